@@ -0,0 +1,91 @@
+// Measures the cost of checksums: the throughput of CRC32C itself and the load
+// time of an archive with and without checksum verification, for many small
+// objects and a few large arrays. The buffer isn't used, so every object is
+// read from the archive's file.
+
+#include "object_archive.hpp"
+
+#include <boost/serialization/vector.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+void run_crc(char const* name, uint32_t (*crc)(void const*, size_t, uint32_t),
+    std::string const& data) {
+  size_t repetitions = 20;
+  uint32_t value = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < repetitions; i++)
+    value = crc(data.data(), data.size(), value);
+  double time = seconds_since(start);
+
+  printf("%-10s %10.1f MB/s (%08x)\n", name,
+      repetitions * data.size() / 1e6 / time, value);
+}
+
+// Loads every object without verification and with it, keeping the best of a
+// few runs.
+template <class T>
+void run_load(char const* workload, std::vector<T> const& objects,
+    size_t object_size) {
+  ObjectArchive<size_t> ar;
+  ar.set_contiguous_arrays(true);
+  ar.set_checksums(true);
+  for (size_t i = 0; i < objects.size(); i++)
+    ar.insert(i, objects[i]);
+
+  T val;
+  double times[2] = { 1e100, 1e100 };
+  ObjectArchive<size_t>::ChecksumVerification verifications[2] =
+    { ObjectArchive<size_t>::verify_none,
+      ObjectArchive<size_t>::verify_file_reads };
+  for (int run = 0; run < 3; run++)
+    for (int v = 0; v < 2; v++) {
+      ar.set_checksum_verification(verifications[v]);
+      auto start = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < objects.size(); i++)
+        ar.load(i, val);
+      times[v] = std::min(times[v], seconds_since(start));
+    }
+
+  double total_mb = objects.size() * object_size / 1e6;
+  printf("%-6s %12.1f %12.1f %9.2f%%\n", workload, total_mb / times[0],
+      total_mb / times[1], 100 * (times[1] - times[0]) / times[0]);
+}
+
+int main() {
+  std::mt19937 generator(0);
+  std::uniform_int_distribution<int> distribution('a', 'z');
+
+  std::string data(1 << 24, ' ');
+  for (auto& it : data)
+    it = distribution(generator);
+
+  printf("%-10s %15s\n", "crc32c", "throughput");
+  if (CRC32C::hardware_available())
+    run_crc("hardware", CRC32C::compute, data);
+  run_crc("software", CRC32C::compute_software, data);
+
+  std::vector<std::string> small(20000);
+  for (auto& it : small)
+    it = data.substr(distribution(generator) * 1000, 256);
+
+  std::vector<std::vector<double>> large(4,
+      std::vector<double>(1 << 22));
+  for (auto& object : large)
+    for (auto& it : object)
+      it = distribution(generator) / 100.;
+
+  printf("\n%-6s %12s %12s %10s\n", "data", "no MB/s", "verify MB/s",
+      "overhead");
+  run_load("small", small, 256);
+  run_load("large", large, (1 << 22) * sizeof(double));
+
+  return 0;
+}
@@ -0,0 +1,106 @@
+// Compares the loads of many small objects in random order one at a time
+// through pread, in batches through pread and in batches through io_uring,
+// reporting the IOPS and the latency of each object or batch. The archive's
+// pages are dropped from the system's cache before each run, so the objects are
+// read from the device where the system allows it.
+
+#include "object_archive.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+#if BOOST_OS_LINUX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+void drop_cache(std::string const& filename) {
+#if BOOST_OS_LINUX
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+  }
+#endif
+}
+
+// Prints the IOPS and the mean and 99th percentile of the latencies, which are
+// of batches with batch objects each.
+void report(char const* name, size_t batch, std::vector<double>& latencies) {
+  double total = 0;
+  for (double latency : latencies)
+    total += latency;
+  std::sort(latencies.begin(), latencies.end());
+
+  printf("%-18s %6zu %12.0f %12.1f %12.1f\n", name, batch,
+      latencies.size() * batch / total, 1e6 * total / latencies.size(),
+      1e6 * latencies[latencies.size() * 99 / 100]);
+}
+
+int main() {
+  size_t n_objects = 50000, object_size = 4096;
+  std::string filename = boost::filesystem::temp_directory_path().string() +
+    "/" + boost::filesystem::unique_path().string();
+
+  std::mt19937 generator(0);
+  std::uniform_int_distribution<int> distribution(0, 255);
+
+  std::vector<size_t> keys(n_objects);
+  {
+    ObjectArchive<size_t> ar;
+    ar.init(filename);
+    std::string data(object_size, 0);
+    for (size_t i = 0; i < n_objects; i++) {
+      for (auto& it : data)
+        it = distribution(generator);
+      ar.insert_raw(i, data);
+      keys[i] = i;
+    }
+  }
+  std::shuffle(keys.begin(), keys.end(), generator);
+
+  ObjectArchive<size_t> ar;
+  ar.init(filename);
+
+  printf("%-18s %6s %12s %12s %12s\n", "path", "batch", "IOPS",
+      "mean (us)", "p99 (us)");
+
+  {
+    drop_cache(filename);
+    std::vector<double> latencies;
+    std::string val;
+    for (size_t key : keys) {
+      auto start = std::chrono::steady_clock::now();
+      ar.load_raw(key, val, false);
+      latencies.push_back(seconds_since(start));
+    }
+    report("pread", 1, latencies);
+  }
+
+  for (unsigned int depth : { 0, 32 }) {
+    ar.set_io_uring(depth);
+    for (size_t batch : { 16, 256 }) {
+      drop_cache(filename);
+      std::vector<double> latencies;
+      std::vector<std::string> vals;
+      for (size_t i = 0; i + batch <= keys.size(); i += batch) {
+        std::vector<size_t> batch_keys(keys.begin() + i,
+            keys.begin() + i + batch);
+        auto start = std::chrono::steady_clock::now();
+        ar.load_raw_many(batch_keys, vals, false);
+        latencies.push_back(seconds_since(start));
+      }
+      report(depth ? "io_uring (32)" : "pread sorted", batch, latencies);
+    }
+  }
+
+  boost::filesystem::remove(filename);
+}
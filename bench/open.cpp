@@ -0,0 +1,75 @@
+// Compares the time to open an archive of many small objects and to load a few
+// thousand of them in random order: reading every entry, through the lazy
+// index and from a frozen archive. The files are in the system's cache, so this
+// measures the cost of parsing rather than the device's.
+
+#include "object_archive.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+void report(char const* name, double open_time, double load_time,
+    size_t n_loads) {
+  printf("%-10s %12.1f %12.0f\n", name, 1e3 * open_time, n_loads / load_time);
+}
+
+template <class Archive>
+double load_keys(Archive& ar, std::vector<size_t> const& keys) {
+  std::string val;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t key : keys)
+    ar.load_raw(key, val);
+  return seconds_since(start);
+}
+
+int main() {
+  size_t n_objects = 1000000, n_loads = 10000;
+  std::string filename = boost::filesystem::temp_directory_path().string() +
+    "/" + boost::filesystem::unique_path().string();
+  std::string frozen = filename + ".frozen";
+
+  {
+    ObjectArchive<size_t> ar;
+    ar.init(filename);
+    ar.set_lazy_index(true);
+    for (size_t i = 0; i < n_objects; i++)
+      ar.insert_raw(i, std::to_string(i * i));
+    ar.flush();
+    ar.freeze(frozen);
+  }
+
+  std::mt19937 generator(0);
+  std::uniform_int_distribution<size_t> distribution(0, n_objects - 1);
+  std::vector<size_t> keys(n_loads);
+  for (auto& key : keys)
+    key = distribution(generator);
+
+  printf("%-10s %12s %12s\n", "archive", "open (ms)", "loads/s");
+
+  for (bool lazy : { false, true }) {
+    ObjectArchive<size_t> ar;
+    ar.set_lazy_index(lazy);
+    auto start = std::chrono::steady_clock::now();
+    ar.init(filename);
+    double open_time = seconds_since(start);
+    report(lazy ? "lazy" : "full", open_time, load_keys(ar, keys), n_loads);
+  }
+
+  {
+    FrozenArchive<size_t> ar;
+    auto start = std::chrono::steady_clock::now();
+    ar.open(frozen);
+    double open_time = seconds_since(start);
+    report("frozen", open_time, load_keys(ar, keys), n_loads);
+  }
+
+  boost::filesystem::remove(filename);
+  boost::filesystem::remove(filename + ".index");
+  boost::filesystem::remove(frozen);
+}
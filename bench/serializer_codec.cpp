@@ -0,0 +1,128 @@
+// Measures the insertion and load throughput of every combination of
+// serializer and codec, for many small objects and a few large ones. The
+// buffer isn't used, so every object goes through the archive's file.
+
+#include "object_archive.hpp"
+
+#include <boost/serialization/vector.hpp>
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+struct SmallObject {
+  size_t id;
+  double tolerance;
+  std::string solver;
+  std::vector<double> parameters;
+
+  template<class Archive>
+  void serialize(Archive& ar, const unsigned int version) {
+    ar & id;
+    ar & tolerance;
+    ar & solver;
+    ar & parameters;
+  }
+};
+
+typedef std::vector<double> LargeObject;
+
+// The raw serializer needs objects already serialized by the user.
+template <class Serializer, class T>
+struct Payload {
+  static T const& get(T const& val) { return val; }
+};
+
+template <class T>
+struct Payload<RawSerializer, T> {
+  static std::string get(T const& val) {
+    std::stringstream stream;
+    BinarySerializer::save(stream, val);
+    return stream.str();
+  }
+};
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+template <class Serializer, class T>
+void run(char const* serializer, char const* codec, char const* workload,
+    std::vector<T> const& objects, size_t object_size) {
+  typedef decltype(Payload<Serializer, T>::get(objects[0])) payload_type;
+  typename std::decay<payload_type>::type val;
+
+  ObjectArchive<size_t, Serializer> ar;
+
+  std::string codec_name(codec);
+  if (codec_name == "dictionary") {
+    // The samples use other keys, so they don't affect the measurements.
+    for (size_t i = 0; i < objects.size() && i < 1000; i++)
+      ar.insert(objects.size() + i, Payload<Serializer, T>::get(objects[i]));
+    ar.train_dictionary();
+  }
+  else if (codec_name == "chunked")
+    ar.set_chunked_compression(1 << 20);
+
+  size_t stored_size = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < objects.size(); i++)
+    stored_size += ar.insert(i, Payload<Serializer, T>::get(objects[i]));
+  double insert_time = seconds_since(start);
+
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < objects.size(); i++)
+    ar.load(i, val);
+  double load_time = seconds_since(start);
+
+  double total_mb = objects.size() * object_size / 1e6;
+  printf("%-10s %-11s %-6s %10.1f %10.1f %12zu\n", serializer, codec, workload,
+      total_mb / insert_time, total_mb / load_time, stored_size);
+}
+
+template <class Serializer, class T>
+void run_codecs(char const* serializer, char const* workload,
+    std::vector<T> const& objects, size_t object_size) {
+  run<Serializer>(serializer, "zlib", workload, objects, object_size);
+  run<Serializer>(serializer, "dictionary", workload, objects, object_size);
+  run<Serializer>(serializer, "chunked", workload, objects, object_size);
+}
+
+template <class T>
+void run_all(char const* workload, std::vector<T> const& objects,
+    size_t object_size) {
+  run_codecs<BoostSerializer>("boost", workload, objects, object_size);
+  run_codecs<HeaderlessBoostSerializer>("headerless", workload, objects,
+      object_size);
+  run_codecs<BinarySerializer>("binary", workload, objects, object_size);
+  run_codecs<RawSerializer>("raw", workload, objects, object_size);
+}
+
+int main() {
+  std::mt19937 generator(0);
+  std::uniform_real_distribution<double> distribution(0, 1);
+
+  std::vector<SmallObject> small(20000);
+  for (size_t i = 0; i < small.size(); i++) {
+    small[i].id = i;
+    small[i].tolerance = 1e-9;
+    small[i].solver = i % 2 ? "conjugate_gradient" : "gmres";
+    small[i].parameters.resize(8);
+    for (auto& it : small[i].parameters)
+      it = (size_t)(distribution(generator) * 100) / 100.;
+  }
+  size_t small_size = sizeof(size_t) + sizeof(double) + 18 + 8 * sizeof(double);
+
+  std::vector<LargeObject> large(4, LargeObject(1 << 22));
+  for (auto& object : large)
+    for (auto& it : object)
+      it = (size_t)(distribution(generator) * 1000) / 1000.;
+  size_t large_size = (1 << 22) * sizeof(double);
+
+  printf("%-10s %-11s %-6s %10s %10s %12s\n", "serial.", "codec", "data",
+      "ins. MB/s", "load MB/s", "stored");
+  run_all("small", small, small_size);
+  run_all("large", large, large_size);
+
+  return 0;
+}
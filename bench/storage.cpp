@@ -0,0 +1,91 @@
+// Compares the storage backends on their own, without the archive: the
+// throughput of appending many 4 KiB records and syncing them, and the IOPS of
+// reading them in random order one at a time and in batches of 256. The records
+// are read from the system's cache, so this measures the cost of each backend
+// rather than the device's.
+
+#include "direct_file.hpp"
+#include "storage.hpp"
+
+#include <algorithm>
+#include <boost/filesystem.hpp>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <random>
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+void run(char const* name, Storage& storage, std::string const& filename) {
+  size_t n_records = 20000, record_size = 4096, batch = 256;
+  if (!storage.open(filename, true)) {
+    printf("%-10s unsupported\n", name);
+    return;
+  }
+
+  std::mt19937 generator(0);
+  std::string record(record_size, 0);
+  for (auto& it : record)
+    it = generator();
+
+  std::vector<size_t> positions(n_records);
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n_records; i++)
+    storage.append(record.data(), record_size, positions[i]);
+  storage.sync();
+  double write_time = seconds_since(start);
+
+  std::shuffle(positions.begin(), positions.end(), generator);
+
+  start = std::chrono::steady_clock::now();
+  for (size_t position : positions)
+    storage.read(position, &record[0], record_size);
+  double read_time = seconds_since(start);
+
+  std::string data(batch * record_size, 0);
+  std::vector<Storage::Range> ranges(batch);
+  start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i + batch <= n_records; i += batch) {
+    for (size_t j = 0; j < batch; j++) {
+      Storage::Range range = { positions[i + j], &data[j * record_size],
+        record_size, false };
+      ranges[j] = range;
+    }
+    storage.read_many(ranges);
+  }
+  double batch_time = seconds_since(start);
+
+  printf("%-10s %12.1f %12.0f %12.0f\n", name,
+      n_records * record_size / 1e6 / write_time, n_records / read_time,
+      n_records / batch * batch / batch_time);
+
+  storage.close();
+}
+
+int main() {
+  std::string filename = boost::filesystem::temp_directory_path().string() +
+    "/" + boost::filesystem::unique_path().string();
+
+  printf("%-10s %12s %12s %12s\n", "storage", "write (MB/s)", "read IOPS",
+      "batch IOPS");
+
+  FileStorage file;
+  run("file", file, filename);
+
+  MmapStorage mmap;
+  run("mmap", mmap, filename);
+
+  IoUringStorage io_uring(32);
+  run("io_uring", io_uring, filename);
+
+  DirectFile direct;
+  run("direct", direct, filename);
+
+  MemoryStorage memory;
+  run("memory", memory, filename);
+
+  boost::filesystem::remove(filename);
+}
@@ -0,0 +1,119 @@
+// This file defines the format used by an ObjectArchive to store contiguous
+// arrays of arithmetic types, such as std::vector<double>, without going
+// through the serializer or compression. The elements are copied as a single
+// block after a small header:
+// 1) Array magic (uint64_t), whose first byte is never the first one of a
+//    zlib stream or of chunked data;
+// 2) Element type (uint64_t), holding its size and whether it's floating
+//    point, signed or unsigned;
+// 3) Number of elements (uint64_t);
+// 4) Reserved (uint64_t), so that the elements are aligned to 32 bytes from
+//    the beginning of the record;
+// 5) Elements.
+//
+// Loading an array into a vector of another element type throws an
+// archive_exception, as boost would do for incompatible native formats.
+
+#ifndef __ARRAY_RECORD_HPP__
+#define __ARRAY_RECORD_HPP__
+
+#include <boost/archive/archive_exception.hpp>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+class ArrayRecord {
+  public:
+    // Checks if objects of type T can be stored as arrays.
+    template <class T>
+    struct is_supported: std::false_type { };
+
+    template <class T, class A>
+    struct is_supported<std::vector<T, A>>:
+      std::integral_constant<bool, std::is_arithmetic<T>::value &&
+                                   !std::is_same<T, bool>::value> { };
+
+    static size_t header_size() { return 4 * sizeof(uint64_t); }
+
+    // Builds the record for the array.
+    template <class V>
+    static std::string encode(V const& val);
+
+    // Checks if the header, with at least header_size() bytes from the
+    // beginning of the record, belongs to an array.
+    static bool is_array(std::string const& header);
+
+    // Gets the number of elements from the header, checking that they have the
+    // type of the vector's elements.
+    template <class V>
+    static size_t count(std::string const& header);
+
+    // Copies the elements of the record to the vector.
+    template <class V>
+    static void decode(std::string const& record, V& val);
+
+  private:
+    // First bytes of arrays: "\xfeARRAY" in little endian.
+    static uint64_t array_magic() { return 0x5941525241fe; }
+
+    template <class T>
+    static uint64_t element_type() {
+      uint64_t kind = std::is_floating_point<T>::value ? 2 :
+                      std::is_signed<T>::value ? 1 : 0;
+      return sizeof(T) | (kind << 32);
+    }
+
+    static uint64_t read_uint64(std::string const& data, size_t position) {
+      uint64_t value;
+      memcpy(&value, &data[position], sizeof(uint64_t));
+      return value;
+    }
+};
+
+template <class V>
+std::string ArrayRecord::encode(V const& val) {
+  typedef typename V::value_type T;
+
+  uint64_t header[4] = { array_magic(), element_type<T>(), val.size(), 0 };
+  size_t data_size = val.size() * sizeof(T);
+
+  std::string record;
+  record.resize(header_size() + data_size);
+  memcpy(&record[0], header, header_size());
+  if (data_size)
+    memcpy(&record[header_size()], val.data(), data_size);
+
+  return record;
+}
+
+inline bool ArrayRecord::is_array(std::string const& header) {
+  return header.size() >= header_size() &&
+    read_uint64(header, 0) == array_magic();
+}
+
+template <class V>
+size_t ArrayRecord::count(std::string const& header) {
+  if (read_uint64(header, sizeof(uint64_t)) !=
+      element_type<typename V::value_type>())
+    throw boost::archive::archive_exception(
+        boost::archive::archive_exception::incompatible_native_format);
+
+  return read_uint64(header, 2 * sizeof(uint64_t));
+}
+
+template <class V>
+void ArrayRecord::decode(std::string const& record, V& val) {
+  size_t n = count<V>(record);
+  size_t data_size = n * sizeof(typename V::value_type);
+  if (record.size() < header_size() + data_size)
+    throw boost::archive::archive_exception(
+        boost::archive::archive_exception::input_stream_error);
+
+  val.resize(n);
+  if (data_size)
+    memcpy(&val[0], &record[header_size()], data_size);
+}
+
+#endif
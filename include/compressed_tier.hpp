@@ -0,0 +1,142 @@
+// This file defines the compressed tier used by an ObjectArchive to keep the
+// objects evicted from its buffer in memory, so that loading them again doesn't
+// read the file.
+//
+// Each object is compressed again with a strong zlib level, which pays off for
+// data stored without compression, such as arrays and objects packed in
+// blocks. Objects that don't get smaller are kept as they are. The tier has its
+// own maximum size, counted after compression, and removes the least recently
+// used objects when it's full. As their data is also in the file, nothing is
+// lost.
+
+#ifndef __COMPRESSED_TIER_HPP__
+#define __COMPRESSED_TIER_HPP__
+
+#include <list>
+#include <string>
+#include <unordered_map>
+
+#include "zlib_codec.hpp"
+
+template <class Key>
+class CompressedTier {
+  public:
+    CompressedTier(): max_size_(0), size_(0), level_(Z_BEST_COMPRESSION),
+      hits_(0), misses_(0) { }
+
+    // Stores a copy of the data, removing the least recently used objects if
+    // the tier is too large. Data larger than the tier alone isn't stored.
+    void insert(Key const& key, std::string const& data);
+
+    // Gets the key's data, if it's in the tier.
+    bool find(Key const& key, std::string& data);
+
+    bool contains(Key const& key) const { return items_.count(key) > 0; }
+
+    void erase(Key const& key);
+
+    void clear();
+
+    // Changes the maximum size and the zlib level used for new objects. A size
+    // of 0 disables the tier.
+    void set_max_size(size_t max_size, int level);
+
+    size_t max_size() const { return max_size_; }
+    size_t size() const { return size_; }
+
+    // Number of find() calls that found the key or didn't.
+    size_t hits() const { return hits_; }
+    size_t misses() const { return misses_; }
+
+  private:
+    struct Item {
+      Key key;
+      std::string data;
+      bool compressed;
+    };
+
+    typedef std::list<Item> item_list;
+
+    void shrink(size_t max_size);
+
+    item_list LRU_; // Most recent objects are on the front
+    std::unordered_map<Key, typename item_list::iterator> items_;
+    size_t max_size_, size_;
+    int level_;
+    size_t hits_, misses_;
+};
+
+template <class Key>
+void CompressedTier<Key>::insert(Key const& key, std::string const& data) {
+  erase(key);
+  if (data.size() == 0 || max_size_ == 0)
+    return;
+
+  Item item = { key, ZlibCodec::compress(data, nullptr, level_), true };
+  if (item.data.size() >= data.size()) {
+    item.data = data;
+    item.compressed = false;
+  }
+
+  if (item.data.size() > max_size_)
+    return;
+
+  shrink(max_size_ - item.data.size());
+  size_ += item.data.size();
+  LRU_.push_front(std::move(item));
+  items_[key] = LRU_.begin();
+}
+
+template <class Key>
+bool CompressedTier<Key>::find(Key const& key, std::string& data) {
+  auto it = items_.find(key);
+  if (it == items_.end()) {
+    misses_++;
+    return false;
+  }
+
+  hits_++;
+  LRU_.splice(LRU_.begin(), LRU_, it->second);
+  Item const& item = *it->second;
+  if (item.compressed)
+    data = ZlibCodec::decompress(item.data);
+  else
+    data = item.data;
+  return true;
+}
+
+template <class Key>
+void CompressedTier<Key>::erase(Key const& key) {
+  auto it = items_.find(key);
+  if (it == items_.end())
+    return;
+
+  size_ -= it->second->data.size();
+  LRU_.erase(it->second);
+  items_.erase(it);
+}
+
+template <class Key>
+void CompressedTier<Key>::clear() {
+  LRU_.clear();
+  items_.clear();
+  size_ = 0;
+}
+
+template <class Key>
+void CompressedTier<Key>::set_max_size(size_t max_size, int level) {
+  max_size_ = max_size;
+  level_ = level;
+  shrink(max_size);
+}
+
+template <class Key>
+void CompressedTier<Key>::shrink(size_t max_size) {
+  while (size_ > max_size && !LRU_.empty()) {
+    size_ -= LRU_.back().data.size();
+    items_.erase(LRU_.back().key);
+    LRU_.pop_back();
+  }
+}
+
+#endif
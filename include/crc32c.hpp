@@ -0,0 +1,200 @@
+// This file defines the CRC32C (Castagnoli) checksum used by the archive to
+// detect corrupted records.
+//
+// On x86-64 processors with SSE4.2 the checksum is computed by the crc32
+// instruction, which is detected at runtime, so the binary doesn't require it.
+// As the instruction's latency is larger than its throughput, large buffers are
+// split in three streams processed together, whose checksums are combined with
+// a table. Otherwise, a table-based software implementation processing 8 bytes
+// at a time is used. Both produce the same values.
+//
+// Checksums can be extended, so that
+// CRC32C::compute(b, size_b, CRC32C::compute(a, size_a))
+// is the checksum of a followed by b.
+
+#ifndef __CRC32C_HPP__
+#define __CRC32C_HPP__
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define CRC32C_X86 1
+#include <nmmintrin.h>
+#endif
+
+// Thrown when the data read doesn't match its checksum.
+class ChecksumError: public std::runtime_error {
+  public:
+    explicit ChecksumError(std::string const& what):
+      std::runtime_error(what) { }
+};
+
+class CRC32C {
+  public:
+    // Extends the checksum crc with the data.
+    static uint32_t compute(void const* data, size_t size, uint32_t crc = 0);
+
+    // Same as compute(), but never uses the hardware.
+    static uint32_t compute_software(void const* data, size_t size,
+        uint32_t crc = 0);
+
+    // Checks if the hardware implementation is used.
+    static bool hardware_available();
+
+  private:
+    // Tables for slicing-by-8, built on first use.
+    static uint32_t const (&table())[8][256];
+
+#if CRC32C_X86
+    // Size of each of the three streams processed together.
+    static size_t stream_size() { return 4096; }
+
+    __attribute__((target("sse4.2")))
+    static uint32_t compute_sse42(void const* data, size_t size, uint32_t crc);
+
+    // Table to shift an intermediate checksum over stream_size() zero bytes.
+    __attribute__((target("sse4.2")))
+    static uint32_t const (&shift_table())[4][256];
+
+    static uint32_t shift(uint32_t crc, uint32_t const (&table)[4][256]) {
+      return table[0][crc & 0xff] ^ table[1][(crc >> 8) & 0xff] ^
+        table[2][(crc >> 16) & 0xff] ^ table[3][crc >> 24];
+    }
+#endif
+};
+
+inline uint32_t CRC32C::compute(void const* data, size_t size, uint32_t crc) {
+#if CRC32C_X86
+  if (hardware_available())
+    return compute_sse42(data, size, crc);
+#endif
+  return compute_software(data, size, crc);
+}
+
+inline bool CRC32C::hardware_available() {
+#if CRC32C_X86
+  static bool const available = __builtin_cpu_supports("sse4.2");
+  return available;
+#else
+  return false;
+#endif
+}
+
+inline uint32_t const (&CRC32C::table())[8][256] {
+  struct Tables {
+    uint32_t values[8][256];
+
+    Tables() {
+      for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++)
+          crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+        values[0][i] = crc;
+      }
+      for (uint32_t i = 0; i < 256; i++)
+        for (int k = 1; k < 8; k++)
+          values[k][i] = (values[k-1][i] >> 8) ^
+            values[0][values[k-1][i] & 0xff];
+    }
+  };
+
+  static Tables const tables;
+  return tables.values;
+}
+
+inline uint32_t CRC32C::compute_software(void const* data, size_t size,
+    uint32_t crc) {
+  uint32_t const (&t)[8][256] = table();
+  unsigned char const* p = (unsigned char const*)data;
+  crc = ~crc;
+
+  for (; size >= 8; size -= 8, p += 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    word ^= crc;
+    crc = t[7][word & 0xff] ^ t[6][(word >> 8) & 0xff] ^
+      t[5][(word >> 16) & 0xff] ^ t[4][(word >> 24) & 0xff] ^
+      t[3][(word >> 32) & 0xff] ^ t[2][(word >> 40) & 0xff] ^
+      t[1][(word >> 48) & 0xff] ^ t[0][word >> 56];
+  }
+  for (; size > 0; size--, p++)
+    crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xff];
+
+  return ~crc;
+}
+
+#if CRC32C_X86
+__attribute__((target("sse4.2")))
+inline uint32_t CRC32C::compute_sse42(void const* data, size_t size,
+    uint32_t crc) {
+  unsigned char const* p = (unsigned char const*)data;
+  uint64_t crc64 = (uint32_t)~crc;
+
+  size_t length = stream_size();
+  if (size >= 3 * length) {
+    uint32_t const (&table)[4][256] = shift_table();
+
+    // The checksum of a stream started from zero is combined with the one
+    // before it by shifting the latter over the stream's length.
+    for (; size >= 3 * length; size -= 3 * length, p += 3 * length) {
+      uint64_t crc_b = 0, crc_c = 0;
+      for (size_t i = 0; i < length; i += 8) {
+        uint64_t a, b, c;
+        memcpy(&a, p + i, sizeof(a));
+        memcpy(&b, p + length + i, sizeof(b));
+        memcpy(&c, p + 2 * length + i, sizeof(c));
+        crc64 = _mm_crc32_u64(crc64, a);
+        crc_b = _mm_crc32_u64(crc_b, b);
+        crc_c = _mm_crc32_u64(crc_c, c);
+      }
+      crc64 = shift(shift(crc64, table) ^ crc_b, table) ^ crc_c;
+    }
+  }
+
+  for (; size >= 8; size -= 8, p += 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+
+  uint32_t crc32 = crc64;
+  for (; size > 0; size--, p++)
+    crc32 = _mm_crc32_u8(crc32, *p);
+
+  return ~crc32;
+}
+
+__attribute__((target("sse4.2")))
+inline uint32_t const (&CRC32C::shift_table())[4][256] {
+  struct Table {
+    uint32_t values[4][256];
+
+    __attribute__((target("sse4.2")))
+    Table() {
+      // Shifting is linear, so the image of each bit is enough.
+      uint32_t bits[32];
+      for (int j = 0; j < 32; j++) {
+        uint64_t crc = uint32_t(1) << j;
+        for (size_t i = 0; i < stream_size(); i += 8)
+          crc = _mm_crc32_u64(crc, 0);
+        bits[j] = crc;
+      }
+
+      for (int k = 0; k < 4; k++)
+        for (uint32_t b = 0; b < 256; b++) {
+          values[k][b] = 0;
+          for (int j = 0; j < 8; j++)
+            if (b & (1 << j))
+              values[k][b] ^= bits[8 * k + j];
+        }
+    }
+  };
+
+  static Table const table;
+  return table.values;
+}
+#endif
+
+#endif
@@ -0,0 +1,186 @@
+// This file defines the binary deltas used by an ObjectArchive to store a new
+// version of an object as its differences from the previous one.
+//
+// The delta is a sequence of operations, each starting with a varint holding
+// the length of the operation and whether it's a copy (lowest bit set) or an
+// insertion. A copy is followed by a varint with the position in the base to
+// copy from, while an insertion is followed by the bytes inserted.
+//
+// Matches are found by indexing the base in blocks and looking for them in
+// every position of the new version with a rolling hash, so data that moved
+// is still copied. Matches are then extended in both directions.
+
+#ifndef __DELTA_CODEC_HPP__
+#define __DELTA_CODEC_HPP__
+
+#include <boost/archive/archive_exception.hpp>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+
+class DeltaCodec {
+  public:
+    // Builds the delta that turns base into target.
+    static std::string encode(std::string const& base,
+        std::string const& target);
+
+    // Applies the delta starting at position begin of the string to base.
+    // Throws an archive_exception if the delta is invalid or the result
+    // doesn't have the expected size.
+    static std::string decode(std::string const& base, std::string const& delta,
+        size_t begin, size_t target_size);
+
+  private:
+    static size_t block_size() { return 64; }
+    static uint64_t multiplier() { return 0x100000001b3; }
+
+    static void write_varint(std::string& out, uint64_t value);
+    static uint64_t read_varint(std::string const& in, size_t& position);
+
+    static void write_insert(std::string& out, char const* data, size_t size);
+    static void write_copy(std::string& out, size_t position, size_t size);
+
+    static void invalid() {
+      throw boost::archive::archive_exception(
+          boost::archive::archive_exception::input_stream_error);
+    }
+};
+
+inline std::string DeltaCodec::encode(std::string const& base,
+    std::string const& target) {
+  size_t block = block_size();
+  std::string delta;
+  if (base.size() < block || target.size() < block) {
+    write_insert(delta, target.data(), target.size());
+    return delta;
+  }
+
+  unsigned char const* b = (unsigned char const*)base.data();
+  unsigned char const* t = (unsigned char const*)target.data();
+
+  auto hash = [block](unsigned char const* p) {
+    uint64_t h = 0;
+    for (size_t i = 0; i < block; i++)
+      h = h * multiplier() + p[i];
+    return h;
+  };
+
+  // Weight of the byte leaving the window when it rolls.
+  uint64_t leaving = 1;
+  for (size_t i = 1; i < block; i++)
+    leaving *= multiplier();
+
+  std::unordered_map<uint64_t, size_t> blocks;
+  blocks.reserve(base.size() / block);
+  for (size_t i = 0; i + block <= base.size(); i += block)
+    blocks.emplace(hash(b + i), i);
+
+  size_t literal = 0, p = 0;
+  uint64_t h = hash(t);
+  while (p + block <= target.size()) {
+    auto found = blocks.find(h);
+    if (found != blocks.end() &&
+        memcmp(b + found->second, t + p, block) == 0) {
+      size_t base_position = found->second, target_position = p;
+      while (target_position > literal && base_position > 0 &&
+             b[base_position - 1] == t[target_position - 1]) {
+        base_position--;
+        target_position--;
+      }
+
+      size_t length = p + block - target_position;
+      while (base_position + length < base.size() &&
+             target_position + length < target.size() &&
+             b[base_position + length] == t[target_position + length])
+        length++;
+
+      write_insert(delta, target.data() + literal, target_position - literal);
+      write_copy(delta, base_position, length);
+
+      p = literal = target_position + length;
+      if (p + block <= target.size())
+        h = hash(t + p);
+      continue;
+    }
+
+    if (p + block < target.size())
+      h = (h - t[p] * leaving) * multiplier() + t[p + block];
+    p++;
+  }
+
+  write_insert(delta, target.data() + literal, target.size() - literal);
+  return delta;
+}
+
+inline std::string DeltaCodec::decode(std::string const& base,
+    std::string const& delta, size_t begin, size_t target_size) {
+  std::string target;
+  target.reserve(target_size);
+
+  size_t position = begin;
+  while (position < delta.size()) {
+    uint64_t op = read_varint(delta, position);
+    uint64_t length = op >> 1;
+
+    if (op & 1) {
+      uint64_t from = read_varint(delta, position);
+      if (from > base.size() || length > base.size() - from)
+        invalid();
+      target.append(base, from, length);
+    }
+    else {
+      if (length > delta.size() - position)
+        invalid();
+      target.append(delta, position, length);
+      position += length;
+    }
+
+    if (target.size() > target_size)
+      invalid();
+  }
+
+  if (target.size() != target_size)
+    invalid();
+
+  return target;
+}
+
+inline void DeltaCodec::write_varint(std::string& out, uint64_t value) {
+  while (value >= 0x80) {
+    out += char(value | 0x80);
+    value >>= 7;
+  }
+  out += char(value);
+}
+
+inline uint64_t DeltaCodec::read_varint(std::string const& in,
+    size_t& position) {
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (position >= in.size())
+      invalid();
+    unsigned char byte = in[position++];
+    value |= uint64_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return value;
+  }
+  invalid();
+  return 0;
+}
+
+inline void DeltaCodec::write_insert(std::string& out, char const* data,
+    size_t size) {
+  if (size == 0)
+    return;
+  write_varint(out, size << 1);
+  out.append(data, size);
+}
+
+inline void DeltaCodec::write_copy(std::string& out, size_t position,
+    size_t size) {
+  write_varint(out, (size << 1) | 1);
+  write_varint(out, position);
+}
+
+#endif
@@ -0,0 +1,214 @@
+// This file defines a file accessed with direct I/O, which bypasses the page
+// cache, so that large objects read or written by an ObjectArchive don't evict
+// other data from memory or are kept twice.
+//
+// Direct I/O requires positions, sizes and memory aligned to the device's
+// blocks, so data is transferred through an aligned buffer. Reads may start
+// anywhere, but writes must start at an aligned position and are padded with
+// zeros up to the next one.
+//
+// Currently only Linux is supported. Elsewhere, or if the file system doesn't
+// support direct I/O, open() fails and the caller must use another storage.
+
+#ifndef __DIRECT_FILE_HPP__
+#define __DIRECT_FILE_HPP__
+
+#include <algorithm>
+#include <boost/predef.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "storage.hpp"
+
+class DirectFile: public Storage {
+  public:
+    DirectFile(): fd_(-1), buffer_(nullptr) { }
+    virtual ~DirectFile() { close(); }
+
+    // Opens the file for reading and writing, creating it if needed. Returns
+    // false if direct I/O can't be used.
+    virtual bool open(std::string const& filename, bool truncate);
+
+    virtual void close();
+
+    virtual bool is_open() const { return fd_ >= 0; }
+
+    // Current size of the file, which is always aligned after writes.
+    virtual size_t size() const;
+
+    virtual bool read(size_t position, char* data, size_t size);
+
+    // Writes the data at an aligned position. Returns false on failure.
+    virtual bool write(size_t position, char const* data, size_t size);
+
+    // Writes the data at the end of the file, which is always aligned.
+    virtual bool append(char const* data, size_t size, size_t& position);
+
+    virtual bool sync();
+
+    virtual bool truncate(size_t size);
+
+    // Alignment required for positions and sizes, which works for any device.
+    static size_t alignment() { return 4096; }
+
+    // Rounds the value up to a multiple of the alignment.
+    static size_t align(size_t value) {
+      return (value + alignment() - 1) & ~(alignment() - 1);
+    }
+
+  private:
+    // Not implemented
+    DirectFile(DirectFile const& other);
+    DirectFile const& operator=(DirectFile const& other);
+
+    // Size of the buffer used for each transfer.
+    static size_t buffer_size() { return 1 << 20; }
+
+    int fd_;
+    char* buffer_;
+};
+
+inline bool DirectFile::open(std::string const& filename, bool truncate) {
+  close();
+
+#if BOOST_OS_LINUX && defined(O_DIRECT)
+  void* buffer;
+  if (posix_memalign(&buffer, alignment(), buffer_size()) != 0)
+    return false;
+  buffer_ = (char*)buffer;
+
+  fd_ = ::open(filename.c_str(),
+      O_RDWR | O_CREAT | O_DIRECT | (truncate ? O_TRUNC : 0), 0644);
+  if (fd_ < 0) {
+    close();
+    return false;
+  }
+
+  return true;
+#else
+  (void)filename;
+  (void)truncate;
+  return false;
+#endif
+}
+
+inline void DirectFile::close() {
+#if BOOST_OS_LINUX
+  if (fd_ >= 0)
+    ::close(fd_);
+#endif
+  fd_ = -1;
+
+  free(buffer_);
+  buffer_ = nullptr;
+}
+
+inline size_t DirectFile::size() const {
+#if BOOST_OS_LINUX
+  struct stat info;
+  if (fd_ >= 0 && fstat(fd_, &info) == 0)
+    return info.st_size;
+#endif
+  return 0;
+}
+
+inline bool DirectFile::read(size_t position, char* data, size_t size) {
+#if BOOST_OS_LINUX
+  while (size > 0) {
+    size_t begin = position & ~(alignment() - 1);
+    size_t offset = position - begin;
+    size_t length = std::min(buffer_size(), align(offset + size));
+
+    // Interrupted and short reads are continued until the end of the file.
+    // Direct reads must start aligned, and a short read that isn't aligned
+    // has reached the end of the file.
+    size_t n = 0;
+    while (n < length) {
+      ssize_t read = pread(fd_, buffer_ + n, length - n, begin + n);
+      if (read < 0 && errno == EINTR)
+        continue;
+      if (read <= 0)
+        break;
+      n += read;
+      if (n % alignment() != 0)
+        break;
+    }
+    if (n <= offset)
+      return false;
+
+    size_t copied = std::min(size, n - offset);
+    memcpy(data, buffer_ + offset, copied);
+    data += copied;
+    position += copied;
+    size -= copied;
+  }
+
+  return true;
+#else
+  (void)position;
+  (void)data;
+  return size == 0;
+#endif
+}
+
+inline bool DirectFile::write(size_t position, char const* data, size_t size) {
+#if BOOST_OS_LINUX
+  while (size > 0) {
+    size_t n = std::min(size, buffer_size());
+    size_t length = align(n);
+    memcpy(buffer_, data, n);
+    memset(buffer_ + n, 0, length - n);
+
+    // Short writes are continued from the last aligned position written,
+    // as direct writes must start aligned.
+    for (size_t done = 0; done < length;) {
+      ssize_t written = pwrite(fd_, buffer_ + done, length - done,
+          position + done);
+      if (written < 0 && errno == EINTR)
+        continue;
+      size_t next = (done + std::max<ssize_t>(written, 0)) &
+        ~(alignment() - 1);
+      if (next == done)
+        return false;
+      done = next;
+    }
+
+    data += n;
+    position += length;
+    size -= n;
+  }
+
+  return true;
+#else
+  (void)position;
+  (void)data;
+  return size == 0;
+#endif
+}
+
+inline bool DirectFile::append(char const* data, size_t size,
+    size_t& position) {
+  position = align(this->size());
+  return write(position, data, size);
+}
+
+inline bool DirectFile::sync() {
+#if BOOST_OS_LINUX
+  return fd_ >= 0 && fsync(fd_) == 0;
+#else
+  return false;
+#endif
+}
+
+inline bool DirectFile::truncate(size_t size) {
+#if BOOST_OS_LINUX
+  return fd_ >= 0 && ftruncate(fd_, align(size)) == 0;
+#else
+  (void)size;
+  return false;
+#endif
+}
+
+#endif
@@ -0,0 +1,335 @@
+// This file defines a read-only archive written by ObjectArchive::freeze(),
+// for data that is written once and then only read, possibly by many
+// processes at the same time.
+//
+// The file is mapped in memory and never parsed, so opening it takes the same
+// time for any number of objects and the system's cache holds a single copy
+// shared by every process. Keys are found through a minimal perfect hash (see
+// minimal_perfect_hash.hpp), whose pilots and table of positions are in the
+// file, so that a lookup computes the key's position and reads its record.
+//
+// The file has the following sections, all in the machine's byte order:
+// 1) magic, version, number of objects, seed of the keys' hashes and size of
+//    the header, 8 bytes each;
+// 2) header, with the serializer's version and the compression dictionaries,
+//    padded to 8 bytes;
+// 3) pilots of the hash and position of each object's record, 8 bytes each;
+// 4) records, with the sizes of the serialized key and data, 8 bytes each,
+//    followed by them. Records that fit in a page don't cross pages and larger
+//    ones start at a page, so a small object is read with a single page.
+//
+// Keys are compared after their serialized forms, so the archive must be read
+// with the same serializer that wrote it, as with ObjectArchive.
+
+#ifndef __FROZEN_ARCHIVE_HPP__
+#define __FROZEN_ARCHIVE_HPP__
+
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "minimal_perfect_hash.hpp"
+#include "object_archive.hpp"
+
+template <class Key, class Serializer = BoostSerializer>
+class FrozenArchive {
+  public:
+    FrozenArchive(): map_((char*)MAP_FAILED), map_size_(0), n_objects_(0),
+      seed_(0), pilots_(nullptr), positions_(nullptr) { }
+    ~FrozenArchive() { close(); }
+
+    // Maps the file. Throws an archive_exception if it can't be read, isn't a
+    // frozen archive or was written with another serializer.
+    void open(std::string const& filename);
+
+    void close();
+
+    // Number of objects in the archive.
+    size_t size() const { return n_objects_; }
+
+    bool is_available(Key const& key) const;
+
+    // Finds the serialized data of an object, which is in the map until the
+    // archive is closed. Returns nullptr if the key isn't in the archive.
+    char const* find(Key const& key, size_t& size) const;
+
+    // Same as ObjectArchive's load() and load_raw(), returning 0 if the key
+    // isn't in the archive.
+    template <class T>
+    size_t load(Key const& key, T& obj) const;
+    size_t load_raw(Key const& key, std::string& data) const;
+
+    // Writes a frozen archive with the given serialized keys, whose data is
+    // provided by read_data, and compression dictionaries.
+    static void write(std::string const& filename,
+        ZlibCodec::dictionary_map const& dictionaries,
+        std::vector<std::string> const& keys,
+        std::function<void(size_t, std::string&)> const& read_data);
+
+  private:
+    // Value found at the beginning of frozen archives.
+    static uint64_t magic() { return 0x4e5a4f52464a424f; } // "OBJFROZN"
+    static uint64_t version() { return 1; }
+    static size_t page_size() { return 4096; }
+
+    struct Header {
+      unsigned int serializer_version;
+      ZlibCodec::dictionary_map dictionaries;
+
+      template<class Archive>
+      void serialize(Archive& ar, const unsigned int) {
+        ar & serializer_version;
+        ar & dictionaries;
+      }
+    };
+
+    // Same as ObjectArchive's decode().
+    template <class T>
+    void decode(std::string const& str, T& val) const;
+    template <class T>
+    void decode(std::string const& str, T& val, std::true_type) const;
+    template <class T>
+    void decode(std::string const& str, T& val, std::false_type) const;
+
+    char* map_;
+    size_t map_size_;
+    uint64_t n_objects_, seed_;
+    uint64_t const* pilots_; // Both in the map
+    uint64_t const* positions_;
+    ZlibCodec::dictionary_map dictionaries_;
+
+    // Not implemented
+    FrozenArchive(FrozenArchive const& other);
+    FrozenArchive const& operator=(FrozenArchive const& other);
+};
+
+template <class Key, class Serializer>
+void FrozenArchive<Key, Serializer>::open(std::string const& filename) {
+  close();
+
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  struct stat info;
+  if (fd >= 0 && fstat(fd, &info) == 0 && info.st_size > 0) {
+    map_ = (char*)mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map_ != MAP_FAILED)
+      map_size_ = info.st_size;
+  }
+  if (fd >= 0)
+    ::close(fd);
+
+  uint64_t fields[5];
+  if (map_size_ < sizeof(fields)) {
+    close();
+    throw boost::archive::archive_exception(
+        boost::archive::archive_exception::input_stream_error);
+  }
+  memcpy(fields, map_, sizeof(fields));
+
+  if (fields[0] != magic() || fields[1] != version()) {
+    close();
+    throw boost::archive::archive_exception(
+        boost::archive::archive_exception::invalid_signature);
+  }
+
+  // The sections must fit in the file.
+  uint64_t n_objects = fields[2], header_size = fields[4];
+  uint64_t pilots_begin = (sizeof(fields) + header_size + 7) / 8 * 8;
+  uint64_t positions_begin = pilots_begin +
+    MinimalPerfectHash::bucket_count(n_objects) * sizeof(uint64_t);
+  if (header_size > map_size_ || n_objects > map_size_ ||
+      positions_begin + n_objects * sizeof(uint64_t) > map_size_) {
+    close();
+    throw boost::archive::archive_exception(
+        boost::archive::archive_exception::input_stream_error);
+  }
+
+  // As in ObjectArchive, the header doesn't depend on the serializer.
+  Header header;
+  ObjectArchive<Key>::deserialize(std::string(map_ + sizeof(fields),
+        header_size), header);
+  if (header.serializer_version != Serializer::format_version()) {
+    close();
+    throw boost::archive::archive_exception(
+        boost::archive::archive_exception::unsupported_version);
+  }
+
+  n_objects_ = n_objects;
+  seed_ = fields[3];
+  pilots_ = (uint64_t const*)(map_ + pilots_begin);
+  positions_ = (uint64_t const*)(map_ + positions_begin);
+  dictionaries_.swap(header.dictionaries);
+}
+
+template <class Key, class Serializer>
+void FrozenArchive<Key, Serializer>::close() {
+  if (map_ != MAP_FAILED)
+    munmap(map_, map_size_);
+  map_ = (char*)MAP_FAILED;
+  map_size_ = 0;
+  n_objects_ = 0;
+  pilots_ = positions_ = nullptr;
+  dictionaries_.clear();
+}
+
+template <class Key, class Serializer>
+bool FrozenArchive<Key, Serializer>::is_available(Key const& key) const {
+  size_t size;
+  return find(key, size) != nullptr;
+}
+
+template <class Key, class Serializer>
+char const* FrozenArchive<Key, Serializer>::find(Key const& key,
+    size_t& size) const {
+  if (n_objects_ == 0)
+    return nullptr;
+
+  std::string key_string = ObjectArchive<Key, Serializer>::serialize(key);
+  uint64_t hash = XXHash64::hash(key_string.data(), key_string.size(), seed_);
+  uint64_t position = positions_[MinimalPerfectHash::position(hash,
+      n_objects_, pilots_)];
+
+  // Keys that aren't in the archive are mapped to another object's record.
+  uint64_t sizes[2];
+  if (position + sizeof(sizes) > map_size_)
+    return nullptr;
+  memcpy(sizes, map_ + position, sizeof(sizes));
+
+  char const* record_key = map_ + position + sizeof(sizes);
+  if (sizes[0] != key_string.size() ||
+      position + sizeof(sizes) + sizes[0] + sizes[1] > map_size_ ||
+      memcmp(record_key, key_string.data(), sizes[0]) != 0)
+    return nullptr;
+
+  size = sizes[1];
+  return record_key + sizes[0];
+}
+
+template <class Key, class Serializer>
+template <class T>
+size_t FrozenArchive<Key, Serializer>::load(Key const& key, T& obj) const {
+  std::string data;
+  size_t ret = load_raw(key, data);
+  if (ret == 0) return 0;
+  decode(data, obj);
+  return ret;
+}
+
+template <class Key, class Serializer>
+size_t FrozenArchive<Key, Serializer>::load_raw(Key const& key,
+    std::string& data) const {
+  size_t size;
+  char const* found = find(key, size);
+  if (!found)
+    return 0;
+
+  data.assign(found, size);
+  return size;
+}
+
+template <class Key, class Serializer>
+void FrozenArchive<Key, Serializer>::write(std::string const& filename,
+    ZlibCodec::dictionary_map const& dictionaries,
+    std::vector<std::string> const& keys,
+    std::function<void(size_t, std::string&)> const& read_data) {
+  // Another seed is tried if the hashes of two keys are the same.
+  MinimalPerfectHash function;
+  std::vector<uint64_t> hashes(keys.size());
+  uint64_t seed = 0;
+  for (;; seed++) {
+    if (seed == 16)
+      throw boost::archive::archive_exception(
+          boost::archive::archive_exception::output_stream_error);
+
+    for (size_t i = 0; i < keys.size(); i++)
+      hashes[i] = XXHash64::hash(keys[i].data(), keys[i].size(), seed);
+    if (function.build(hashes))
+      break;
+  }
+
+  Header header;
+  header.serializer_version = Serializer::format_version();
+  header.dictionaries = dictionaries;
+  std::string header_str = ObjectArchive<Key>::serialize(header);
+
+  FileStorage storage;
+  if (!storage.open(filename, true))
+    throw boost::archive::archive_exception(
+        boost::archive::archive_exception::output_stream_error);
+
+  StorageWriter writer(storage);
+  uint64_t fields[5] = { magic(), version(), keys.size(), seed,
+    header_str.size() };
+  writer.write((char*)fields, sizeof(fields));
+  writer.write(header_str.data(), header_str.size());
+
+  std::string padding(page_size(), 0);
+  writer.write(padding.data(), (8 - writer.tell() % 8) % 8);
+  writer.write((char*)function.pilots().data(),
+      function.pilots().size() * sizeof(uint64_t));
+
+  // Positions are written after the records, when they are known.
+  size_t positions_begin = writer.tell();
+  std::vector<uint64_t> positions(keys.size(), 0);
+  writer.write((char*)positions.data(), positions.size() * sizeof(uint64_t));
+
+  std::string data;
+  for (size_t i = 0; i < keys.size(); i++) {
+    read_data(i, data);
+
+    uint64_t sizes[2] = { keys[i].size(), data.size() };
+    size_t record_size = sizeof(sizes) + sizes[0] + sizes[1];
+    size_t offset = writer.tell() % page_size();
+    if (offset > 0 && (record_size > page_size() ||
+          offset + record_size > page_size()))
+      writer.write(padding.data(), page_size() - offset);
+
+    positions[MinimalPerfectHash::position(hashes[i], keys.size(),
+        function.pilots().data())] = writer.tell();
+    writer.write((char*)sizes, sizeof(sizes));
+    writer.write(keys[i].data(), sizes[0]);
+    writer.write(data.data(), sizes[1]);
+  }
+
+  bool ok = writer.flush() &&
+    storage.write(positions_begin, (char*)positions.data(),
+        positions.size() * sizeof(uint64_t)) &&
+    storage.sync();
+  if (!ok)
+    throw boost::archive::archive_exception(
+        boost::archive::archive_exception::output_stream_error);
+}
+
+template <class Key, class Serializer>
+template <class T>
+void FrozenArchive<Key, Serializer>::decode(std::string const& str,
+    T& val) const {
+  decode(str, val, ArrayRecord::is_supported<T>());
+}
+
+template <class Key, class Serializer>
+template <class T>
+void FrozenArchive<Key, Serializer>::decode(std::string const& str,
+    T& val, std::true_type) const {
+  if (ArrayRecord::is_array(str))
+    ArrayRecord::decode(str, val);
+  else
+    decode(str, val, std::false_type());
+}
+
+template <class Key, class Serializer>
+template <class T>
+void FrozenArchive<Key, Serializer>::decode(std::string const& str,
+    T& val, std::false_type) const {
+  if (dictionaries_.empty() && !ZlibCodec::is_chunked(str))
+    ObjectArchive<Key, Serializer>::deserialize(str, val);
+  else
+    ObjectArchive<Key, Serializer>::deserialize_uncompressed(
+        ZlibCodec::decompress(str, dictionaries_), val);
+}
+
+#endif
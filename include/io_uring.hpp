@@ -0,0 +1,261 @@
+// This file defines a minimal io_uring, the asynchronous I/O interface of
+// Linux, used by an ObjectArchive to submit many reads at once instead of
+// waiting for each one. It uses the system calls directly, so it doesn't depend
+// on liburing.
+//
+// Requests are kept in flight up to the queue depth, so the device can serve
+// them in parallel and in its own order. Short reads are submitted again for
+// the rest of the data. Reads in flight are always waited for, even after an
+// error, as the kernel writes to their data until they complete.
+//
+// Currently only Linux is supported. Elsewhere, or if the kernel doesn't allow
+// it, init() fails and the caller must read the data itself.
+
+#ifndef __IO_URING_HPP__
+#define __IO_URING_HPP__
+
+#include <algorithm>
+#include <boost/predef.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if BOOST_OS_LINUX && __has_include(<linux/io_uring.h>)
+#define IO_URING_LINUX 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+class IoUring {
+  public:
+    // Reads size bytes starting at position of the file into data.
+    struct Request {
+      int fd;
+      size_t position;
+      char* data;
+      size_t size;
+      size_t done; // Bytes read so far
+    };
+
+    IoUring();
+    ~IoUring() { close(); }
+
+    // Creates the queues with the given depth. Returns false if io_uring can't
+    // be used.
+    bool init(unsigned int depth);
+
+    void close();
+
+    bool is_open() const { return fd_ >= 0; }
+
+    // Reads every request. Returns false if any of them fails or reaches the
+    // end of the file, but the others are still read.
+    bool read(std::vector<Request>& requests);
+
+  private:
+    // Not implemented
+    IoUring(IoUring const& other);
+    IoUring const& operator=(IoUring const& other);
+
+    int fd_;
+    unsigned int depth_;
+
+#if IO_URING_LINUX
+    // Adds a read of the rest of the request to the submission queue.
+    void prepare(std::vector<Request>& requests, size_t index);
+
+    void* sq_ring_;
+    void* cq_ring_;
+    size_t sq_ring_size_, cq_ring_size_;
+    io_uring_sqe* sqes_;
+    size_t sqes_size_;
+
+    unsigned int* sq_tail_;
+    unsigned int* sq_mask_;
+    unsigned int* sq_array_;
+    unsigned int* cq_head_;
+    unsigned int* cq_tail_;
+    unsigned int* cq_mask_;
+    io_uring_cqe* cqes_;
+
+    std::vector<iovec> iovecs_; // One for each request
+#endif
+};
+
+#if IO_URING_LINUX
+
+inline IoUring::IoUring(): fd_(-1), depth_(0), sq_ring_(MAP_FAILED),
+  cq_ring_(MAP_FAILED), sqes_((io_uring_sqe*)MAP_FAILED) { }
+
+inline bool IoUring::init(unsigned int depth) {
+  close();
+
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  fd_ = syscall(__NR_io_uring_setup, depth, &params);
+  if (fd_ < 0) {
+    fd_ = -1;
+    return false;
+  }
+  depth_ = params.sq_entries;
+
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ = params.cq_off.cqes +
+    params.cq_entries * sizeof(io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+
+  sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    cq_ring_ = sq_ring_;
+  else
+    cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+  sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+  sqes_ = (io_uring_sqe*)mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+
+  if (sq_ring_ == MAP_FAILED || cq_ring_ == MAP_FAILED ||
+      sqes_ == MAP_FAILED) {
+    close();
+    return false;
+  }
+
+  char* sq = (char*)sq_ring_;
+  sq_tail_ = (unsigned int*)(sq + params.sq_off.tail);
+  sq_mask_ = (unsigned int*)(sq + params.sq_off.ring_mask);
+  sq_array_ = (unsigned int*)(sq + params.sq_off.array);
+
+  char* cq = (char*)cq_ring_;
+  cq_head_ = (unsigned int*)(cq + params.cq_off.head);
+  cq_tail_ = (unsigned int*)(cq + params.cq_off.tail);
+  cq_mask_ = (unsigned int*)(cq + params.cq_off.ring_mask);
+  cqes_ = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+  return true;
+}
+
+inline void IoUring::close() {
+  if (sqes_ != MAP_FAILED)
+    munmap(sqes_, sqes_size_);
+  if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_)
+    munmap(cq_ring_, cq_ring_size_);
+  if (sq_ring_ != MAP_FAILED)
+    munmap(sq_ring_, sq_ring_size_);
+  sqes_ = (io_uring_sqe*)MAP_FAILED;
+  sq_ring_ = cq_ring_ = MAP_FAILED;
+
+  if (fd_ >= 0)
+    ::close(fd_);
+  fd_ = -1;
+}
+
+inline void IoUring::prepare(std::vector<Request>& requests, size_t index) {
+  Request& request = requests[index];
+
+  unsigned int tail = *sq_tail_;
+  unsigned int slot = tail & *sq_mask_;
+
+  // Older kernels may only read the iovec after the submission.
+  iovec& iov = iovecs_[index];
+  iov.iov_base = request.data + request.done;
+  iov.iov_len = request.size - request.done;
+
+  io_uring_sqe& sqe = sqes_[slot];
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.opcode = IORING_OP_READV;
+  sqe.fd = request.fd;
+  sqe.off = request.position + request.done;
+  sqe.addr = (uint64_t)&iov;
+  sqe.len = 1;
+  sqe.user_data = index;
+
+  sq_array_[slot] = slot;
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+}
+
+inline bool IoUring::read(std::vector<Request>& requests) {
+  bool ok = true, failed = false;
+  size_t next = 0, in_flight = 0, to_submit = 0;
+  iovecs_.resize(requests.size());
+
+  while (next < requests.size() || in_flight > 0) {
+    while (!failed && next < requests.size() && in_flight < depth_) {
+      requests[next].done = 0;
+      if (requests[next].size > 0) {
+        prepare(requests, next);
+        in_flight++;
+        to_submit++;
+      }
+      next++;
+    }
+    if (in_flight == 0)
+      break;
+
+    int ret = syscall(__NR_io_uring_enter, fd_, to_submit, 1,
+        IORING_ENTER_GETEVENTS, nullptr, 0);
+    if (ret >= 0)
+      to_submit -= std::min<size_t>(ret, to_submit);
+    else if (errno != EINTR && errno != EAGAIN && errno != EBUSY &&
+        !failed) {
+      // The reads submitted still write to the requests' data, so they must
+      // complete before returning. The ones not submitted are dropped.
+      ok = false;
+      failed = true;
+      __atomic_store_n(sq_tail_, *sq_tail_ - (unsigned int)to_submit,
+          __ATOMIC_RELEASE);
+      in_flight -= to_submit;
+      to_submit = 0;
+    }
+
+    unsigned int head = *cq_head_;
+    unsigned int tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      io_uring_cqe const& cqe = cqes_[head & *cq_mask_];
+      Request& request = requests[cqe.user_data];
+      in_flight--;
+
+      if (cqe.res <= 0) {
+        ok = false;
+        continue;
+      }
+
+      request.done += cqe.res;
+      if (request.done < request.size) {
+        if (failed) {
+          ok = false;
+          continue;
+        }
+        prepare(requests, cqe.user_data);
+        in_flight++;
+        to_submit++;
+      }
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+
+  return ok;
+}
+
+#else
+
+inline IoUring::IoUring(): fd_(-1), depth_(0) { }
+
+inline bool IoUring::init(unsigned int) {
+  return false;
+}
+
+inline void IoUring::close() { }
+
+inline bool IoUring::read(std::vector<Request>&) {
+  return false;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,103 @@
+// This file defines a minimal perfect hash function, which maps each of n
+// different 64 bits hashes to a different position between 0 and n - 1, so
+// that a table of n elements can be indexed without collisions. It's used by
+// frozen archives to find each key with a single probe.
+//
+// As in PTHash, the hashes are split in buckets of about 4 of them, which are
+// placed from the largest by searching for a pilot value that moves all the
+// bucket's hashes to free positions. Only the pilots are stored. Hashes that
+// weren't given are mapped to arbitrary positions, so whatever is found there
+// must still be compared.
+
+#ifndef __MINIMAL_PERFECT_HASH_HPP__
+#define __MINIMAL_PERFECT_HASH_HPP__
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+class MinimalPerfectHash {
+  public:
+    // Builds the function for the hashes, which must be different. Returns
+    // false if some bucket couldn't be placed, which is very unlikely unless
+    // the hashes repeat.
+    bool build(std::vector<uint64_t> const& hashes);
+
+    // Pilot of each bucket, which is all that's needed to compute positions.
+    std::vector<uint64_t> const& pilots() const { return pilots_; }
+
+    // Number of buckets for n hashes.
+    static size_t bucket_count(size_t n) { return n / 4 + 1; }
+
+    // Position of the hash in a function built for n hashes with the pilots
+    // given, which may be in a memory map.
+    static size_t position(uint64_t hash, size_t n, uint64_t const* pilots) {
+      uint64_t pilot = pilots[hash % bucket_count(n)];
+      return mix(hash ^ mix(pilot)) % n;
+    }
+
+  private:
+    // Finalizer of splitmix64, so that close pilots give unrelated positions.
+    static uint64_t mix(uint64_t value) {
+      value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9;
+      value = (value ^ (value >> 27)) * 0x94d049bb133111eb;
+      return value ^ (value >> 31);
+    }
+
+    std::vector<uint64_t> pilots_;
+};
+
+inline bool MinimalPerfectHash::build(std::vector<uint64_t> const& hashes) {
+  size_t n = hashes.size(), n_buckets = bucket_count(n);
+  pilots_.assign(n_buckets, 0);
+
+  // Hashes grouped by bucket, and the buckets from the largest.
+  std::vector<std::pair<uint64_t, uint64_t>> sorted;
+  sorted.reserve(n);
+  for (uint64_t hash : hashes)
+    sorted.emplace_back(hash % n_buckets, hash);
+  std::sort(sorted.begin(), sorted.end());
+
+  std::vector<std::pair<size_t, size_t>> buckets; // Size and first hash
+  for (size_t begin = 0, end = 0; begin < n; begin = end) {
+    while (end < n && sorted[end].first == sorted[begin].first)
+      end++;
+    buckets.emplace_back(end - begin, begin);
+  }
+  std::stable_sort(buckets.begin(), buckets.end(),
+      [](std::pair<size_t, size_t> const& a,
+        std::pair<size_t, size_t> const& b) { return a.first > b.first; });
+
+  // The last buckets have few free positions left, so their search is longer.
+  std::vector<bool> taken(n, false);
+  std::vector<size_t> positions;
+  uint64_t max_pilot = 100 * (uint64_t)n + 1000;
+  for (auto& bucket : buckets) {
+    uint64_t index = sorted[bucket.second].first;
+    for (uint64_t pilot = 0; ; pilot++) {
+      if (pilot > max_pilot)
+        return false;
+
+      pilots_[index] = pilot;
+      positions.clear();
+      for (size_t i = bucket.second; i < bucket.second + bucket.first; i++) {
+        size_t position = MinimalPerfectHash::position(sorted[i].second, n,
+            pilots_.data());
+        if (taken[position] || std::find(positions.begin(), positions.end(),
+              position) != positions.end())
+          break;
+        positions.push_back(position);
+      }
+
+      if (positions.size() == bucket.first)
+        break;
+    }
+
+    for (size_t position : positions)
+      taken[position] = true;
+  }
+
+  return true;
+}
+
+#endif
@@ -15,7 +15,8 @@
 //
 // Each object is referenced by a key, whose type must be hashable and
 // comparable, as it's used inside as index to an unordered_map. Both the key
-// and the object must be serializable through boost.
+// and the object must be serializable through boost or through the serializer
+// policy provided as second template argument (see serializers.hpp).
 //
 // The default buffer size is zero, so no objects are kept in memory, and a
 // temporary file is used as backend. For permanent storage, the user must
@@ -27,6 +28,100 @@
 // Threading support: to allow the archive to be used by multiple threads, set
 // ENABLE_THREADS. This should place mutex at the right places for consistency.
 //
+// Dictionary compression: small objects compress poorly on their own, so the
+// archive can train a dictionary from the objects already stored and use it to
+// compress the small objects inserted afterwards. The dictionaries are stored
+// in the archive's header and objects compressed with them must be loaded
+// through the archive, as the static deserialize() doesn't know them.
+//
+// Chunked compression: serializing a very large object with a single zlib
+// stream uses only one core, so objects larger than a given size can be split
+// in chunks that are compressed and decompressed in parallel. Each chunk can
+// also be loaded without the others through load_chunk().
+//
+// Contiguous arrays: vectors of arithmetic types, which boost serializes
+// through the compressor, can be stored as a copy of their memory instead. When
+// they aren't in the buffer, they are loaded directly from the file into the
+// vector's memory.
+//
+// Checksums: each key and object can be stored with its CRC32C, which is
+// checked when they are read from the file, so that a corrupted record throws a
+// ChecksumError instead of being deserialized. Loading a single chunk isn't
+// checked, as the checksum covers the whole object.
+//
+// Scrubbing: to find corrupted objects before they are needed, scrub() verifies
+// the objects in the order they are in the file, a few at a time, and
+// quarantines the corrupted ones by removing them from the archive. With
+// ENABLE_THREADS, a low priority thread can scrub the archive continuously at a
+// given rate.
+//
+// Deduplication: objects with the same contents inserted under many keys can
+// share the same data in the file, found through a hash of their contents. An
+// object whose data is already in the buffer because of another key is loaded
+// from there instead of being read again.
+//
+// Delta encoding: a new version of an object whose previous version is in the
+// file can be written as a delta from it, which is much smaller if only a few
+// bytes changed. A full copy is written after a given number of deltas, so that
+// loading doesn't have to apply too many of them, and on flush.
+//
+// Block packing: small objects can be packed together in blocks that are
+// compressed as a whole, so that compression works across objects and a single
+// read serves many neighboring ones. Small objects are then only serialized by
+// the archive, as the block compresses them. The blocks read are kept in a
+// cache of their own, separate from the buffer, and small objects written back
+// wait in an open block in memory until it's full.
+//
+// Blob storage: large objects can be stored in a separate blob file next to
+// the archive's, so that flushing the archive doesn't copy them. The blob file
+// only grows until most of it is unused, when a flush rewrites it as well.
+//
+// Direct I/O: the blob file can be read and written bypassing the system's
+// cache, so that the buffer is the only copy of large objects in memory. Blobs
+// are then aligned in the file and transferred through an aligned buffer.
+//
+// Batched loads: many objects can be loaded at once, reading them in the order
+// they are in the file. On Linux, the reads can be submitted together through
+// io_uring, so that the device serves many of them in parallel.
+//
+// Compressed tier: objects evicted from the buffer can be kept in memory
+// compressed again with a strong level, with a budget of their own, so that
+// loading them again doesn't read the file. Their data is also written to the
+// file as usual, so the tier only serves reads.
+//
+// Storage tiers: besides the buffer and the compressed tier in memory, the
+// archive's file can be a fast tier on a local device and the blob file a slow
+// tier on bulk storage. Each flush demotes the least recently used objects to
+// the blob file when the ones in the archive's file exceed its capacity, and
+// objects loaded from there are promoted back when written back.
+//
+// Warm restart: the keys of the objects in the buffer can be saved on every
+// flush and loaded again after the archive is opened, so that it doesn't start
+// with an empty buffer. With ENABLE_THREADS, a thread can load them in the
+// background, in batches, while the archive is used.
+//
+// Frozen archives: archives that are only read after being written can be
+// frozen into a read-only file that is mapped in memory and found through a
+// minimal perfect hash (see frozen_archive.hpp).
+//
+// Lazy index: opening a file reads every entry into memory, which takes long
+// for many objects. Instead, a hash index of the keys can be kept next to the
+// file, so that opening it reads nothing else and the entries are read from
+// the file when their keys are used. Operations on all the objects, such as a
+// flush that rebuilds the file, read the remaining entries first.
+//
+// Scans: every object can be visited by reading the archive's file in order,
+// which doesn't need its entries in memory and keeps the buffer as it is.
+//
+// Range queries: for ordered keys, the keys in a range or with a prefix are
+// found through a sorted index built on the first query, and sorted by the
+// position of their objects for sequential reads.
+//
+// Storage backends: the archive's files are accessed through a storage backend
+// (see storage.hpp), which can be changed at any time: positional reads and
+// writes of the file, the default, reads from a memory map, batched reads
+// through io_uring, or memory only, in which case nothing is written to disk.
+//
 // Example:
 // ObjectArchive<std::string> ar;
 // ar.init("path/to/file");
@@ -44,39 +139,77 @@
 
 #include <boost/archive/binary_iarchive.hpp>
 #include <boost/archive/binary_oarchive.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/stream.hpp>
 #include <boost/predef.h>
+#include <boost/serialization/map.hpp>
+#include <boost/serialization/string.hpp>
 #if ENABLE_THREADS
 #include <boost/thread.hpp>
 #endif
 #include <fstream>
 #include <functional>
 #include <list>
+#include <map>
+#include <memory>
 #include <sstream>
 #include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "array_record.hpp"
+#include "compressed_tier.hpp"
+#include "crc32c.hpp"
+#include "delta_codec.hpp"
+#include "direct_file.hpp"
+#include "record_block.hpp"
+#include "serializers.hpp"
+#include "storage.hpp"
+#include "thread_pool.hpp"
+#include "xxhash64.hpp"
+#include "zlib_codec.hpp"
+
+template <class Key, class Serializer>
+class FrozenArchive;
 
-template <class Key>
+template <class Key, class Serializer = BoostSerializer>
 class ObjectArchive {
   public:
+    // Ways to access the archive's files.
+    enum StorageBackend {
+      storage_file, // Positional reads and writes
+      storage_mmap, // Reads from a memory map of the file
+      storage_io_uring, // Reads of load_many() submitted through io_uring
+      storage_memory // Contents kept in memory only and lost on destruction
+    };
+
     // Creates an archive with a temporary file as backend, which is deleted on
     // destruction. To use a permanent record, call the method init().
     ObjectArchive();
 
+    // Same as above, but uses the given backend from the start. With
+    // storage_memory, the archive never touches the file system.
+    explicit ObjectArchive(StorageBackend backend);
+
     // Unloads the buffer using method flush().
     virtual ~ObjectArchive();
 
-    // Passes an object through boost serialize, making it easier to handle.
+    // Passes an object through the serializer and compresses it, making it
+    // easier to handle.
     template <class T> static std::string serialize(T const& val);
     template <class T> static void deserialize(std::string const& str, T& val);
 
     // If trying to serialize a pointer of a Base class, that has virtual
     // methods, poiting to a Derived object, serialization fails because it
     // doesn't recognize the type. In this case, this method deals with this.
-    // Calls like serialize<Derived>(value);
+    // Calls like serialize<Derived>(value); and requires BoostSerializer.
     template <class T1, class T2>
     static std::string serialize(T2 const& val);
 
     // Initializes the archive using a temporary file as backend. As the names
-    // are random, it's possible to have a collision!
+    // are random, it's possible to have a collision! With storage_memory, no
+    // name is needed.
     void init();
 
     // Initializes the archive using a new file as backend. If the file is
@@ -101,6 +234,165 @@ class ObjectArchive {
     size_t get_max_buffer_size() const;
     size_t get_buffer_size() const;
 
+    // Keeps the objects evicted from the buffer in memory, compressed with the
+    // given zlib level, up to max_size bytes after compression. The default
+    // size, 0, disables the tier.
+    void set_compressed_tier(size_t max_size, int level = Z_BEST_COMPRESSION);
+
+    // Provides information about the compressed tier's size and the number of
+    // objects loaded from it.
+    size_t get_compressed_tier_size() const;
+    size_t get_compressed_tier_hits() const;
+
+    // Drops the objects evicted from the buffer that aren't in the files yet,
+    // after they leave the compressed tier if one is set, instead of writing
+    // them, so that the archive is a bounded cache. Their keys are removed
+    // with them, and flushes don't change the archive. Disabled by default.
+    void set_drop_evicted(bool enable);
+
+    // Saves the keys of the objects in the buffer, from the most recently
+    // used, in the file named as the archive's plus ".warm" on every flush, and
+    // reads the ones saved when init() opens the file. With prefetch, they are
+    // loaded by prefetch_warm() whenever they are read, in a thread of its own
+    // with ENABLE_THREADS. Disabled by default and for temporary files.
+    void set_warm_restart(bool enable, bool prefetch = false);
+
+    // Loads the objects whose keys were read and fit in the buffer, from the
+    // least recently used, so that the buffer's order is the saved one. Each
+    // batch of objects is loaded like load_raw_many(). Returns the number of
+    // objects loaded.
+    size_t prefetch_warm();
+
+    // Writes a hash index of the keys in the file named as the archive's plus
+    // ".index" whenever the archive's file is written or fully read, and uses
+    // it to open the file without reading its entries from the next init() on.
+    // The index is ignored if the archive's file changed since it was written.
+    // Disabled by default and for temporary files.
+    void set_lazy_index(bool enable);
+
+    // Writes every object to a frozen archive, which is read with a
+    // FrozenArchive with the same template arguments.
+    void freeze(std::string const& filename);
+
+    // Trains a compression dictionary from up to max_samples stored objects
+    // whose size is at most the dictionary threshold and uses it for the small
+    // objects inserted from now on. Returns the size of the dictionary, which
+    // is 0 if no sample was found and no dictionary is used.
+    size_t train_dictionary(size_t max_samples = 1000);
+
+    // Uses a dictionary provided by the user for the next small objects.
+    void set_dictionary(std::string const& dictionary);
+
+    // Objects whose serialized size, before compression, is at most this value
+    // are compressed with the dictionary. The default is 4096 bytes and 0
+    // disables the dictionary.
+    void set_dictionary_threshold(size_t threshold);
+
+    // Objects whose serialized size is larger than chunk_size are compressed
+    // in independent chunks by n_threads threads besides the caller, which are
+    // also used to decompress them. A chunk size of 0, the default, disables
+    // chunking.
+    void set_chunked_compression(size_t chunk_size,
+        unsigned int n_threads = ThreadPool::default_size());
+
+    // Stores vectors of arithmetic types as a single block copied from their
+    // memory, instead of serializing and compressing each element. Disabled
+    // by default. Arrays already stored can be loaded either way.
+    void set_contiguous_arrays(bool enable);
+
+    // When the checksums are checked.
+    enum ChecksumVerification {
+      verify_none, // Never
+      verify_file_reads, // When keys and objects are read from the file
+      verify_all_reads // Also when objects are loaded from the buffer
+    };
+
+    // Stores a checksum with each key and object from the next flush on.
+    // Disabled by default, but opening a file with checksums enables them.
+    void set_checksums(bool enable);
+
+    // Changes when the checksums are checked. The default is verify_file_reads.
+    void set_checksum_verification(ChecksumVerification verification);
+
+    // Verifies the checksums of the objects in the file, in the order they are
+    // stored, until at least max_bytes are read or the end of the file is
+    // reached. Each call continues from where the previous one stopped and
+    // starts over after the end. Corrupted objects are removed from the archive
+    // and reported to the callback. Returns the number of them found.
+    size_t scrub(size_t max_bytes);
+
+    // Function called with the key of each corrupted object found by scrub().
+    // With the scrubber thread, it's called from that thread.
+    void set_scrub_callback(std::function<void(Key const&)> const& callback);
+
+    // Gets the keys of all objects removed by scrub().
+    std::list<Key> quarantined_objects();
+
+    // Makes objects with the same contents share their data in the file from
+    // the next flush on. Disabled by default, but opening a file with shared
+    // data enables it.
+    void set_deduplication(bool enable);
+
+    // Writes new versions of objects whose previous version is in the file as
+    // deltas from it, with a full copy after max_chain deltas. Objects
+    // compressed by the archive are compared before compression. Deltas are
+    // only used until the next flush, which writes full copies. The default,
+    // 0, disables delta encoding.
+    void set_delta_encoding(unsigned int max_chain);
+
+    // Packs objects whose size is at most max_object_size into compressed
+    // blocks of about block_size bytes from the next flush on, keeping up to
+    // cache_size bytes of blocks in memory. A maximum size of 0, the default,
+    // disables packing, but opening a file with blocks enables it.
+    void set_block_packing(size_t max_object_size, size_t block_size = 1 << 16,
+        size_t cache_size = 1 << 24);
+
+    // Stores objects larger than threshold in the file named as the archive's
+    // plus ".blobs" from the next flush on. A threshold of 0, the default,
+    // disables it, but opening a file with blobs enables it.
+    void set_blob_storage(size_t threshold);
+
+    // Uses the blob file, placed at the given path, as a slow tier for the
+    // objects that don't fit in fast_capacity bytes of the archive's file. On
+    // each flush, the least recently used objects are moved to it, and objects
+    // loaded from it are moved back to the archive's file. Enables blob
+    // storage if it isn't, but without a threshold, and moves an existing blob
+    // file to the new path. A capacity of 0, the default, stops demoting.
+    void set_slow_tier(std::string const& filename, size_t fast_capacity);
+
+    // Number of objects loaded from each place.
+    struct TierStats {
+      size_t buffer; // Including data shared with other keys
+      size_t compressed_tier;
+      size_t file;
+      size_t blob_file; // Slow tier or large objects
+    };
+
+    // Provides the statistics since the archive was opened or they were reset.
+    TierStats get_tier_stats() const;
+    void reset_tier_stats();
+
+    // Reads and writes the blob file with direct I/O, which has no effect if
+    // the system or file system doesn't support it. Disabled by default.
+    void set_direct_io(bool enable);
+
+    // Changes how the archive's files are accessed. The default is
+    // storage_file. Moving to or from storage_memory copies the contents.
+    void set_storage(StorageBackend backend);
+
+    // Uses storage_io_uring, keeping up to depth reads in flight, if the
+    // system supports it. A depth of 0 goes back to storage_file.
+    void set_io_uring(unsigned int depth);
+
+#if ENABLE_THREADS
+    // Starts a low priority thread that calls scrub() so that at most
+    // bytes_per_second are read every second. Stops the previous one, if any.
+    void start_scrubber(size_t bytes_per_second);
+
+    // Stops the scrubber thread, if any.
+    void stop_scrubber();
+#endif
+
     // Removes an object entry if it's present.
     virtual void remove(Key const& key);
 
@@ -139,6 +431,20 @@ class ObjectArchive {
     virtual size_t load_raw(Key const& key, std::string& data,
         bool keep_in_buffer = true);
 
+    // Same as load() and load_raw(), but for many objects at once, which are
+    // stored in the same order as their keys. Objects that aren't found are
+    // left empty. Returns the total size of the objects.
+    template <class T>
+    size_t load_many(std::vector<Key> const& keys, std::vector<T>& objs,
+        bool keep_in_buffer = true);
+    size_t load_raw_many(std::vector<Key> const& keys,
+        std::vector<std::string>& data, bool keep_in_buffer = true);
+
+    // Loads only one chunk of the serialized data of an object compressed in
+    // chunks, without changing the buffer. Returns the size of the chunk,
+    // which is 0 if the object isn't found, isn't chunked or has fewer chunks.
+    size_t load_chunk(Key const& key, size_t chunk, std::string& data);
+
     // Saves the least recently used entries so that the buffer size is at most
     // the value given in the argument. By default, frees the full buffer. If
     // the argument is larger than the current buffer, does nothing.
@@ -150,6 +456,50 @@ class ObjectArchive {
     // Gets a list of all the results stored in this archive.
     std::list<Key const*> available_objects();
 
+    // Copies the keys of all objects stored in this archive at once, so that
+    // they are consistent with each other and stay valid if the archive
+    // changes, unlike the pointers above. With the lazy index, the keys are
+    // read from the file without keeping its entries in memory.
+    std::vector<Key> available_keys();
+
+    // Gets the keys in [lo, hi), which must be ordered by operator<, sorted
+    // by the position of their objects in the files, so that loading them in
+    // this order reads the files sequentially. The first query sorts every
+    // key in an index that is kept up to date from then on.
+    std::vector<Key> range(Key const& lo, Key const& hi);
+
+    // Same as range(), but gets the keys that begin with prefix. Requires
+    // string keys.
+    std::vector<Key> prefix(Key const& prefix);
+
+    // Calls fn with the key and raw data of every object, reading the
+    // archive's file in order with large sequential reads instead of loading
+    // the objects one by one, and without changing the buffer. Objects that
+    // aren't in the file as it was last written come last. The archive is
+    // locked meanwhile and fn must not use it.
+    void for_each_raw(
+        std::function<void(Key const&, std::string const&)> const& fn);
+
+    // Same as for_each_raw(), but decodes each object as load() does.
+    template <class T>
+    void for_each(std::function<void(Key const&, T const&)> const& fn);
+
+    // Same as for_each(), but objects are decoded and passed to fn by
+    // n_threads threads besides the caller, in parts of consecutive objects
+    // processed while the next ones are read. fn is called concurrently.
+    template <class T>
+    void parallel_for_each(std::function<void(Key const&, T const&)> const& fn,
+        unsigned int n_threads = ThreadPool::default_size());
+
+    // Maps every object as parallel_for_each() does and combines the values
+    // with reduce, in the order of the objects in the file, which makes the
+    // result deterministic if reduce is associative. The initial value must
+    // be the identity of reduce, as each part is combined from it.
+    template <class T, class R>
+    R map_reduce(std::function<R(Key const&, T const&)> const& map,
+        std::function<R(R const&, R const&)> const& reduce, R const& init,
+        unsigned int n_threads = ThreadPool::default_size());
+
     // Flushs the archive, guaranteeing that the data is saved to a file, which
     // can be used later or continue to be used. The buffer is empty after this
     // method, but the archive can still be used.
@@ -163,7 +513,83 @@ class ObjectArchive {
     ObjectArchive(ObjectArchive const& other);
     ObjectArchive const& operator=(ObjectArchive const& other);
 
+    // Decodes objects as the archive does.
+    friend class FrozenArchive<Key, Serializer>;
+
   protected:
+    // Value found instead of the number of entries in files with a header.
+    static size_t const header_magic = 0x56484352414a424f; // "OBJARCHV"
+
+    // Version of the header written by this code.
+    static unsigned int const header_version = 7;
+
+    // Value found at the beginning of blob files.
+    static size_t const blob_magic = 0x53424f4c424a424f; // "OBJBLOBS"
+
+    // Value found at the beginning of index files.
+    static size_t const index_magic = 0x5845444e494a424f; // "OBJINDEX"
+
+    // Information stored at the beginning of the file, if any of the features
+    // that require it is used.
+    struct Header {
+      unsigned int version;
+      ZlibCodec::dictionary_map dictionaries;
+      uint32_t dictionary_id; // Dictionary used for new objects
+      unsigned int serializer_version; // Serializer::format_version()
+      bool checksums; // Entries have checksums
+      bool deduplication; // Entries have hashes and may share data
+      size_t block_object_size; // Entries may be in blocks if not 0
+      size_t block_size;
+      size_t blob_threshold; // Entries may be in the blob file if not 0
+      std::string blob_filename; // Default name if empty
+      size_t fast_capacity; // Capacity of the archive's file as a tier
+
+      template<class Archive>
+      void serialize(Archive& ar, const unsigned int) {
+        ar & version;
+        ar & dictionaries;
+        ar & dictionary_id;
+        if (version >= 2)
+          ar & serializer_version;
+        else
+          serializer_version = 0;
+        if (version >= 3)
+          ar & checksums;
+        else
+          checksums = false;
+        if (version >= 4)
+          ar & deduplication;
+        else
+          deduplication = false;
+        if (version >= 5) {
+          ar & block_object_size;
+          ar & block_size;
+        }
+        else
+          block_object_size = block_size = 0;
+        if (version >= 6)
+          ar & blob_threshold;
+        else
+          blob_threshold = 0;
+        if (version >= 7) {
+          ar & blob_filename;
+          ar & fast_capacity;
+        }
+        else {
+          blob_filename.clear();
+          fast_capacity = 0;
+        }
+      }
+    };
+
+    // Data in the file, which may be a delta from other data.
+    struct Extent {
+      size_t index_in_file;
+      size_t size; // Size of the data
+      size_t delta_size; // Size of the delta in the file, or 0 if it's full
+      unsigned int chain; // Number of deltas to apply to reach the data
+    };
+
     // Holds the entry for one object with all the information required to
     // manage it.
     struct ObjectEntry {
@@ -172,11 +598,303 @@ class ObjectArchive {
       size_t index_in_file; // Index for finding it inside a file
       size_t size; // Total object size. data.size() == size if loaded
       bool modified; // If modified, the file must be written back to disk
+      uint32_t checksum; // CRC32C of the data, valid if has_checksum
+      bool has_checksum;
+      uint64_t hash; // XXHash64 of the data, valid if has_hash
+      bool has_hash;
+      size_t delta_size; // The file has a delta if not 0, as in Extent
+      unsigned int delta_chain;
+      Extent base; // Previous version in the file, valid if has_base
+      bool has_base;
+      bool packed; // The data is in the block at index_in_file, or in the
+                   // open block if it's 0
+      size_t slot; // Position inside the block
+      bool in_blob; // index_in_file is a position in the blob file
+      uint64_t last_access; // Value of the access clock when last used
+    };
+
+    // Fields present in each entry of the archive's file.
+    struct EntryLayout {
+      bool checksums;
+      bool deduplication;
+      bool blocks;
+      bool blobs;
     };
 
     // Same as external flush, but the archive can't be used anymore.
     void internal_flush();
 
+    // Builds a random name in the system's temporary directory.
+    static std::string temporary_filename();
+
+    // Reads the archive's file, opening it if needed.
+    void open_file();
+
+    // Closes the archive's files and removes them if they are temporary.
+    void close_files();
+
+    // Creates a storage of the current backend, which isn't open.
+    Storage* new_storage() const;
+
+    // Replaces the archive's file with the temporary one written by a flush.
+    void replace_file(std::unique_ptr<Storage>& storage,
+        std::unique_ptr<Storage>& temp_storage, std::string const& filename,
+        std::string const& temp_filename) const;
+
+    // Serializes and compresses an object using the dictionary if it's small
+    // enough, and the opposite operation.
+    template <class T> std::string encode(T const& val) const;
+    template <class T> void decode(std::string const& str, T& val) const;
+
+    // Same as above, but the tag says if the type can be stored as an array.
+    template <class T>
+    std::string encode(T const& val, std::true_type) const;
+    template <class T>
+    std::string encode(T const& val, std::false_type) const;
+    template <class T>
+    void decode(std::string const& str, T& val, std::true_type) const;
+    template <class T>
+    void decode(std::string const& str, T& val, std::false_type) const;
+
+    // Loads an array directly from the file into the object if it isn't in the
+    // buffer and won't be kept there. Returns 0 if it can't, so that the
+    // regular load must be used.
+    template <class T>
+    size_t load_array(Key const& key, T& obj, bool keep_in_buffer,
+        std::true_type);
+    template <class T>
+    size_t load_array(Key const& key, T& obj, bool keep_in_buffer,
+        std::false_type);
+
+    // Same as serialize() and deserialize(), but without compression. The
+    // serialized data is kept in the thread's buffer and is only valid until
+    // the next call, while deserialization reads the string in place.
+    template <class T>
+    static std::string const& serialize_uncompressed(T const& val);
+    template <class T>
+    static void deserialize_uncompressed(std::string const& str, T& val);
+
+    // Stream reused by each thread to serialize objects, whose buffer keeps
+    // its memory between calls. Boost's archives themselves can't be reused,
+    // as they only write the information about a class the first time it's
+    // seen, so objects wouldn't be independent.
+    struct ThreadOutput {
+      // Larger buffers are freed by trim() instead of kept for the next object
+      static size_t const max_kept_size = 1 << 20;
+
+      std::string buffer;
+      boost::iostreams::stream<
+        boost::iostreams::back_insert_device<std::string>> stream;
+
+      ThreadOutput(): stream(buffer) { }
+
+      void trim();
+    };
+
+    static ThreadOutput& thread_output();
+
+    // Checks if the file must have a header.
+    bool has_header() const;
+
+    // Same as the public scrub(), but adds the number of bytes read to bytes.
+    size_t scrub(size_t max_bytes, size_t& bytes);
+
+    // Verifies the next object to scrub, adding its size to bytes and its key
+    // to corrupted if it's corrupted. Returns false at the end of the file.
+    bool scrub_next(size_t& bytes, std::list<Key>& corrupted);
+
+    // Size of the pieces in which large objects are read and checked.
+    static size_t read_piece_size() { return 1 << 18; }
+
+    // Gets where the data of an entry is in the file.
+    static Extent extent(ObjectEntry const& entry);
+
+    // Reads some data from the file, applying the deltas if it's one.
+    void read_extent(Extent const& extent, std::string& data);
+
+    // Writes the entry's data at the end of the file, as a delta from its base
+    // if it's worth it.
+    void write_extent(ObjectEntry& entry);
+
+    // Checks if the data is a single zlib stream, neither chunked nor an array.
+    static bool is_compressed_record(std::string const& data);
+
+    // Checks if the entry's data must be stored in a block.
+    bool must_pack(ObjectEntry const& entry) const;
+
+    // Gets the contents of the block at the given position in the file.
+    std::string const& read_block(size_t position);
+
+    // Writes the open block at the end of the file.
+    void write_open_block();
+
+    // Checks if the entry's data must be stored in the blob file.
+    bool must_blob(ObjectEntry const& entry) const;
+
+    // Name of the blob file.
+    std::string blob_filename() const;
+
+    // Name of the file with the keys saved for warm restart.
+    std::string warm_filename() const;
+
+    // Name of the file with the lazy index.
+    std::string index_filename() const;
+
+    // Reads the entry at the reader's position and its key, whose serialized
+    // form is also provided, leaving the reader after the entry's data.
+    // Returns if the data follows the key in the file.
+    bool parse_entry(StorageReader& reader, Key& key, ObjectEntry& entry,
+        std::string& key_string);
+
+    // Adds an entry read from the file to the archive.
+    typename std::unordered_map<Key, ObjectEntry>::iterator add_entry(
+        Key const& key, ObjectEntry const& entry, bool has_data);
+
+    // Finds the key's entry, reading it through the lazy index if needed.
+    typename std::unordered_map<Key, ObjectEntry>::iterator find_object(
+        Key const& key);
+
+    // Reads the entries not read yet and stops using the lazy index.
+    void load_all_entries();
+
+    // Opens the lazy index if it matches the archive's file.
+    bool open_index(size_t n_entries);
+
+    // Writes the lazy index from the hash of each key and the position of its
+    // entry in the archive's file, which has archive_size bytes.
+    void write_index(std::vector<std::pair<uint64_t, uint64_t>> const& records,
+        size_t archive_size);
+
+    // Reads the entries of the archive's file in order, calling fn with the
+    // key and entry of each object whose data is still the one in the file and
+    // if the data follows the entry, which the reader is right after. Then,
+    // calls fn with the remaining objects, sorted by their position.
+    void scan_entries(StorageReader& reader, std::function<void(Key const&,
+          ObjectEntry const&, bool)> const& fn);
+
+    // Orders entries by the position of their data in the files, with the
+    // ones only in the buffer last.
+    static bool file_order(ObjectEntry const* a, ObjectEntry const* b);
+
+    // Sorts the keys inserted since the last query into the ordered index,
+    // building it on the first query.
+    void update_ordered_index();
+
+    // Gets the keys between the positions begin and end of the ordered index
+    // that are still in the archive, sorted with file_order(), and drops the
+    // others from the index.
+    std::vector<Key> ordered_results(size_t begin, size_t end);
+
+    // Reads the data of an entry given by scan_entries().
+    void read_scanned(StorageReader& reader, ObjectEntry const& entry,
+        bool follows, std::string& data);
+
+    // Size of the reads made by for_each_raw(), so that the device reads
+    // ahead of the objects processed.
+    static size_t scan_buffer_size() { return 1 << 22; }
+
+    // Consecutive objects read by a scan.
+    typedef std::vector<std::pair<Key, std::string>> ScanPart;
+
+    // Reads the objects as for_each_raw() does, in parts of about
+    // scan_part_size() bytes, which are passed to process with their index in
+    // the file's order by n_threads threads besides the caller. With
+    // ENABLE_THREADS, the next parts are read meanwhile by another thread.
+    void parallel_scan(
+        std::function<void(size_t, ScanPart const&)> const& process,
+        unsigned int n_threads);
+
+    static size_t scan_part_size() { return 1 << 20; }
+
+    // Writes the keys of the objects in the buffer and the ones read but not
+    // loaded yet to the warm file.
+    void save_warm_keys();
+
+    // Reads the keys in the warm file, if any, and prefetches them if needed.
+    void load_warm_keys();
+
+    // Loads the next batch of warm keys, adding the number of objects loaded.
+    // Returns if there are keys left.
+    bool prefetch_warm_batch(size_t& n_loaded);
+
+    static size_t warm_batch_size() { return 256; }
+
+    // Opens the blob file, creating it if it doesn't exist.
+    void open_blob_file();
+
+    // Opens a blob file as a DirectFile with direct I/O, if it can be used,
+    // or with the backend otherwise.
+    std::unique_ptr<Storage> open_blob_storage(std::string const& filename,
+        bool truncate) const;
+
+    // Writes the data at the end of the blob file and makes it the entry's.
+    void write_blob(ObjectEntry& entry, std::string const& data);
+
+    // Copies the blobs in use to a new blob file, without the space of the
+    // ones removed, and stores the position of each one in the new file by its
+    // position in the old one. Returns the new file.
+    std::unique_ptr<Storage> rewrite_blobs(std::string const& filename,
+        std::unordered_map<size_t, size_t>& positions);
+
+    // Size of the blob file, which is opened if it isn't.
+    size_t blob_file_size();
+
+    // Reads size bytes from the blob file starting at position. Returns false
+    // if they aren't all there.
+    bool read_blob(size_t position, char* data, size_t size);
+
+    // Moves the least recently used objects in the archive's file to the blob
+    // file until the others fit in its capacity.
+    void demote_objects();
+
+    // Marks an entry as used now and counts where its data was loaded from,
+    // promoting it to the archive's file if it was in the slow tier.
+    void count_access(ObjectEntry& entry, size_t TierStats::* place);
+
+    // Reads the objects of load_raw_many() that can be read in a single batch
+    // by the storage, whose indexes are given in the order to read them, and
+    // marks them as done. Returns their total size.
+    size_t load_batch(std::vector<Key> const& keys,
+        std::vector<size_t> const& order, std::vector<std::string>& data,
+        std::vector<bool>& done, bool keep_in_buffer);
+
+    // Same as read_blob(), but reads from the entry's data in its file.
+    bool read_data(ObjectEntry const& entry, size_t begin, char* data,
+        size_t size);
+
+    // Reads the data of an entry that isn't in the buffer from the file or
+    // its block, applying the deltas, without checking it.
+    void read_record(ObjectEntry const& entry, std::string& data);
+
+    // Computes the checksum and hash that the entry needs in the file but
+    // doesn't have yet, reading its data from the file.
+    void compute_digests(ObjectEntry& entry);
+
+    // Looks for data in the file with the given hash and contents. Returns if
+    // it's found and, in this case, its position.
+    bool find_extent(uint64_t hash, std::string const& data, size_t& position);
+
+    // Checks if the entry's checksum must be verified when it's read.
+    bool must_verify(ObjectEntry const& entry) const;
+
+    // Throws a ChecksumError if the checksum computed for the entry's data
+    // doesn't match the stored one and it must be verified.
+    void check_checksum(ObjectEntry const& entry, uint32_t checksum) const;
+
+    // Reads size bytes of the entry's data starting at begin from the file. If
+    // the entry must be verified, extends the checksum with each piece read
+    // while it's still in the cache and returns it.
+    uint32_t read_file(ObjectEntry const& entry, size_t begin, char* data,
+        size_t size, uint32_t checksum = 0);
+
+    // Reads the data of an entry, from the buffer if it's there or from the
+    // file otherwise, without changing the buffer.
+    void read_entry(ObjectEntry const& entry, std::string& data);
+
+    // Same as read_entry(), but only reads size bytes starting at begin.
+    void read_entry(ObjectEntry const& entry, size_t begin, size_t size,
+        std::string& data);
+
     // Writes a file back to disk, freeing its buffer space. Returns if the
     // object id is inside the buffer.
     bool write_back(Key const& key);
@@ -196,9 +914,115 @@ class ObjectArchive {
     size_t max_buffer_size_, // Argument provided at creation
       buffer_size_; // Current buffer size
 
+    // Copies of objects evicted from the buffer.
+    CompressedTier<Key> compressed_tier_;
+    bool drop_evicted_; // Evicted objects are dropped instead of written
+
     std::string filename_;
     bool temporary_file_;
-    std::fstream stream_;
+
+    // Backend of the archive's files, the depth used by io_uring and the
+    // storage of the archive's file.
+    StorageBackend storage_backend_;
+    unsigned int io_uring_depth_;
+    std::unique_ptr<Storage> storage_;
+
+    // Compression dictionaries known by the archive and the one currently used
+    // for new objects, which is valid only if the map isn't empty.
+    ZlibCodec::dictionary_map dictionaries_;
+    uint32_t dictionary_id_;
+    size_t dictionary_threshold_;
+
+    // Size of each chunk for large objects and the threads that process them.
+    size_t chunk_size_;
+    std::unique_ptr<ThreadPool> pool_;
+
+    // Vectors of arithmetic types are stored as arrays.
+    bool contiguous_arrays_;
+
+    // Checksums are written to the file and when they are checked.
+    bool checksums_;
+    ChecksumVerification checksum_verification_;
+
+    // Objects of the current scrub pass, sorted by position in the file, and
+    // the next one to verify.
+    std::vector<std::pair<size_t, Key>> scrub_queue_;
+    size_t scrub_next_;
+    std::function<void(Key const&)> scrub_callback_;
+    std::list<Key> quarantined_;
+
+    // Objects share data with the same contents. The position and size of the
+    // data in the file are indexed by hash, and the keys whose data is in the
+    // buffer by position.
+    bool deduplication_;
+    std::unordered_multimap<uint64_t, std::pair<size_t, size_t>> extents_;
+    std::unordered_map<size_t, Key> buffered_extents_;
+
+    // Maximum number of deltas from a full copy, which is 0 without deltas.
+    unsigned int max_delta_chain_;
+
+    // Objects up to block_object_size_ are packed in blocks, which is
+    // disabled if it's 0. Objects written since the last block are in the open
+    // one, whose keys are kept by slot.
+    size_t block_object_size_, block_size_;
+    BlockCache block_cache_;
+    RecordBlock open_block_;
+    std::vector<Key> open_block_keys_;
+
+    // Objects larger than blob_threshold_ are in the blob file, which is
+    // disabled if it's 0 and is a DirectFile with direct I/O. It's named
+    // after the archive's file unless blob_filename_ is given.
+    size_t blob_threshold_;
+    std::string blob_filename_;
+    bool direct_io_;
+    std::unique_ptr<Storage> blob_storage_;
+
+    // Objects in the archive's file beyond fast_capacity_ bytes are demoted to
+    // the blob file, which is disabled if it's 0. Entries are ordered by the
+    // access clock, which only counts since the archive was opened.
+    size_t fast_capacity_;
+    uint64_t access_clock_;
+    TierStats tier_stats_;
+
+    // Keys saved for warm restart and not loaded yet, from the most recently
+    // used, which are cut to the ones that fit in the buffer before the first
+    // batch.
+    bool warm_restart_, warm_prefetch_, warm_fitted_;
+    std::vector<Key> warm_keys_;
+
+    // Entries of the archive's file, which begin at entries_begin_. With the
+    // lazy index open, only the ones used and not removed are in objects_.
+    EntryLayout file_layout_;
+    size_t entries_begin_, n_file_entries_;
+    bool lazy_index_;
+    std::unique_ptr<Storage> index_storage_;
+    size_t index_slots_;
+    std::unordered_set<Key> index_removed_;
+
+    // Keys sorted for range queries, built by the first one, and the keys
+    // inserted since the last one, which the next sorts into them. Keys
+    // removed are dropped when a query finds them.
+    bool ordered_built_;
+    std::vector<Key> ordered_keys_, ordered_new_keys_;
+
+#if ENABLE_THREADS
+    // Loop of the prefetcher thread, which stops when no key is left.
+    void prefetcher();
+
+    // Stops the prefetcher thread, if any.
+    void stop_prefetcher();
+
+    boost::thread prefetcher_;
+    bool prefetching_ = false;
+
+    // Loop of the scrubber thread.
+    void scrubber(size_t bytes_per_second);
+
+    boost::thread scrubber_;
+    boost::mutex scrubber_mutex_;
+    boost::condition_variable scrubber_wakeup_;
+    bool scrubber_stop_ = false;
+#endif
 
 #if ENABLE_THREADS
     boost::recursive_mutex mutex_;
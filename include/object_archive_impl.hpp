@@ -4,16 +4,53 @@
 // 2.2) Size of the object (size_t);
 // 2.3) Key as serialized by boost;
 // 2.4) Object as serialized by boost.
+//
+// If the archive needs a header, the number of entries is replaced by:
+// 1.1) Header magic (size_t);
+// 1.2) Size of the header (size_t);
+// 1.3) Header as serialized by boost;
+// 1.4) Number of entries (size_t).
+//
+// If the header says so, the sizes of each entry are followed by:
+// 2.2.1) CRC32C of the key (uint32_t);
+// 2.2.2) CRC32C of the object (uint32_t).
+//
+// If the header says that objects are deduplicated, these are followed by:
+// 2.2.3) XXHash64 of the object (uint64_t);
+// 2.2.4) Position in the file of the object's data, if it's shared with a
+//        previous entry, or 0 if the data follows the key (uint64_t).
+//
+// If the header says that objects are packed in blocks, the number of entries
+// is preceded by:
+// 1.4.1) Size of the blocks that follow (size_t);
+// 1.4.2) Blocks, each with its size (uint64_t) followed by its compressed
+//        contents, as described in record_block.hpp.
+//
+// and the other fields of each entry are followed by:
+// 2.2.5) Position in the file of the block with the object, or 0 if the data
+//        follows the key (uint64_t);
+// 2.2.6) Slot of the object inside the block (uint64_t).
+//
+// If the header says that large objects are in a blob file, these are followed
+// by:
+// 2.2.7) Position of the object's data in the blob file, or 0 if the data
+//        isn't there (uint64_t).
+//
+// The blob file starts with the blob magic (size_t), followed by the data of
+// the objects, which may include some that were removed.
 
 #ifndef __OBJECT_ARCHIVE_IMPL_HPP__
 #define __OBJECT_ARCHIVE_IMPL_HPP__
 
 #include "object_archive.hpp"
+#include "frozen_archive.hpp"
 
 #include <algorithm>
 #include <boost/filesystem.hpp>
+#include <boost/iostreams/device/array.hpp>
 #include <boost/iostreams/filtering_stream.hpp>
 #include <boost/iostreams/filter/zlib.hpp>
+#include <limits>
 
 #if ENABLE_THREADS
 #define OBJECT_ARCHIVE_MUTEX_GUARD \
@@ -22,151 +59,644 @@
 #define OBJECT_ARCHIVE_MUTEX_GUARD do { } while(0)
 #endif
 
-template <class Key>
-ObjectArchive<Key>::ObjectArchive():
+#if ENABLE_THREADS && BOOST_OS_LINUX
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+template <class Key, class Serializer>
+size_t const ObjectArchive<Key, Serializer>::header_magic;
+
+template <class Key, class Serializer>
+unsigned int const ObjectArchive<Key, Serializer>::header_version;
+
+template <class Key, class Serializer>
+size_t const ObjectArchive<Key, Serializer>::blob_magic;
+
+template <class Key, class Serializer>
+size_t const ObjectArchive<Key, Serializer>::index_magic;
+
+template <class Key, class Serializer>
+ObjectArchive<Key, Serializer>::ObjectArchive():
+  ObjectArchive(storage_file) { }
+
+template <class Key, class Serializer>
+ObjectArchive<Key, Serializer>::ObjectArchive(StorageBackend backend):
   must_rebuild_file_(false),
   max_buffer_size_(0),
   buffer_size_(0),
-  temporary_file_(false) {
+  drop_evicted_(false),
+  temporary_file_(false),
+  storage_backend_(backend),
+  io_uring_depth_(0),
+  dictionary_id_(0),
+  dictionary_threshold_(4096),
+  chunk_size_(0),
+  contiguous_arrays_(false),
+  checksums_(false),
+  checksum_verification_(verify_file_reads),
+  scrub_next_(0),
+  deduplication_(false),
+  max_delta_chain_(0),
+  block_object_size_(0),
+  block_size_(1 << 16),
+  blob_threshold_(0),
+  direct_io_(false),
+  fast_capacity_(0),
+  access_clock_(0),
+  tier_stats_(),
+  warm_restart_(false),
+  warm_prefetch_(false),
+  warm_fitted_(false),
+  file_layout_(),
+  entries_begin_(0),
+  n_file_entries_(0),
+  lazy_index_(false),
+  index_slots_(0),
+  ordered_built_(false) {
+    block_cache_.set_max_size(1 << 24);
     init();
     set_buffer_size(0);
 }
 
-template <class Key>
-ObjectArchive<Key>::~ObjectArchive() {
+template <class Key, class Serializer>
+ObjectArchive<Key, Serializer>::~ObjectArchive() {
+#if ENABLE_THREADS
+  stop_scrubber();
+  stop_prefetcher();
+#endif
+
   OBJECT_ARCHIVE_MUTEX_GUARD;
 
-  if (!temporary_file_)
+  // Memory is lost anyway.
+  if (!temporary_file_ && storage_backend_ != storage_memory)
     internal_flush();
-  stream_.close();
-  if (temporary_file_)
-    boost::filesystem::remove(filename_);
+  close_files();
 }
 
-template <class Key>
+template <class Key, class Serializer>
 template <class T>
-std::string ObjectArchive<Key>::serialize(T const& val) {
-  std::stringstream stream;
+std::string ObjectArchive<Key, Serializer>::serialize(T const& val) {
+  std::string data;
   {
     boost::iostreams::filtering_stream<boost::iostreams::output> filtering;
     filtering.push(boost::iostreams::zlib_compressor());
-    filtering.push(stream);
-    boost::archive::binary_oarchive ofs(filtering);
-    ofs << val;
+    filtering.push(boost::iostreams::back_inserter(data));
+    Serializer::save(filtering, val);
   }
 
-  return stream.str();
+  return data;
 }
 
-template <class Key>
+template <class Key, class Serializer>
 template <class T1, class T2>
-std::string ObjectArchive<Key>::serialize(T2 const& val) {
-  std::stringstream stream;
+std::string ObjectArchive<Key, Serializer>::serialize(T2 const& val) {
+  std::string data;
   {
     boost::iostreams::filtering_stream<boost::iostreams::output> filtering;
     filtering.push(boost::iostreams::zlib_compressor());
-    filtering.push(stream);
-    boost::archive::binary_oarchive ofs(filtering);
-    ofs.register_type<T1>();
-    ofs << val;
+    filtering.push(boost::iostreams::back_inserter(data));
+    Serializer::template save_registered<T1>(filtering, val);
   }
 
-  return stream.str();
+  return data;
 }
 
-template <class Key>
+template <class Key, class Serializer>
 template <class T>
-void ObjectArchive<Key>::deserialize(std::string const& str, T& val) {
-  std::stringstream stream(str);
+void ObjectArchive<Key, Serializer>::deserialize(std::string const& str,
+    T& val) {
   boost::iostreams::filtering_stream<boost::iostreams::input> filtering;
   filtering.push(boost::iostreams::zlib_decompressor());
-  filtering.push(stream);
-  boost::archive::binary_iarchive ifs(filtering);
+  filtering.push(boost::iostreams::array_source(str.data(), str.size()));
+  Serializer::load(filtering, val);
+}
+
+template <class Key, class Serializer>
+template <class T>
+std::string const& ObjectArchive<Key, Serializer>::serialize_uncompressed(
+    T const& val) {
+  ThreadOutput& output = thread_output();
+
+  // Discards anything left by a previous call that failed.
+  output.stream.flush();
+  output.stream.clear();
+  output.buffer.clear();
+
+  Serializer::save(output.stream, val);
+  output.stream.flush();
+
+  return output.buffer;
+}
+
+template <class Key, class Serializer>
+template <class T>
+void ObjectArchive<Key, Serializer>::deserialize_uncompressed(
+    std::string const& str, T& val) {
+  boost::iostreams::stream<boost::iostreams::array_source> stream(str.data(),
+      str.size());
+  Serializer::load(stream, val);
+}
+
+template <class Key, class Serializer>
+typename ObjectArchive<Key, Serializer>::ThreadOutput&
+ObjectArchive<Key, Serializer>::thread_output() {
+  static thread_local ThreadOutput output;
+  return output;
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::ThreadOutput::trim() {
+  if (buffer.capacity() > max_kept_size)
+    std::string().swap(buffer);
+}
+
+template <class Key, class Serializer>
+template <class T>
+std::string ObjectArchive<Key, Serializer>::encode(T const& val) const {
+  return encode(val, ArrayRecord::is_supported<T>());
+}
+
+template <class Key, class Serializer>
+template <class T>
+std::string ObjectArchive<Key, Serializer>::encode(T const& val,
+    std::true_type) const {
+  if (contiguous_arrays_)
+    return ArrayRecord::encode(val);
+  return encode(val, std::false_type());
+}
+
+template <class Key, class Serializer>
+template <class T>
+std::string ObjectArchive<Key, Serializer>::encode(T const& val,
+    std::false_type) const {
+  bool use_dictionary = !dictionaries_.empty() && dictionary_threshold_ > 0;
+  if (!use_dictionary && chunk_size_ == 0 && block_object_size_ == 0)
+    return serialize(val);
+
+  std::string const& data = serialize_uncompressed(val);
+
+  // Objects that will be packed are compressed with their block instead. The
+  // stream's header may take them over the size of packed objects, and then
+  // they aren't packed and are compressed on their own.
+  std::string ret;
+  if (chunk_size_ > 0 && data.size() > chunk_size_)
+    ret = ZlibCodec::compress_chunked(data, chunk_size_, pool_.get());
+  else {
+    if (block_object_size_ > 0 && data.size() <= block_object_size_)
+      ret = ZlibCodec::compress(data, nullptr, Z_NO_COMPRESSION);
+    if (ret.empty() || ret.size() > block_object_size_) {
+      if (!use_dictionary || data.size() > dictionary_threshold_)
+        ret = ZlibCodec::compress(data);
+      else
+        ret = ZlibCodec::compress(data, &dictionaries_.at(dictionary_id_));
+    }
+  }
+
+  thread_output().trim();
+  return ret;
+}
+
+template <class Key, class Serializer>
+template <class T>
+void ObjectArchive<Key, Serializer>::decode(std::string const& str,
+    T& val) const {
+  decode(str, val, ArrayRecord::is_supported<T>());
+}
+
+template <class Key, class Serializer>
+template <class T>
+void ObjectArchive<Key, Serializer>::decode(std::string const& str,
+    T& val, std::true_type) const {
+  if (ArrayRecord::is_array(str))
+    ArrayRecord::decode(str, val);
+  else
+    decode(str, val, std::false_type());
+}
+
+template <class Key, class Serializer>
+template <class T>
+void ObjectArchive<Key, Serializer>::decode(std::string const& str,
+    T& val, std::false_type) const {
+  if (dictionaries_.empty() && !ZlibCodec::is_chunked(str))
+    deserialize(str, val);
+  else
+    deserialize_uncompressed(
+        ZlibCodec::decompress(str, dictionaries_, pool_.get()), val);
+}
 
-  ifs >> val;
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::init() {
+  // Memory doesn't need a name.
+  init(storage_backend_ == storage_memory ? std::string() :
+      temporary_filename(), true);
 }
 
-template <class Key>
-void ObjectArchive<Key>::init() {
+template <class Key, class Serializer>
+std::string ObjectArchive<Key, Serializer>::temporary_filename() {
   std::string filename;
   filename = boost::filesystem::temp_directory_path().string();
   filename += '/';
   filename += boost::filesystem::unique_path().string();
-
-  init(filename, true);
+  return filename;
 }
 
-template <class Key>
-void ObjectArchive<Key>::init(std::string const& filename,
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::init(std::string const& filename,
     bool temporary_file) {
   OBJECT_ARCHIVE_MUTEX_GUARD;
 
   internal_flush();
-
-  stream_.close();
-  if (temporary_file_)
-    boost::filesystem::remove(filename_);
+  close_files();
+  compressed_tier_.clear();
 
   filename_ = filename;
   temporary_file_ = temporary_file;
+  ordered_built_ = false;
+  ordered_keys_.clear();
+  ordered_new_keys_.clear();
+
+  open_file();
+
+  // A flush opens the file again, but keeps the buffer empty.
+  load_warm_keys();
+}
 
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::open_file() {
   buffer_size_ = 0;
   objects_.clear();
   LRU_.clear();
-
-  stream_.open(filename, std::ios_base::in | std::ios_base::out |
-                         std::ios_base::binary);
-  stream_.seekg(0, std::ios_base::end);
+  access_clock_ = 0;
+  tier_stats_ = TierStats();
+  dictionaries_.clear();
+  scrub_queue_.clear();
+  scrub_next_ = 0;
+  extents_.clear();
+  buffered_extents_.clear();
+  block_cache_.clear();
+  open_block_.clear();
+  open_block_keys_.clear();
+  file_layout_ = EntryLayout();
+  entries_begin_ = n_file_entries_ = 0;
+  index_storage_.reset();
+  index_removed_.clear();
+
+  if (!storage_) {
+    storage_.reset(new_storage());
+    storage_->open(filename_, false);
+  }
 
   // If the file seems ok and has entries, use it. Otherwise, overwrite.
-  if (stream_.good() && stream_.tellg() > 0) {
-    stream_.seekg(0);
-
-    size_t n_entries;
-    stream_.read((char*)&n_entries, sizeof(size_t));
-
-    for (size_t i = 0; i < n_entries; i++) {
-      size_t key_size;
-      size_t data_size;
-      stream_.read((char*)&key_size, sizeof(size_t));
-      stream_.read((char*)&data_size, sizeof(size_t));
-
-      std::string key_string;
-      key_string.resize(key_size);
-      stream_.read(&key_string[0], key_size);
-
-      Key key;
-      deserialize(key_string, key);
-
-      ObjectEntry entry;
-      entry.index_in_file = stream_.tellg();
-      entry.size = data_size;
-      entry.modified = false;
-      auto it = objects_.emplace(key, entry).first;
-      it->second.key = &it->first;
+  if (storage_->is_open() && storage_->size() > 0) {
+    StorageReader reader(*storage_);
 
-      stream_.seekg(data_size, std::ios_base::cur);
+    size_t n_entries = 0;
+    reader.read((char*)&n_entries, sizeof(size_t));
+
+    unsigned int serializer_version = 0;
+    size_t file_block_object_size = 0, file_blob_threshold = 0;
+    if (n_entries == header_magic) {
+      size_t header_size = 0;
+      reader.read((char*)&header_size, sizeof(size_t));
+
+      std::string header_string;
+      header_string.resize(header_size);
+      reader.read(&header_string[0], header_size);
+
+      // The header doesn't depend on the serializer used for objects.
+      Header header;
+      ObjectArchive<Key>::deserialize(header_string, header);
+      dictionaries_.swap(header.dictionaries);
+      dictionary_id_ = header.dictionary_id;
+      serializer_version = header.serializer_version;
+      file_layout_.checksums = header.checksums;
+      file_layout_.deduplication = header.deduplication;
+      file_block_object_size = header.block_object_size;
+      file_blob_threshold = header.blob_threshold;
+      if (header.blob_filename.size())
+        blob_filename_ = header.blob_filename;
+      if (header.fast_capacity)
+        fast_capacity_ = header.fast_capacity;
+
+      // Blocks are read when their objects are loaded.
+      if (file_block_object_size) {
+        block_size_ = header.block_size;
+        size_t blocks_size = 0;
+        reader.read((char*)&blocks_size, sizeof(size_t));
+        reader.skip(blocks_size);
+      }
+
+      reader.read((char*)&n_entries, sizeof(size_t));
+    }
+    file_layout_.blocks = file_block_object_size > 0;
+    file_layout_.blobs = file_blob_threshold > 0;
+    entries_begin_ = reader.tell();
+    n_file_entries_ = n_entries;
+
+    // Objects written with another format can't be read.
+    if (n_entries > 0 && serializer_version != Serializer::format_version())
+      throw boost::archive::archive_exception(
+          boost::archive::archive_exception::unsupported_version);
+
+    // Checksums requested for a file without them are added on the next flush.
+    if (file_layout_.checksums)
+      checksums_ = true;
+    else if (checksums_ && n_entries > 0)
+      must_rebuild_file_ = true;
+
+    if (file_layout_.deduplication)
+      deduplication_ = true;
+    else if (deduplication_ && n_entries > 0)
+      must_rebuild_file_ = true;
+
+    if (file_block_object_size)
+      block_object_size_ = file_block_object_size;
+    else if (block_object_size_ && n_entries > 0)
+      must_rebuild_file_ = true;
+
+    if (file_blob_threshold) {
+      blob_threshold_ = file_blob_threshold;
+      open_blob_file();
+    }
+    else if (blob_threshold_ && n_entries > 0)
+      must_rebuild_file_ = true;
+
+    // With the lazy index, entries are read when their keys are used.
+    if (!lazy_index_ || !open_index(n_entries)) {
+      std::vector<std::pair<uint64_t, uint64_t>> records;
+      for (size_t i = 0; i < n_entries; i++) {
+        size_t position = reader.tell();
+
+        Key key;
+        ObjectEntry entry;
+        std::string key_string;
+        bool has_data = parse_entry(reader, key, entry, key_string);
+        add_entry(key, entry, has_data);
+
+        if (lazy_index_)
+          records.emplace_back(XXHash64::hash(key_string.data(),
+                key_string.size()), position);
+      }
+
+      if (lazy_index_)
+        write_index(records, storage_->size());
     }
   }
   else {
-    stream_.close();
-    stream_.open(filename, std::ios_base::in | std::ios_base::out |
-        std::ios_base::binary | std::ios_base::trunc);
+    storage_->truncate(0);
     // Consistency on crash if there's no previous flush.
     // Assumes there are no entries.
     size_t n_entries = 0;
-    stream_.write((char*)&n_entries, sizeof(size_t));
+    storage_->write(0, (char*)&n_entries, sizeof(size_t));
+  }
+}
+
+template <class Key, class Serializer>
+bool ObjectArchive<Key, Serializer>::parse_entry(StorageReader& reader,
+    Key& key, ObjectEntry& entry, std::string& key_string) {
+  size_t key_size = 0;
+  size_t data_size = 0;
+  reader.read((char*)&key_size, sizeof(size_t));
+  reader.read((char*)&data_size, sizeof(size_t));
+
+  uint32_t key_checksum = 0, data_checksum = 0;
+  if (file_layout_.checksums) {
+    reader.read((char*)&key_checksum, sizeof(uint32_t));
+    reader.read((char*)&data_checksum, sizeof(uint32_t));
+  }
+
+  uint64_t hash = 0, reference = 0;
+  if (file_layout_.deduplication) {
+    reader.read((char*)&hash, sizeof(uint64_t));
+    reader.read((char*)&reference, sizeof(uint64_t));
+  }
+
+  uint64_t block = 0, slot = 0;
+  if (file_layout_.blocks) {
+    reader.read((char*)&block, sizeof(uint64_t));
+    reader.read((char*)&slot, sizeof(uint64_t));
+  }
+
+  uint64_t blob = 0;
+  if (file_layout_.blobs)
+    reader.read((char*)&blob, sizeof(uint64_t));
+
+  key_string.resize(key_size);
+  reader.read(&key_string[0], key_size);
+
+  if (file_layout_.checksums && checksum_verification_ != verify_none &&
+      CRC32C::compute(key_string.data(), key_size) != key_checksum)
+    throw ChecksumError("ObjectArchive: corrupted key in " + filename_);
+
+  deserialize(key_string, key);
+
+  entry.index_in_file = reader.tell();
+  entry.size = data_size;
+  entry.modified = false;
+  entry.checksum = data_checksum;
+  entry.has_checksum = file_layout_.checksums;
+  entry.hash = hash;
+  entry.has_hash = file_layout_.deduplication;
+  entry.delta_size = 0;
+  entry.delta_chain = 0;
+  entry.has_base = false;
+  entry.packed = block != 0;
+  entry.slot = slot;
+  entry.in_blob = blob != 0;
+  entry.last_access = 0;
+  if (block)
+    entry.index_in_file = block;
+  else if (blob)
+    entry.index_in_file = blob;
+  else if (reference)
+    entry.index_in_file = reference;
+  else {
+    reader.skip(data_size);
+    return true;
+  }
+
+  return false;
+}
+
+template <class Key, class Serializer>
+typename std::unordered_map<Key,
+         typename ObjectArchive<Key, Serializer>::ObjectEntry>::iterator
+ObjectArchive<Key, Serializer>::add_entry(Key const& key,
+    ObjectEntry const& entry, bool has_data) {
+  if (has_data && entry.has_hash)
+    extents_.emplace(entry.hash, std::make_pair(entry.index_in_file,
+          entry.size));
+
+  auto it = objects_.emplace(key, entry).first;
+  it->second.key = &it->first;
+  return it;
+}
+
+template <class Key, class Serializer>
+typename std::unordered_map<Key,
+         typename ObjectArchive<Key, Serializer>::ObjectEntry>::iterator
+ObjectArchive<Key, Serializer>::find_object(Key const& key) {
+  auto it = objects_.find(key);
+  if (it != objects_.end() || !index_storage_ || index_removed_.count(key))
+    return it;
+
+  // Keys are probed linearly from their hash, and a hash can be shared.
+  std::string key_string = serialize(key);
+  uint64_t hash = XXHash64::hash(key_string.data(), key_string.size());
+  for (size_t i = 0; i < index_slots_; i++) {
+    size_t slot = (hash + i) & (index_slots_ - 1);
+    uint64_t record[2];
+    size_t position = 4 * sizeof(uint64_t) + slot * sizeof(record);
+    if (!index_storage_->read(position, (char*)record, sizeof(record)) ||
+        record[1] == 0)
+      break;
+    if (record[0] != hash)
+      continue;
+
+    StorageReader reader(*storage_, record[1], 4096);
+    Key file_key;
+    ObjectEntry entry;
+    bool has_data = parse_entry(reader, file_key, entry, key_string);
+    if (file_key == key)
+      return add_entry(file_key, entry, has_data);
+  }
+
+  return objects_.end();
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::load_all_entries() {
+  if (!index_storage_)
+    return;
+
+  // Entries already read, or removed since, are kept as they are.
+  index_storage_.reset();
+  StorageReader reader(*storage_, entries_begin_);
+  for (size_t i = 0; i < n_file_entries_; i++) {
+    Key key;
+    ObjectEntry entry;
+    std::string key_string;
+    bool has_data = parse_entry(reader, key, entry, key_string);
+    if (!objects_.count(key) && !index_removed_.count(key))
+      add_entry(key, entry, has_data);
+  }
+  index_removed_.clear();
+}
+
+template <class Key, class Serializer>
+std::string ObjectArchive<Key, Serializer>::index_filename() const {
+  return filename_ + ".index";
+}
+
+template <class Key, class Serializer>
+bool ObjectArchive<Key, Serializer>::open_index(size_t n_entries) {
+  if (temporary_file_ || storage_backend_ == storage_memory ||
+      !boost::filesystem::exists(index_filename()))
+    return false;
+
+  std::unique_ptr<Storage> index(new MmapStorage());
+  if (!index->open(index_filename(), false))
+    return false;
+
+  // The index begins with its magic, the size of the archive's file and the
+  // number of entries when it was written, and its number of slots.
+  uint64_t header[4];
+  if (!index->read(0, (char*)header, sizeof(header)) ||
+      header[0] != index_magic || header[1] != storage_->size() ||
+      header[2] != n_entries || header[3] == 0 ||
+      (header[3] & (header[3] - 1)) != 0 ||
+      index->size() != sizeof(header) + 2 * sizeof(uint64_t) * header[3])
+    return false;
+
+  index_slots_ = header[3];
+  index_storage_ = std::move(index);
+  return true;
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::write_index(
+    std::vector<std::pair<uint64_t, uint64_t>> const& records,
+    size_t archive_size) {
+  if (temporary_file_ || storage_backend_ == storage_memory)
+    return;
+
+  // At most half of the slots are used, so probes are short. Each slot holds
+  // the hash and the position of the entry, which is 0 if it's empty.
+  size_t n_slots = 1;
+  while (n_slots < 2 * records.size())
+    n_slots *= 2;
+
+  std::vector<uint64_t> slots(2 * n_slots, 0);
+  for (auto& record : records) {
+    size_t slot = record.first & (n_slots - 1);
+    while (slots[2 * slot + 1])
+      slot = (slot + 1) & (n_slots - 1);
+    slots[2 * slot] = record.first;
+    slots[2 * slot + 1] = record.second;
+  }
+
+  uint64_t header[4] = { index_magic, archive_size, records.size(), n_slots };
+  FileStorage index;
+  if (index.open(index_filename(), true)) {
+    index.write(0, (char*)header, sizeof(header));
+    index.write(sizeof(header), (char*)slots.data(),
+        slots.size() * sizeof(uint64_t));
+  }
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::close_files() {
+  storage_.reset();
+  blob_storage_.reset();
+
+  if (temporary_file_ && storage_backend_ != storage_memory) {
+    boost::filesystem::remove(filename_);
+    boost::filesystem::remove(blob_filename());
+  }
+}
+
+template <class Key, class Serializer>
+Storage* ObjectArchive<Key, Serializer>::new_storage() const {
+  switch (storage_backend_) {
+    case storage_mmap:
+      return new MmapStorage();
+    case storage_io_uring:
+      return new IoUringStorage(io_uring_depth_);
+    case storage_memory:
+      return new MemoryStorage();
+    default:
+      return new FileStorage();
+  }
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::replace_file(
+    std::unique_ptr<Storage>& storage, std::unique_ptr<Storage>& temp_storage,
+    std::string const& filename, std::string const& temp_filename) const {
+  if (storage_backend_ == storage_memory) {
+    storage = std::move(temp_storage);
+    return;
   }
+
+  // The file is opened again when it's needed.
+  storage.reset();
+  temp_storage.reset();
+  boost::filesystem::remove(filename);
+  boost::filesystem::copy(temp_filename, filename);
+  boost::filesystem::remove(temp_filename);
 }
 
-template <class Key>
-void ObjectArchive<Key>::set_buffer_size(size_t max_buffer_size) {
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::set_buffer_size(size_t max_buffer_size) {
   max_buffer_size_ = max_buffer_size;
   unload(max_buffer_size);
 }
 
-template <class Key>
-void ObjectArchive<Key>::set_buffer_size(std::string const& max_buffer_size) {
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::set_buffer_size(
+    std::string const& max_buffer_size) {
   size_t length = max_buffer_size.size();
   double buffer_size = atof(max_buffer_size.c_str());
 
@@ -197,8 +727,9 @@ void ObjectArchive<Key>::set_buffer_size(std::string const& max_buffer_size) {
 #if BOOST_OS_LINUX
 #include <sys/sysinfo.h>
 
-template <class Key>
-void ObjectArchive<Key>::set_buffer_size_scale(float max_buffer_size) {
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::set_buffer_size_scale(
+    float max_buffer_size) {
   struct sysinfo info;
   if (sysinfo(&info) == 0) {
     unsigned long freeram = info.freeram;
@@ -207,287 +738,2253 @@ void ObjectArchive<Key>::set_buffer_size_scale(float max_buffer_size) {
 }
 #endif
 
-template <class Key>
-size_t ObjectArchive<Key>::get_max_buffer_size() const {
+template <class Key, class Serializer>
+size_t ObjectArchive<Key, Serializer>::get_max_buffer_size() const {
   return max_buffer_size_;
 }
 
-template <class Key>
-size_t ObjectArchive<Key>::get_buffer_size() const {
+template <class Key, class Serializer>
+size_t ObjectArchive<Key, Serializer>::get_buffer_size() const {
   return buffer_size_;
 }
 
-template <class Key>
-void ObjectArchive<Key>::remove(Key const& key) {
-  if (!is_available(key))
-    return;
-
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::set_compressed_tier(size_t max_size,
+    int level) {
   OBJECT_ARCHIVE_MUTEX_GUARD;
+  compressed_tier_.set_max_size(max_size, level);
+}
 
-  auto it = objects_.find(key);
-  if (it == objects_.end())
-    return;
-
-  ObjectEntry entry = it->second;
-  if (entry.data.size())
-    buffer_size_ -= entry.size;
-  objects_.erase(key);
-  LRU_.remove(&entry);
-  must_rebuild_file_ = true;
+template <class Key, class Serializer>
+size_t ObjectArchive<Key, Serializer>::get_compressed_tier_size() const {
+  return compressed_tier_.size();
 }
 
-template <class Key>
-void ObjectArchive<Key>::change_key(Key const& old_key, Key const& new_key) {
-  if (!is_available(old_key))
-    return;
+template <class Key, class Serializer>
+size_t ObjectArchive<Key, Serializer>::get_compressed_tier_hits() const {
+  return compressed_tier_.hits();
+}
 
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::set_drop_evicted(bool enable) {
   OBJECT_ARCHIVE_MUTEX_GUARD;
+  drop_evicted_ = enable;
+}
 
-  auto it = objects_.find(old_key);
-  if (it == objects_.end())
-    return;
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::set_warm_restart(bool enable,
+    bool prefetch) {
+#if ENABLE_THREADS
+  if (!enable || !prefetch)
+    stop_prefetcher();
+#endif
 
-  ObjectEntry entry = it->second;
+  OBJECT_ARCHIVE_MUTEX_GUARD;
 
-  objects_.erase(old_key);
-  LRU_.remove(&entry);
+  bool was_enabled = warm_restart_;
+  warm_restart_ = enable;
+  warm_prefetch_ = prefetch;
 
-  auto it2 = objects_.emplace(new_key, entry).first;
-  it2->second.key = &it2->first;
-  touch_LRU(&it2->second);
+  // The file was opened without reading the keys.
+  if (!enable)
+    warm_keys_.clear();
+  else if (!was_enabled)
+    load_warm_keys();
+}
 
-  must_rebuild_file_ = true;
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::set_lazy_index(bool enable) {
+  OBJECT_ARCHIVE_MUTEX_GUARD;
+  lazy_index_ = enable;
+  if (!enable)
+    load_all_entries();
 }
 
-template <class Key>
-template <class T>
-size_t ObjectArchive<Key>::insert(Key const& key, T const& obj,
-    bool keep_in_buffer) {
-  return insert_raw(key, serialize(obj), keep_in_buffer);
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::freeze(std::string const& filename) {
+  OBJECT_ARCHIVE_MUTEX_GUARD;
+  load_all_entries();
+
+  std::vector<std::string> keys;
+  std::vector<ObjectEntry const*> entries;
+  keys.reserve(objects_.size());
+  entries.reserve(objects_.size());
+  for (auto& it : objects_) {
+    keys.push_back(serialize(it.first));
+    entries.push_back(&it.second);
+  }
+
+  FrozenArchive<Key, Serializer>::write(filename, dictionaries_, keys,
+      [&](size_t i, std::string& data) { read_entry(*entries[i], data); });
 }
 
-template <class Key>
-size_t ObjectArchive<Key>::insert_raw(Key const& key, std::string const& data,
-    bool keep_in_buffer) {
-  // Makes sure we call the local method, not its virtualization
-  return ObjectArchive<Key>::insert_raw(key, std::string(data), keep_in_buffer);
+template <class Key, class Serializer>
+size_t ObjectArchive<Key, Serializer>::prefetch_warm() {
+  size_t n_loaded = 0;
+  while (prefetch_warm_batch(n_loaded));
+  return n_loaded;
 }
 
-template <class Key>
-size_t ObjectArchive<Key>::insert_raw(Key const& key, std::string&& data,
-    bool keep_in_buffer) {
-  size_t size = data.size();
-  if (size > max_buffer_size_)
-    keep_in_buffer = false;
+template <class Key, class Serializer>
+size_t ObjectArchive<Key, Serializer>::train_dictionary(size_t max_samples) {
+  OBJECT_ARCHIVE_MUTEX_GUARD;
+  load_all_entries();
 
-  // Makes sure we call the local method, not its virtualization
-  ObjectArchive<Key>::remove(key);
+  std::vector<std::string> samples;
+  for (auto& it : objects_) {
+    if (samples.size() >= max_samples)
+      break;
+
+    // Arrays aren't compressed, and so aren't samples.
+    std::string data;
+    read_entry(it.second, data);
+    if (ArrayRecord::is_array(data))
+      continue;
+
+    data = ZlibCodec::decompress(data, dictionaries_);
+    if (data.size() <= dictionary_threshold_)
+      samples.push_back(std::move(data));
+  }
 
-  if (size + buffer_size_ > max_buffer_size_ && keep_in_buffer)
-    unload(max_buffer_size_ - size);
+  std::string dictionary = ZlibCodec::train_dictionary(samples);
+  if (dictionary.size())
+    set_dictionary(dictionary);
+
+  return dictionary.size();
+}
 
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::set_dictionary(
+    std::string const& dictionary) {
   OBJECT_ARCHIVE_MUTEX_GUARD;
 
-  buffer_size_ += size;
+  dictionary_id_ = ZlibCodec::dictionary_id(dictionary);
+  dictionaries_[dictionary_id_] = dictionary;
+  must_rebuild_file_ = true;
+}
 
-  ObjectEntry entry;
-  entry.data.swap(data);
-  entry.size = size;
-  entry.modified = true;
-  auto it = objects_.emplace(key, entry).first;
-  it->second.key = &it->first;
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::set_dictionary_threshold(
+    size_t threshold) {
+  dictionary_threshold_ = threshold;
+}
 
-  touch_LRU(&it->second);
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::set_chunked_compression(size_t chunk_size,
+    unsigned int n_threads) {
+  OBJECT_ARCHIVE_MUTEX_GUARD;
 
-  if (!keep_in_buffer)
-    write_back(it);
+  chunk_size_ = chunk_size;
+  if (!pool_ || pool_->size() != n_threads)
+    pool_.reset(new ThreadPool(n_threads));
+}
 
-  return size;
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::set_contiguous_arrays(bool enable) {
+  contiguous_arrays_ = enable;
 }
 
-template <class Key>
-template <class T>
-size_t ObjectArchive<Key>::load(Key const& key, T& obj, bool keep_in_buffer) {
-  std::string s;
-  size_t ret = load_raw(key, s, keep_in_buffer);
-  if (ret == 0) return 0;
-  deserialize(s, obj);
-  return ret;
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::set_checksums(bool enable) {
+  OBJECT_ARCHIVE_MUTEX_GUARD;
+
+  if (checksums_ != enable)
+    must_rebuild_file_ = true;
+  checksums_ = enable;
 }
 
-template <class Key>
-size_t ObjectArchive<Key>::load_raw(Key const& key, std::string& data,
-    bool keep_in_buffer) {
-  if (!is_available(key))
-    return 0;
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::set_checksum_verification(
+    ChecksumVerification verification) {
+  checksum_verification_ = verification;
+}
 
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::set_deduplication(bool enable) {
   OBJECT_ARCHIVE_MUTEX_GUARD;
 
-  auto it = objects_.find(key);
-  if (it == objects_.end())
-    return 0;
+  if (deduplication_ != enable)
+    must_rebuild_file_ = true;
+  deduplication_ = enable;
+}
 
-  ObjectEntry& entry = it->second;
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::set_delta_encoding(
+    unsigned int max_chain) {
+  max_delta_chain_ = max_chain;
+}
 
-  size_t size = entry.size;
-  if (size > max_buffer_size_)
-    keep_in_buffer = false;
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::set_block_packing(size_t max_object_size,
+    size_t block_size, size_t cache_size) {
+  OBJECT_ARCHIVE_MUTEX_GUARD;
 
-  // If the result isn't in the buffer, we must read it.
-  if (entry.data.size() == 0) {
-    // Only check for size if we have to load.
-    if (size + buffer_size_ > max_buffer_size_ && keep_in_buffer)
-      unload(max_buffer_size_ - size);
+  if (block_object_size_ != max_object_size || block_size_ != block_size)
+    must_rebuild_file_ = true;
+  block_object_size_ = max_object_size;
+  block_size_ = block_size;
+  block_cache_.set_max_size(cache_size);
+}
 
-    stream_.seekg(entry.index_in_file);
-    std::string& buf = entry.data;
-    buf.resize(size);
-    stream_.read(&buf[0], size);
-    buffer_size_ += size;
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::set_blob_storage(size_t threshold) {
+  OBJECT_ARCHIVE_MUTEX_GUARD;
 
-    entry.modified = false;
-  }
+  if (blob_threshold_ != threshold)
+    must_rebuild_file_ = true;
+  blob_threshold_ = threshold;
+}
 
-  touch_LRU(&entry);
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::set_slow_tier(std::string const& filename,
+    size_t fast_capacity) {
+  OBJECT_ARCHIVE_MUTEX_GUARD;
 
-  if (!keep_in_buffer) {
-    if (!entry.modified)
-      data.swap(entry.data);
+  if (blob_threshold_ == 0)
+    blob_threshold_ = std::numeric_limits<size_t>::max();
+
+  // Objects already in the blob file are moved with it.
+  std::string old_filename = blob_filename();
+  if (filename != old_filename && storage_backend_ != storage_memory) {
+    if (boost::filesystem::exists(old_filename)) {
+      open_blob_file();
+      std::unique_ptr<Storage> storage = open_blob_storage(filename, true);
+      storage->copy(*blob_storage_);
+      blob_storage_ = std::move(storage);
+      boost::filesystem::remove(old_filename);
+    }
     else
-      data = entry.data;
-
-    write_back(it);
+      blob_storage_.reset();
   }
-  else
-    data = entry.data;
 
-  return size;
+  blob_filename_ = filename;
+  fast_capacity_ = fast_capacity;
+  must_rebuild_file_ = true;
 }
 
-template <class Key>
-void ObjectArchive<Key>::unload(size_t desired_size) {
-  OBJECT_ARCHIVE_MUTEX_GUARD;
-  while (buffer_size_ > desired_size)
-    write_back(*LRU_.back()->key);
+template <class Key, class Serializer>
+typename ObjectArchive<Key, Serializer>::TierStats
+ObjectArchive<Key, Serializer>::get_tier_stats() const {
+  return tier_stats_;
 }
 
-template <class Key>
-bool ObjectArchive<Key>::is_available(Key const& key) {
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::reset_tier_stats() {
   OBJECT_ARCHIVE_MUTEX_GUARD;
-  if (objects_.count(key) == 0)
-    return false;
-  return true;
+  tier_stats_ = TierStats();
 }
 
-template <class Key>
-std::list<Key const*> ObjectArchive<Key>::available_objects() {
-  std::list<Key const*> list;
-
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::set_direct_io(bool enable) {
   OBJECT_ARCHIVE_MUTEX_GUARD;
-  for (auto& it : objects_)
-    list.push_front(it.second.key);
 
-  return list;
+  // The blob file is opened again in the new mode when it's needed.
+  direct_io_ = enable;
+  if (storage_backend_ != storage_memory)
+    blob_storage_.reset();
 }
 
-template <class Key>
-void ObjectArchive<Key>::flush() {
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::set_storage(StorageBackend backend) {
   OBJECT_ARCHIVE_MUTEX_GUARD;
 
+  StorageBackend old_backend = storage_backend_;
+  storage_backend_ = backend;
+
+  // Archives created in memory have no file yet.
+  if (filename_.empty() && backend != storage_memory)
+    filename_ = temporary_filename();
+
+  // Positions don't change, so the entries remain valid. Files are opened
+  // again with the new backend, while memory is copied.
+  bool copy = old_backend == storage_memory || backend == storage_memory;
+  std::unique_ptr<Storage> storage(new_storage());
+  if (copy) {
+    storage->open(filename_, true);
+    storage->copy(*storage_);
+  }
+  else {
+    storage_.reset();
+    storage->open(filename_, false);
+  }
+  storage_ = std::move(storage);
+
+  if (blob_storage_) {
+    if (copy) {
+      std::unique_ptr<Storage> blob_storage = open_blob_storage(
+          blob_filename(), true);
+      blob_storage->copy(*blob_storage_);
+      blob_storage_ = std::move(blob_storage);
+    }
+    else
+      blob_storage_.reset();
+  }
+
+  // Temporary files aren't needed once their contents are in memory.
+  if (copy && backend == storage_memory && temporary_file_) {
+    boost::filesystem::remove(filename_);
+    boost::filesystem::remove(blob_filename());
+  }
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::set_io_uring(unsigned int depth) {
+  io_uring_depth_ = depth;
+  set_storage(depth > 0 ? storage_io_uring : storage_file);
+}
+
+template <class Key, class Serializer>
+size_t ObjectArchive<Key, Serializer>::scrub(size_t max_bytes) {
+  size_t bytes = 0;
+  return scrub(max_bytes, bytes);
+}
+
+template <class Key, class Serializer>
+size_t ObjectArchive<Key, Serializer>::scrub(size_t max_bytes, size_t& bytes) {
+  std::list<Key> corrupted;
+  size_t start = bytes;
+  while (bytes - start < max_bytes && scrub_next(bytes, corrupted))
+    continue;
+
+  std::function<void(Key const&)> callback;
+  {
+    OBJECT_ARCHIVE_MUTEX_GUARD;
+    callback = scrub_callback_;
+  }
+
+  // Called without the lock, so that the callback can use the archive.
+  if (callback)
+    for (auto& key : corrupted)
+      callback(key);
+
+  return corrupted.size();
+}
+
+template <class Key, class Serializer>
+bool ObjectArchive<Key, Serializer>::scrub_next(size_t& bytes,
+    std::list<Key>& corrupted) {
+  OBJECT_ARCHIVE_MUTEX_GUARD;
+
+  if (scrub_next_ >= scrub_queue_.size()) {
+    bool pass_done = !scrub_queue_.empty();
+    scrub_queue_.clear();
+    scrub_next_ = 0;
+    if (pass_done)
+      return false;
+
+    load_all_entries();
+    for (auto& it : objects_)
+      if (!it.second.modified && it.second.has_checksum)
+        scrub_queue_.emplace_back(it.second.index_in_file, it.first);
+    if (scrub_queue_.empty())
+      return false;
+
+    std::sort(scrub_queue_.begin(), scrub_queue_.end(),
+        [](std::pair<size_t, Key> const& a, std::pair<size_t, Key> const& b) {
+          return a.first < b.first;
+        });
+  }
+
+  auto const& next = scrub_queue_[scrub_next_++];
+
+  // Objects changed since the pass started aren't in the same place anymore.
+  auto it = objects_.find(next.second);
+  if (it == objects_.end() || it->second.modified ||
+      it->second.index_in_file != next.first)
+    return true;
+
+  ObjectEntry& entry = it->second;
+  uint32_t checksum = 0;
+  bool valid = true;
+
+  if (entry.delta_size || entry.packed) {
+    try {
+      std::string data;
+      read_record(entry, data);
+      checksum = CRC32C::compute(data.data(), data.size());
+    }
+    catch (boost::archive::archive_exception&) {
+      valid = false;
+    }
+    catch (boost::iostreams::zlib_error&) {
+      valid = false;
+    }
+  }
+  else {
+    std::string piece(std::min(entry.size, read_piece_size()), 0);
+    for (size_t done = 0; done < entry.size && valid; done += piece.size()) {
+      size_t n = std::min(piece.size(), entry.size - done);
+      valid = read_data(entry, done, &piece[0], n);
+      checksum = CRC32C::compute(piece.data(), n, checksum);
+    }
+  }
+  bytes += entry.size;
+
+  if (valid && checksum == entry.checksum)
+    return true;
+
+  if (entry.data.size())
+    buffer_size_ -= entry.size;
+  LRU_.remove(&entry);
+  compressed_tier_.erase(it->first);
+  corrupted.push_back(it->first);
+  quarantined_.push_back(it->first);
+  objects_.erase(it);
+  must_rebuild_file_ = true;
+
+  return true;
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::set_scrub_callback(
+    std::function<void(Key const&)> const& callback) {
+  OBJECT_ARCHIVE_MUTEX_GUARD;
+  scrub_callback_ = callback;
+}
+
+template <class Key, class Serializer>
+std::list<Key> ObjectArchive<Key, Serializer>::quarantined_objects() {
+  OBJECT_ARCHIVE_MUTEX_GUARD;
+  return quarantined_;
+}
+
+#if ENABLE_THREADS
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::prefetcher() {
+  size_t n_loaded = 0;
+  while (true) {
+    boost::this_thread::interruption_point();
+
+    // Finishing under the lock lets a new file start another prefetcher.
+    OBJECT_ARCHIVE_MUTEX_GUARD;
+    if (!prefetch_warm_batch(n_loaded)) {
+      prefetching_ = false;
+      return;
+    }
+  }
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::stop_prefetcher() {
+  prefetcher_.interrupt();
+  if (prefetcher_.joinable())
+    prefetcher_.join();
+  prefetching_ = false;
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::start_scrubber(size_t bytes_per_second) {
+  stop_scrubber();
+
+  scrubber_stop_ = false;
+  scrubber_ = boost::thread(&ObjectArchive<Key, Serializer>::scrubber, this,
+      bytes_per_second);
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::stop_scrubber() {
+  {
+    boost::lock_guard<boost::mutex> lock(scrubber_mutex_);
+    scrubber_stop_ = true;
+  }
+  scrubber_wakeup_.notify_all();
+
+  if (scrubber_.joinable())
+    scrubber_.join();
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::scrubber(size_t bytes_per_second) {
+#if BOOST_OS_LINUX
+  // Lowest CPU priority and idle IO class, which only affect this thread.
+  pid_t tid = syscall(SYS_gettid);
+  setpriority(PRIO_PROCESS, tid, 19);
+#ifdef SYS_ioprio_set
+  syscall(SYS_ioprio_set, 1, tid, 3 << 13);
+#endif
+#endif
+
+  // Every tenth of a second, scrubs a tenth of the rate minus what the last
+  // objects read beyond their share.
+  size_t budget = std::max<size_t>(bytes_per_second / 10, 1);
+  size_t debt = 0;
+
+  boost::unique_lock<boost::mutex> lock(scrubber_mutex_);
+  while (!scrubber_stop_) {
+    lock.unlock();
+    if (debt < budget)
+      scrub(budget - debt, debt);
+    debt -= std::min(debt, budget);
+    lock.lock();
+
+    scrubber_wakeup_.timed_wait(lock, boost::posix_time::milliseconds(100),
+        [this]() { return scrubber_stop_; });
+  }
+}
+#endif
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::remove(Key const& key) {
+  if (!is_available(key))
+    return;
+
+  OBJECT_ARCHIVE_MUTEX_GUARD;
+
+  compressed_tier_.erase(key);
+
+  auto it = find_object(key);
+  if (it == objects_.end())
+    return;
+
+  ObjectEntry& entry = it->second;
+  if (entry.data.size())
+    buffer_size_ -= entry.size;
+  LRU_.remove(&entry);
+  if (index_storage_)
+    index_removed_.insert(key);
+  objects_.erase(it);
+  must_rebuild_file_ = true;
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::change_key(Key const& old_key,
+    Key const& new_key) {
+  if (!is_available(old_key))
+    return;
+
+  OBJECT_ARCHIVE_MUTEX_GUARD;
+
+  auto it = find_object(old_key);
+  if (it == objects_.end())
+    return;
+
+  ObjectEntry entry = it->second;
+
+  LRU_.remove(&it->second);
+  if (index_storage_)
+    index_removed_.insert(old_key);
+  compressed_tier_.erase(old_key);
+  objects_.erase(it);
+
+  auto it2 = objects_.emplace(new_key, entry).first;
+  it2->second.key = &it2->first;
+  if (entry.data.size())
+    touch_LRU(&it2->second);
+  if (ordered_built_)
+    ordered_new_keys_.push_back(new_key);
+
+  if (entry.packed && entry.index_in_file == 0)
+    open_block_keys_[entry.slot] = new_key;
+
+  must_rebuild_file_ = true;
+}
+
+template <class Key, class Serializer>
+template <class T>
+size_t ObjectArchive<Key, Serializer>::insert(Key const& key, T const& obj,
+    bool keep_in_buffer) {
+  return insert_raw(key, encode(obj), keep_in_buffer);
+}
+
+template <class Key, class Serializer>
+size_t ObjectArchive<Key, Serializer>::insert_raw(Key const& key,
+    std::string const& data, bool keep_in_buffer) {
+  // Makes sure we call the local method, not its virtualization
+  return ObjectArchive<Key, Serializer>::insert_raw(key, std::string(data),
+      keep_in_buffer);
+}
+
+template <class Key, class Serializer>
+size_t ObjectArchive<Key, Serializer>::insert_raw(Key const& key,
+    std::string&& data, bool keep_in_buffer) {
+  size_t size = data.size();
+  if (size > max_buffer_size_)
+    keep_in_buffer = false;
+
+  // The previous version in the file is the base for a delta.
+  Extent base = Extent();
+  bool has_base = false;
+  if (max_delta_chain_ > 0) {
+    OBJECT_ARCHIVE_MUTEX_GUARD;
+
+    auto old = find_object(key);
+    if (old != objects_.end()) {
+      has_base = old->second.modified ? old->second.has_base :
+        !old->second.packed && !old->second.in_blob;
+      base = old->second.modified ? old->second.base : extent(old->second);
+    }
+  }
+
+  // Makes sure we call the local method, not its virtualization
+  ObjectArchive<Key, Serializer>::remove(key);
+
+  ObjectEntry entry;
+  entry.size = size;
+  entry.modified = true;
+  entry.has_checksum = checksums_;
+  entry.checksum = checksums_ ? CRC32C::compute(data.data(), size) : 0;
+  entry.has_hash = deduplication_;
+  entry.hash = deduplication_ ? XXHash64::hash(data.data(), size) : 0;
+  entry.delta_size = 0;
+  entry.delta_chain = 0;
+  entry.base = base;
+  entry.has_base = has_base;
+  entry.packed = false;
+  entry.slot = 0;
+  entry.in_blob = false;
+
+  // Data already in the file is shared instead of stored again.
+  if (entry.has_hash) {
+    OBJECT_ARCHIVE_MUTEX_GUARD;
+
+    if (find_extent(entry.hash, data, entry.index_in_file)) {
+      entry.modified = false;
+      entry.last_access = ++access_clock_;
+      auto it = objects_.emplace(key, entry).first;
+      it->second.key = &it->first;
+      if (ordered_built_)
+        ordered_new_keys_.push_back(key);
+      must_rebuild_file_ = true;
+      return size;
+    }
+  }
+
+  if (size + buffer_size_ > max_buffer_size_ && keep_in_buffer)
+    unload(max_buffer_size_ - size);
+
+  OBJECT_ARCHIVE_MUTEX_GUARD;
+
+  buffer_size_ += size;
+
+  entry.last_access = ++access_clock_;
+  entry.data.swap(data);
+  auto it = objects_.emplace(key, entry).first;
+  it->second.key = &it->first;
+  if (ordered_built_)
+    ordered_new_keys_.push_back(key);
+
+  touch_LRU(&it->second);
+
+  if (!keep_in_buffer)
+    write_back(it);
+
+  return size;
+}
+
+template <class Key, class Serializer>
+template <class T>
+size_t ObjectArchive<Key, Serializer>::load(Key const& key, T& obj,
+    bool keep_in_buffer) {
+  if (contiguous_arrays_) {
+    size_t ret = load_array(key, obj, keep_in_buffer,
+        ArrayRecord::is_supported<T>());
+    if (ret > 0)
+      return ret;
+  }
+
+  std::string s;
+  size_t ret = load_raw(key, s, keep_in_buffer);
+  if (ret == 0) return 0;
+  decode(s, obj);
+  return ret;
+}
+
+template <class Key, class Serializer>
+template <class T>
+size_t ObjectArchive<Key, Serializer>::load_array(Key const& key, T& obj,
+    bool keep_in_buffer, std::true_type) {
+  OBJECT_ARCHIVE_MUTEX_GUARD;
+
+  auto it = find_object(key);
+  if (it == objects_.end())
+    return 0;
+
+  ObjectEntry& entry = it->second;
+  if (entry.data.size() || entry.delta_size || entry.packed ||
+      (keep_in_buffer && entry.size <= max_buffer_size_) ||
+      compressed_tier_.contains(key))
+    return 0;
+
+  size_t header_size = ArrayRecord::header_size();
+  if (entry.size < header_size)
+    return 0;
+
+  std::string header;
+  read_entry(entry, 0, header_size, header);
+  if (!ArrayRecord::is_array(header))
+    return 0;
+
+  size_t n = ArrayRecord::count<T>(header);
+  size_t data_size = n * sizeof(typename T::value_type);
+  if (entry.size < header_size + data_size)
+    throw boost::archive::archive_exception(
+        boost::archive::archive_exception::input_stream_error);
+
+  obj.resize(n);
+  uint32_t checksum = 0;
+  if (must_verify(entry))
+    checksum = CRC32C::compute(header.data(), header_size);
+  if (data_size)
+    checksum = read_file(entry, header_size, (char*)&obj[0], data_size,
+        checksum);
+
+  // Any data after the array is part of the checksum as well.
+  if (must_verify(entry) && entry.size > header_size + data_size) {
+    std::string rest(entry.size - header_size - data_size, 0);
+    checksum = read_file(entry, header_size + data_size, &rest[0],
+        rest.size(), checksum);
+  }
+  check_checksum(entry, checksum);
+  count_access(entry, entry.in_blob ? &TierStats::blob_file : &TierStats::file);
+
+  return entry.size;
+}
+
+template <class Key, class Serializer>
+template <class T>
+size_t ObjectArchive<Key, Serializer>::load_array(Key const&, T&, bool,
+    std::false_type) {
+  return 0;
+}
+
+template <class Key, class Serializer>
+size_t ObjectArchive<Key, Serializer>::load_raw(Key const& key,
+    std::string& data, bool keep_in_buffer) {
+  if (!is_available(key))
+    return 0;
+
+  OBJECT_ARCHIVE_MUTEX_GUARD;
+
+  // Dropped objects may still be in the compressed tier.
+  auto it = find_object(key);
+  if (it == objects_.end()) {
+    if (!compressed_tier_.find(key, data))
+      return 0;
+
+    tier_stats_.compressed_tier++;
+    if (keep_in_buffer)
+      ObjectArchive<Key, Serializer>::insert_raw(key, data, true);
+    return data.size();
+  }
+
+  ObjectEntry& entry = it->second;
+
+  size_t size = entry.size;
+  if (size > max_buffer_size_)
+    keep_in_buffer = false;
+
+  // If the data is in the buffer because of another key, it's used from there.
+  if (entry.data.size() == 0 && deduplication_ && !entry.packed &&
+      !entry.in_blob) {
+    auto shared = buffered_extents_.find(entry.index_in_file);
+    if (shared != buffered_extents_.end()) {
+      auto shared_it = objects_.find(shared->second);
+      if (shared_it != objects_.end() && shared_it->second.data.size() &&
+          !shared_it->second.modified &&
+          shared_it->second.index_in_file == entry.index_in_file) {
+        ObjectEntry& shared_entry = shared_it->second;
+        if (checksum_verification_ == verify_all_reads)
+          check_checksum(entry, CRC32C::compute(shared_entry.data.data(),
+                size));
+
+        count_access(entry, &TierStats::buffer);
+        touch_LRU(&shared_entry);
+        data = shared_entry.data;
+        return size;
+      }
+      buffered_extents_.erase(shared);
+    }
+  }
+
+  // If the result isn't in the buffer, we must read it.
+  size_t TierStats::* place = &TierStats::buffer;
+  if (entry.data.size() == 0) {
+    // Only check for size if we have to load.
+    if (size + buffer_size_ > max_buffer_size_ && keep_in_buffer)
+      unload(max_buffer_size_ - size);
+
+    std::string& buf = entry.data;
+    try {
+      uint32_t checksum = 0;
+      if (compressed_tier_.find(key, buf)) {
+        place = &TierStats::compressed_tier;
+
+        // As in the buffer, the data is only verified on every read.
+        if (checksum_verification_ == verify_all_reads)
+          check_checksum(entry, CRC32C::compute(buf.data(), size));
+
+        // Objects kept in the buffer don't need another copy.
+        if (keep_in_buffer)
+          compressed_tier_.erase(key);
+      }
+      else {
+        place = entry.in_blob ? &TierStats::blob_file : &TierStats::file;
+        if (entry.delta_size || entry.packed) {
+          read_record(entry, buf);
+          if (must_verify(entry))
+            checksum = CRC32C::compute(buf.data(), size);
+        }
+        else {
+          buf.resize(size);
+          checksum = read_file(entry, 0, &buf[0], size);
+        }
+        check_checksum(entry, checksum);
+      }
+    }
+    catch (...) {
+      std::string().swap(buf);
+      throw;
+    }
+
+    buffer_size_ += size;
+
+    entry.modified = false;
+    if (deduplication_ && keep_in_buffer && !entry.packed && !entry.in_blob)
+      buffered_extents_[entry.index_in_file] = key;
+  }
+  else if (checksum_verification_ == verify_all_reads)
+    check_checksum(entry, CRC32C::compute(entry.data.data(), size));
+
+  count_access(entry, place);
+  touch_LRU(&entry);
+
+  if (!keep_in_buffer) {
+    if (!entry.modified)
+      data.swap(entry.data);
+    else
+      data = entry.data;
+
+    write_back(it);
+  }
+  else
+    data = entry.data;
+
+  return size;
+}
+
+template <class Key, class Serializer>
+template <class T>
+size_t ObjectArchive<Key, Serializer>::load_many(std::vector<Key> const& keys,
+    std::vector<T>& objs, bool keep_in_buffer) {
+  std::vector<std::string> data;
+  size_t ret = load_raw_many(keys, data, keep_in_buffer);
+
+  objs.resize(keys.size());
+  for (size_t i = 0; i < keys.size(); i++)
+    if (data[i].size())
+      decode(data[i], objs[i]);
+
+  return ret;
+}
+
+template <class Key, class Serializer>
+size_t ObjectArchive<Key, Serializer>::load_raw_many(
+    std::vector<Key> const& keys, std::vector<std::string>& data,
+    bool keep_in_buffer) {
+  OBJECT_ARCHIVE_MUTEX_GUARD;
+
+  data.assign(keys.size(), std::string());
+
+  // Objects in the archive are read in the order they are in the file, and
+  // the others are left to load_raw(), which may find them elsewhere.
+  std::vector<std::pair<size_t, size_t>> positions;
+  std::vector<size_t> missing;
+  for (size_t i = 0; i < keys.size(); i++) {
+    auto it = find_object(keys[i]);
+    if (it != objects_.end())
+      positions.emplace_back(it->second.index_in_file, i);
+    else
+      missing.push_back(i);
+  }
+  std::sort(positions.begin(), positions.end());
+
+  std::vector<size_t> order;
+  for (auto& it : positions)
+    order.push_back(it.second);
+  order.insert(order.end(), missing.begin(), missing.end());
+
+  std::vector<bool> done(keys.size(), false);
+  size_t ret = 0;
+  if (storage_backend_ == storage_io_uring)
+    ret += load_batch(keys, order, data, done, keep_in_buffer);
+
+  for (size_t i : order)
+    if (!done[i])
+      ret += load_raw(keys[i], data[i], keep_in_buffer);
+
+  return ret;
+}
+
+template <class Key, class Serializer>
+size_t ObjectArchive<Key, Serializer>::load_batch(std::vector<Key> const& keys,
+    std::vector<size_t> const& order, std::vector<std::string>& data,
+    std::vector<bool>& done, bool keep_in_buffer) {
+  // Only whole objects in the files are read, separately for each file.
+  std::vector<Storage::Range> ranges[2];
+  std::vector<size_t> indexes[2];
+  for (size_t i : order) {
+    auto it = objects_.find(keys[i]);
+    if (it == objects_.end())
+      continue;
+
+    ObjectEntry const& entry = it->second;
+    if (entry.data.size() || entry.size == 0 || entry.packed ||
+        entry.delta_size || compressed_tier_.contains(keys[i]))
+      continue;
+
+    data[i].resize(entry.size);
+    Storage::Range range = { entry.index_in_file, &data[i][0], entry.size,
+      false };
+    ranges[entry.in_blob].push_back(range);
+    indexes[entry.in_blob].push_back(i);
+  }
+
+  if (ranges[0].size())
+    storage_->read_many(ranges[0]);
+  if (ranges[1].size()) {
+    open_blob_file();
+    blob_storage_->read_many(ranges[1]);
+  }
+
+  size_t ret = 0;
+  for (size_t j = 0; j < ranges[0].size() + ranges[1].size(); j++) {
+    bool blob = j >= ranges[0].size();
+    size_t k = blob ? j - ranges[0].size() : j;
+    size_t i = indexes[blob][k];
+    ObjectEntry& entry = objects_.find(keys[i])->second;
+
+    // Objects not fully read are left to load_raw(), which reports the error.
+    if (!ranges[blob][k].done) {
+      data[i].clear();
+      continue;
+    }
+
+    if (must_verify(entry))
+      check_checksum(entry, CRC32C::compute(data[i].data(), entry.size));
+    done[i] = true;
+    ret += entry.size;
+
+    if (keep_in_buffer && entry.size <= max_buffer_size_ &&
+        entry.data.empty()) {
+      if (entry.size + buffer_size_ > max_buffer_size_)
+        unload(max_buffer_size_ - entry.size);
+
+      entry.data = data[i];
+      entry.modified = false;
+      buffer_size_ += entry.size;
+      touch_LRU(&entry);
+      if (deduplication_ && !entry.in_blob)
+        buffered_extents_[entry.index_in_file] = keys[i];
+    }
+
+    // Counted with the data in the buffer, so that it can be promoted.
+    count_access(entry, blob ? &TierStats::blob_file : &TierStats::file);
+  }
+
+  return ret;
+}
+
+template <class Key, class Serializer>
+size_t ObjectArchive<Key, Serializer>::load_chunk(Key const& key, size_t chunk,
+    std::string& data) {
+  OBJECT_ARCHIVE_MUTEX_GUARD;
+
+  auto it = find_object(key);
+  if (it == objects_.end())
+    return 0;
+
+  ObjectEntry const& entry = it->second;
+  if (entry.size < ZlibCodec::chunked_header_size())
+    return 0;
+
+  std::string header;
+  read_entry(entry, 0, ZlibCodec::chunked_header_size(), header);
+  if (!ZlibCodec::is_chunked(header) ||
+      chunk >= ZlibCodec::chunk_count(header))
+    return 0;
+
+  std::string offsets;
+  read_entry(entry, ZlibCodec::chunk_offset_position(chunk),
+      2 * sizeof(uint64_t), offsets);
+  uint64_t begin, end;
+  memcpy(&begin, &offsets[0], sizeof(uint64_t));
+  memcpy(&end, &offsets[sizeof(uint64_t)], sizeof(uint64_t));
+  if (begin > end || end > entry.size)
+    return 0;
+
+  std::string compressed;
+  read_entry(entry, begin, end - begin, compressed);
+  data = ZlibCodec::decompress(compressed);
+
+  return data.size();
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::unload(size_t desired_size) {
+  OBJECT_ARCHIVE_MUTEX_GUARD;
+  while (buffer_size_ > desired_size) {
+    ObjectEntry const* entry = LRU_.back();
+    // Dropped objects are moved to the tier by write_back().
+    if (!drop_evicted_ || !entry->modified)
+      compressed_tier_.insert(*entry->key, entry->data);
+    write_back(*entry->key);
+  }
+}
+
+template <class Key, class Serializer>
+bool ObjectArchive<Key, Serializer>::is_available(Key const& key) {
+  OBJECT_ARCHIVE_MUTEX_GUARD;
+  return find_object(key) != objects_.end() ||
+    compressed_tier_.contains(key);
+}
+
+template <class Key, class Serializer>
+std::list<Key const*> ObjectArchive<Key, Serializer>::available_objects() {
+  std::list<Key const*> list;
+
+  OBJECT_ARCHIVE_MUTEX_GUARD;
+  load_all_entries();
+  for (auto& it : objects_)
+    list.push_front(it.second.key);
+
+  return list;
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::for_each_raw(
+    std::function<void(Key const&, std::string const&)> const& fn) {
+  OBJECT_ARCHIVE_MUTEX_GUARD;
+
+  StorageReader reader(*storage_, entries_begin_, scan_buffer_size());
+  std::string data;
+  scan_entries(reader, [&](Key const& key, ObjectEntry const& entry,
+        bool follows) {
+    read_scanned(reader, entry, follows, data);
+    fn(key, data);
+  });
+}
+
+template <class Key, class Serializer>
+template <class T>
+void ObjectArchive<Key, Serializer>::for_each(
+    std::function<void(Key const&, T const&)> const& fn) {
+  for_each_raw([&](Key const& key, std::string const& data) {
+    T obj;
+    decode(data, obj);
+    fn(key, obj);
+  });
+}
+
+template <class Key, class Serializer>
+template <class T>
+void ObjectArchive<Key, Serializer>::parallel_for_each(
+    std::function<void(Key const&, T const&)> const& fn,
+    unsigned int n_threads) {
+  parallel_scan([&](size_t, ScanPart const& part) {
+    for (auto& record : part) {
+      T obj;
+      decode(record.second, obj);
+      fn(record.first, obj);
+    }
+  }, n_threads);
+}
+
+template <class Key, class Serializer>
+template <class T, class R>
+R ObjectArchive<Key, Serializer>::map_reduce(
+    std::function<R(Key const&, T const&)> const& map,
+    std::function<R(R const&, R const&)> const& reduce, R const& init,
+    unsigned int n_threads) {
+  // Parts finish out of order, so each one waits for the previous ones.
+  R result = init;
+  std::map<size_t, R> finished;
+  size_t next = 0;
+#if ENABLE_THREADS
+  boost::mutex mutex;
+#endif
+
+  parallel_scan([&](size_t index, ScanPart const& part) {
+    R value = init;
+    for (auto& record : part) {
+      T obj;
+      decode(record.second, obj);
+      value = reduce(value, map(record.first, obj));
+    }
+
+#if ENABLE_THREADS
+    boost::lock_guard<boost::mutex> lock(mutex);
+#endif
+    finished.emplace(index, std::move(value));
+    for (auto it = finished.begin();
+         it != finished.end() && it->first == next; it = finished.erase(it)) {
+      result = reduce(result, it->second);
+      next++;
+    }
+  }, n_threads);
+
+  return result;
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::parallel_scan(
+    std::function<void(size_t, ScanPart const&)> const& process,
+    unsigned int n_threads) {
+  OBJECT_ARCHIVE_MUTEX_GUARD;
+
+  // Each batch of parts keeps every thread busy.
+  ThreadPool pool(n_threads);
+  size_t n_parts = 2 * (pool.size() + 1), n_processed = 0;
+  auto process_batch = [&](std::vector<ScanPart> const& batch) {
+    pool.run(batch.size(), [&](size_t i) {
+      process(n_processed + i, batch[i]);
+    });
+    n_processed += batch.size();
+  };
+
+  // Reads the objects, handing each batch over once it's full.
+  auto read = [&](
+      std::function<void(std::vector<ScanPart>&)> const& hand_over) {
+    std::vector<ScanPart> batch(1);
+    size_t part_size = 0;
+    StorageReader reader(*storage_, entries_begin_, scan_buffer_size());
+    scan_entries(reader, [&](Key const& key, ObjectEntry const& entry,
+          bool follows) {
+      std::string data;
+      read_scanned(reader, entry, follows, data);
+      part_size += data.size();
+      batch.back().emplace_back(key, std::move(data));
+
+      if (part_size >= scan_part_size()) {
+        part_size = 0;
+        if (batch.size() == n_parts) {
+          hand_over(batch);
+          batch.clear();
+        }
+        batch.emplace_back();
+      }
+    });
+    hand_over(batch);
+  };
+
+#if ENABLE_THREADS
+  // The reader uses the archive while this thread holds its lock, but only
+  // waits for the batches to be processed.
+  boost::mutex mutex;
+  boost::condition_variable changed;
+  std::vector<ScanPart> ready;
+  bool done = false;
+  std::exception_ptr error;
+
+  boost::thread reader([&]() {
+    try {
+      read([&](std::vector<ScanPart>& batch) {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (!ready.empty())
+          changed.wait(lock);
+        ready.swap(batch);
+        changed.notify_all();
+      });
+    }
+    catch (boost::thread_interrupted&) {
+    }
+    catch (...) {
+      error = std::current_exception();
+    }
+
+    boost::lock_guard<boost::mutex> lock(mutex);
+    done = true;
+    changed.notify_all();
+  });
+
+  try {
+    while (true) {
+      std::vector<ScanPart> batch;
+      {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (ready.empty() && !done)
+          changed.wait(lock);
+        if (ready.empty())
+          break;
+        batch.swap(ready);
+        changed.notify_all();
+      }
+
+      process_batch(batch);
+    }
+  }
+  catch (...) {
+    reader.interrupt();
+    reader.join();
+    throw;
+  }
+
+  reader.join();
+  if (error)
+    std::rethrow_exception(error);
+#else
+  read(process_batch);
+#endif
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::read_scanned(StorageReader& reader,
+    ObjectEntry const& entry, bool follows, std::string& data) {
+  if (!follows) {
+    read_entry(entry, data);
+    return;
+  }
+
+  data.resize(entry.size);
+  reader.seek(entry.index_in_file);
+  if (!reader.read(&data[0], entry.size))
+    throw boost::archive::archive_exception(
+        boost::archive::archive_exception::input_stream_error);
+  if (must_verify(entry))
+    check_checksum(entry, CRC32C::compute(data.data(), data.size()));
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::scan_entries(StorageReader& reader,
+    std::function<void(Key const&, ObjectEntry const&, bool)> const& fn) {
+  // Objects visited with the file's entries, which are the ones whose current
+  // entry is the file's.
+  std::unordered_set<ObjectEntry const*> visited;
+
+  reader.seek(entries_begin_);
+  for (size_t i = 0; i < n_file_entries_; i++) {
+    Key key;
+    ObjectEntry entry;
+    std::string key_string;
+    bool has_data = parse_entry(reader, key, entry, key_string);
+    entry.key = &key;
+    size_t next = reader.tell();
+
+    // Without the lazy index, objects not read are the ones removed.
+    auto it = objects_.find(key);
+    if (it == objects_.end()) {
+      if (index_storage_ && !index_removed_.count(key))
+        fn(key, entry, has_data);
+    }
+    else {
+      ObjectEntry const& current = it->second;
+      if (!current.modified && current.delta_size == 0 &&
+          current.index_in_file == entry.index_in_file &&
+          current.packed == entry.packed && current.slot == entry.slot &&
+          current.in_blob == entry.in_blob) {
+        visited.insert(&current);
+        fn(it->first, current, has_data && current.data.empty());
+      }
+    }
+
+    reader.seek(next);
+  }
+
+  std::vector<ObjectEntry const*> remaining;
+  for (auto& it : objects_)
+    if (!visited.count(&it.second))
+      remaining.push_back(&it.second);
+  std::sort(remaining.begin(), remaining.end(), file_order);
+
+  for (auto entry : remaining)
+    fn(*entry->key, *entry, false);
+}
+
+template <class Key, class Serializer>
+std::vector<Key> ObjectArchive<Key, Serializer>::available_keys() {
+  std::vector<Key> keys;
+
+  OBJECT_ARCHIVE_MUTEX_GUARD;
+  if (!index_storage_) {
+    keys.reserve(objects_.size());
+    for (auto& it : objects_)
+      keys.push_back(it.first);
+    return keys;
+  }
+
+  keys.reserve(n_file_entries_ + objects_.size());
+  StorageReader reader(*storage_, entries_begin_);
+  scan_entries(reader, [&](Key const& key, ObjectEntry const&, bool) {
+    keys.push_back(key);
+  });
+  return keys;
+}
+
+template <class Key, class Serializer>
+std::vector<Key> ObjectArchive<Key, Serializer>::range(Key const& lo,
+    Key const& hi) {
+  OBJECT_ARCHIVE_MUTEX_GUARD;
+  update_ordered_index();
+
+  auto begin = std::lower_bound(ordered_keys_.begin(), ordered_keys_.end(),
+      lo);
+  auto end = std::lower_bound(begin, ordered_keys_.end(), hi);
+  return ordered_results(begin - ordered_keys_.begin(),
+      end - ordered_keys_.begin());
+}
+
+template <class Key, class Serializer>
+std::vector<Key> ObjectArchive<Key, Serializer>::prefix(Key const& prefix) {
+  OBJECT_ARCHIVE_MUTEX_GUARD;
+  update_ordered_index();
+
+  auto begin = std::lower_bound(ordered_keys_.begin(), ordered_keys_.end(),
+      prefix);
+  auto end = begin;
+  while (end != ordered_keys_.end() &&
+      end->compare(0, prefix.size(), prefix) == 0)
+    ++end;
+  return ordered_results(begin - ordered_keys_.begin(),
+      end - ordered_keys_.begin());
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::update_ordered_index() {
+  if (!ordered_built_) {
+    ordered_keys_.clear();
+    ordered_new_keys_ = available_keys();
+    ordered_built_ = true;
+  }
+
+  if (ordered_new_keys_.empty())
+    return;
+
+  // Keys inserted again are in both.
+  std::sort(ordered_new_keys_.begin(), ordered_new_keys_.end());
+  size_t n_sorted = ordered_keys_.size();
+  ordered_keys_.insert(ordered_keys_.end(), ordered_new_keys_.begin(),
+      ordered_new_keys_.end());
+  std::inplace_merge(ordered_keys_.begin(), ordered_keys_.begin() + n_sorted,
+      ordered_keys_.end());
+  ordered_keys_.erase(std::unique(ordered_keys_.begin(), ordered_keys_.end()),
+      ordered_keys_.end());
+  ordered_new_keys_.clear();
+}
+
+template <class Key, class Serializer>
+std::vector<Key> ObjectArchive<Key, Serializer>::ordered_results(size_t begin,
+    size_t end) {
+  std::vector<ObjectEntry const*> entries;
+  size_t kept = begin;
+  for (size_t i = begin; i < end; i++) {
+    auto it = find_object(ordered_keys_[i]);
+    if (it == objects_.end())
+      continue;
+
+    entries.push_back(&it->second);
+    if (kept != i)
+      ordered_keys_[kept] = ordered_keys_[i];
+    kept++;
+  }
+  ordered_keys_.erase(ordered_keys_.begin() + kept,
+      ordered_keys_.begin() + end);
+
+  std::sort(entries.begin(), entries.end(), file_order);
+  std::vector<Key> keys;
+  keys.reserve(entries.size());
+  for (auto entry : entries)
+    keys.push_back(*entry->key);
+  return keys;
+}
+
+template <class Key, class Serializer>
+bool ObjectArchive<Key, Serializer>::file_order(ObjectEntry const* a,
+    ObjectEntry const* b) {
+  // Modified entries aren't in the files, so their positions aren't valid.
+  if (a->modified || b->modified)
+    return !a->modified && b->modified;
+  return std::make_pair(a->in_blob, a->index_in_file) <
+    std::make_pair(b->in_blob, b->index_in_file);
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::flush() {
+  OBJECT_ARCHIVE_MUTEX_GUARD;
+
+  // Opening the file again would lose the objects that were never written.
+  if (drop_evicted_)
+    return;
+
   internal_flush();
-  init(filename_);
+  open_file();
 }
 
-template <class Key>
-void ObjectArchive<Key>::clear() {
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::clear() {
   OBJECT_ARCHIVE_MUTEX_GUARD;
 
-  auto key_list = available_objects();
-  for (auto& it : key_list)
-    remove(*it);
+  // Removing a key frees the one in its entry, so they are copied first.
+  for (auto& key : available_keys())
+    remove(key);
 
   flush();
 }
 
-template <class Key>
-void ObjectArchive<Key>::internal_flush() {
-  unload();
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::internal_flush() {
+  if (drop_evicted_)
+    return;
+
+  save_warm_keys();
+
+  // The buffer is emptied without feeding the compressed tier, which keeps the
+  // objects evicted before as a flush doesn't change them.
+  while (buffer_size_ > 0)
+    write_back(*LRU_.back()->key);
 
   if (!must_rebuild_file_)
     return;
 
   must_rebuild_file_ = false;
+  load_all_entries();
+
+  // Large objects are moved to the blob file, which is only rewritten if
+  // most of it isn't used anymore.
+  std::unordered_map<size_t, size_t> blob_positions;
+  std::string temp_blob_filename;
+  std::unique_ptr<Storage> temp_blob_storage;
+  if (blob_threshold_ > 0) {
+    for (auto& it : objects_) {
+      ObjectEntry& entry = it.second;
+      if (must_blob(entry) && !must_pack(entry) && !entry.in_blob) {
+        compute_digests(entry);
+
+        std::string data;
+        read_record(entry, data);
+        write_blob(entry, data);
+      }
+    }
 
-  boost::filesystem::path temp_filename;
-  temp_filename = boost::filesystem::temp_directory_path();
-  temp_filename += '/';
-  temp_filename += boost::filesystem::unique_path();
-  std::fstream temp_stream(temp_filename.string(),
-      std::ios_base::in | std::ios_base::out |
-      std::ios_base::binary | std::ios_base::trunc);
+    demote_objects();
+
+    size_t used_size = sizeof(size_t);
+    for (auto& it : objects_)
+      if (it.second.in_blob)
+        used_size += it.second.size;
+
+    if (blob_file_size() > 2 * used_size) {
+      temp_blob_filename = blob_filename() + ".tmp";
+      temp_blob_storage = rewrite_blobs(temp_blob_filename, blob_positions);
+    }
+  }
+
+  // Memory doesn't need a temporary file.
+  std::string temp_filename;
+  if (storage_backend_ != storage_memory)
+    temp_filename = temporary_filename();
+  std::unique_ptr<Storage> temp_storage(new_storage());
+  temp_storage->open(temp_filename, true);
+  StorageWriter temp_writer(*temp_storage);
+
+  if (has_header()) {
+    Header header;
+    header.version = header_version;
+    header.dictionaries = dictionaries_;
+    header.dictionary_id = dictionary_id_;
+    header.serializer_version = Serializer::format_version();
+    header.checksums = checksums_;
+    header.deduplication = deduplication_;
+    header.block_object_size = block_object_size_;
+    header.block_size = block_size_;
+    header.blob_threshold = blob_threshold_;
+    header.blob_filename = blob_filename_;
+    header.fast_capacity = fast_capacity_;
+
+    std::string header_str = ObjectArchive<Key>::serialize(header);
+    size_t magic = header_magic;
+    size_t header_size = header_str.size();
+
+    temp_writer.write((char*)&magic, sizeof(size_t));
+    temp_writer.write((char*)&header_size, sizeof(size_t));
+    temp_writer.write(&header_str[0], header_size);
+  }
+
+  // Position and slot in the new file of the objects packed in blocks.
+  std::unordered_map<ObjectEntry const*, std::pair<size_t, size_t>> packed;
+
+  if (block_object_size_ > 0) {
+    size_t blocks_begin = temp_writer.tell();
+    size_t blocks_size = 0;
+    temp_writer.write((char*)&blocks_size, sizeof(size_t));
+
+    RecordBlock block;
+    std::vector<ObjectEntry const*> block_entries;
+    auto write_block = [&]() {
+      size_t position = temp_writer.tell();
+      std::string compressed = ZlibCodec::compress(block.contents());
+      uint64_t compressed_size = compressed.size();
+      temp_writer.write((char*)&compressed_size, sizeof(uint64_t));
+      temp_writer.write(&compressed[0], compressed_size);
+
+      for (size_t i = 0; i < block_entries.size(); i++)
+        packed[block_entries[i]] = std::make_pair(position, i);
+      block.clear();
+      block_entries.clear();
+    };
+
+    for (auto& it : objects_) {
+      ObjectEntry& entry = it.second;
+      if (!must_pack(entry))
+        continue;
+
+      compute_digests(entry);
+
+      std::string data;
+      read_record(entry, data);
+      block.add(data);
+      block_entries.push_back(&entry);
+      if (block.size() >= block_size_)
+        write_block();
+    }
+    if (block.count())
+      write_block();
+
+    blocks_size = temp_writer.tell() - blocks_begin - sizeof(size_t);
+    temp_writer.flush();
+    temp_storage->write(blocks_begin, (char*)&blocks_size, sizeof(size_t));
+  }
 
   size_t n_entries = objects_.size();
-  temp_stream.write((char*)&n_entries, sizeof(size_t));
+  temp_writer.write((char*)&n_entries, sizeof(size_t));
 
-  size_t local_max_buffer_size = (max_buffer_size_ == 0 ? 1 : max_buffer_size_);
+  // Position in the new file of the data already copied, by its position in
+  // the old one, so that shared data is copied once.
+  std::unordered_map<size_t, size_t> copied;
 
-  char* temp_buffer = new char[local_max_buffer_size];
+  // Hash of each key and position of its entry for the lazy index.
+  std::vector<std::pair<uint64_t, uint64_t>> records;
 
   for (auto& it : objects_) {
     ObjectEntry& entry = it.second;
 
     std::string key_str = serialize(it.first);
+    if (lazy_index_)
+      records.emplace_back(XXHash64::hash(key_str.data(), key_str.size()),
+          temp_writer.tell());
 
     size_t key_size = key_str.size();
     size_t data_size = entry.size;
 
-    temp_stream.write((char*)&key_size, sizeof(size_t));
-    temp_stream.write((char*)&data_size, sizeof(size_t));
+    temp_writer.write((char*)&key_size, sizeof(size_t));
+    temp_writer.write((char*)&data_size, sizeof(size_t));
+
+    compute_digests(entry);
+
+    if (checksums_) {
+      uint32_t key_checksum = CRC32C::compute(key_str.data(), key_size);
+      temp_writer.write((char*)&key_checksum, sizeof(uint32_t));
+      temp_writer.write((char*)&entry.checksum, sizeof(uint32_t));
+    }
+
+    auto block = packed.find(&entry);
+    bool in_block = block != packed.end();
+    bool in_blob = blob_threshold_ > 0 && entry.in_blob && !in_block;
+
+    uint64_t reference = 0;
+    if (deduplication_) {
+      auto copy = copied.find(entry.index_in_file);
+      if (copy != copied.end() && !in_block && !entry.in_blob)
+        reference = copy->second;
+
+      temp_writer.write((char*)&entry.hash, sizeof(uint64_t));
+      temp_writer.write((char*)&reference, sizeof(uint64_t));
+    }
+
+    if (block_object_size_ > 0) {
+      uint64_t position = in_block ? block->second.first : 0,
+               slot = in_block ? block->second.second : 0;
+      temp_writer.write((char*)&position, sizeof(uint64_t));
+      temp_writer.write((char*)&slot, sizeof(uint64_t));
+    }
+
+    if (blob_threshold_ > 0) {
+      uint64_t position = 0;
+      if (in_blob) {
+        auto moved = blob_positions.find(entry.index_in_file);
+        position = moved != blob_positions.end() ? moved->second :
+          entry.index_in_file;
+      }
+      temp_writer.write((char*)&position, sizeof(uint64_t));
+    }
+
+    temp_writer.write((char*)&key_str[0], key_size);
 
-    temp_stream.write((char*)&key_str[0], key_size);
+    if (reference || in_block || in_blob)
+      continue;
+    if (deduplication_ && !entry.in_blob)
+      copied[entry.index_in_file] = temp_writer.tell();
 
-    stream_.seekg(entry.index_in_file);
-    size_t size = data_size;
+    // Deltas and objects that were packed are replaced by full copies.
+    if (entry.delta_size || entry.packed) {
+      std::string data;
+      read_record(entry, data);
+      temp_writer.write(&data[0], data.size());
+      continue;
+    }
 
-    // Only uses the allowed buffer memory.
-    for (;
-         size > local_max_buffer_size;
-         size -= local_max_buffer_size) {
-      stream_.read(temp_buffer, local_max_buffer_size);
-      temp_stream.write(temp_buffer, local_max_buffer_size);
+    // Large objects are copied in pieces, including blobs copied back
+    // without blob storage.
+    std::string piece;
+    for (size_t done = 0; done < data_size; done += piece.size()) {
+      piece.resize(std::min(read_piece_size(), data_size - done));
+      read_data(entry, done, &piece[0], piece.size());
+      temp_writer.write(piece.data(), piece.size());
     }
-    stream_.read(temp_buffer, size);
-    temp_stream.write(temp_buffer, size);
   }
 
-  delete[] temp_buffer;
+  size_t archive_size = temp_writer.tell();
+  temp_writer.flush();
+  temp_storage->sync();
+  replace_file(storage_, temp_storage, filename_, temp_filename);
 
-  stream_.close();
-  temp_stream.close();
+  if (lazy_index_)
+    write_index(records, archive_size);
 
-  boost::filesystem::remove(filename_);
-  boost::filesystem::copy(temp_filename, filename_);
-  boost::filesystem::remove(temp_filename);
+  // Without blob storage, the blobs were copied to the archive's file.
+  if (blob_threshold_ == 0) {
+    blob_storage_.reset();
+    if (storage_backend_ != storage_memory)
+      boost::filesystem::remove(blob_filename());
+  }
+  else if (temp_blob_storage) {
+    temp_blob_storage->sync();
+    replace_file(blob_storage_, temp_blob_storage, blob_filename(),
+        temp_blob_filename);
+  }
+  else if (storage_backend_ != storage_memory)
+    blob_storage_.reset();
 }
 
-template <class Key>
-bool ObjectArchive<Key>::write_back(Key const& key) {
-  auto it = objects_.find(key);
+template <class Key, class Serializer>
+bool ObjectArchive<Key, Serializer>::has_header() const {
+  return !dictionaries_.empty() || Serializer::format_version() != 0 ||
+    checksums_ || deduplication_ || block_object_size_ > 0 ||
+    blob_threshold_ > 0;
+}
+
+template <class Key, class Serializer>
+typename ObjectArchive<Key, Serializer>::Extent
+ObjectArchive<Key, Serializer>::extent(ObjectEntry const& entry) {
+  Extent ret = { entry.index_in_file, entry.size, entry.delta_size,
+    entry.delta_chain };
+  return ret;
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::read_extent(Extent const& extent,
+    std::string& data) {
+  if (extent.delta_size == 0) {
+    data.resize(extent.size);
+    storage_->read(extent.index_in_file, &data[0], extent.size);
+    return;
+  }
+
+  // The delta starts with the extent of its base.
+  std::string delta;
+  delta.resize(extent.delta_size);
+  storage_->read(extent.index_in_file, &delta[0], extent.delta_size);
+
+  uint64_t header[5];
+  if (delta.size() < sizeof(header))
+    throw boost::archive::archive_exception(
+        boost::archive::archive_exception::input_stream_error);
+  memcpy(header, delta.data(), sizeof(header));
+
+  Extent base = { header[0], header[1], header[2], (unsigned int)header[3] };
+  if (base.chain + 1 != extent.chain)
+    throw boost::archive::archive_exception(
+        boost::archive::archive_exception::input_stream_error);
+
+  std::string base_data;
+  read_extent(base, base_data);
+  if (header[4] == 0) {
+    data = DeltaCodec::decode(base_data, delta, sizeof(header), extent.size);
+    return;
+  }
+
+  // The delta is between the serialized data, which is compressed again.
+  base_data = ZlibCodec::decompress(base_data, dictionaries_);
+  data = ZlibCodec::compress(DeltaCodec::decode(base_data, delta,
+        sizeof(header), header[4]));
+  if (data.size() != extent.size)
+    throw boost::archive::archive_exception(
+        boost::archive::archive_exception::input_stream_error);
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::write_extent(ObjectEntry& entry) {
+  std::string delta;
+  if (entry.has_base && entry.base.chain < max_delta_chain_) {
+    std::string base;
+    read_extent(entry.base, base);
+
+    // A small change to the serialized data changes most of zlib's output, so
+    // the delta is taken between the serialized data if compressing it again
+    // gives the same record.
+    std::string serialized;
+    if (is_compressed_record(base) && is_compressed_record(entry.data)) {
+      serialized = ZlibCodec::decompress(entry.data, dictionaries_);
+      if (ZlibCodec::compress(serialized) == entry.data)
+        base = ZlibCodec::decompress(base, dictionaries_);
+      else
+        serialized.clear();
+    }
+
+    uint64_t header[5] = { entry.base.index_in_file, entry.base.size,
+      entry.base.delta_size, entry.base.chain, serialized.size() };
+    delta.assign((char*)header, sizeof(header));
+    delta += DeltaCodec::encode(base,
+        serialized.size() ? serialized : entry.data);
+
+    // Deltas almost as large as the data aren't worth reading the base.
+    if (delta.size() > entry.size / 2)
+      delta.clear();
+  }
+
+  bool ok;
+  if (delta.size()) {
+    ok = storage_->append(&delta[0], delta.size(), entry.index_in_file);
+    entry.delta_size = delta.size();
+    entry.delta_chain = entry.base.chain + 1;
+  }
+  else {
+    ok = storage_->append(&entry.data[0], entry.size, entry.index_in_file);
+    entry.delta_size = 0;
+    entry.delta_chain = 0;
+  }
+
+  if (!ok)
+    throw boost::archive::archive_exception(
+        boost::archive::archive_exception::output_stream_error);
+}
+
+template <class Key, class Serializer>
+bool ObjectArchive<Key, Serializer>::is_compressed_record(
+    std::string const& data) {
+  return !ArrayRecord::is_array(data) && !ZlibCodec::is_chunked(data);
+}
+
+template <class Key, class Serializer>
+bool ObjectArchive<Key, Serializer>::must_pack(ObjectEntry const& entry) const {
+  return block_object_size_ > 0 && entry.size <= block_object_size_;
+}
+
+template <class Key, class Serializer>
+std::string const& ObjectArchive<Key, Serializer>::read_block(
+    size_t position) {
+  std::string const* contents = block_cache_.find(position);
+  if (contents)
+    return *contents;
+
+  uint64_t size = 0;
+  std::string compressed;
+  if (!storage_->read(position, (char*)&size, sizeof(uint64_t)) ||
+      size > storage_->size())
+    throw boost::archive::archive_exception(
+        boost::archive::archive_exception::input_stream_error);
+
+  compressed.resize(size);
+  if (!storage_->read(position + sizeof(uint64_t), &compressed[0], size))
+    throw boost::archive::archive_exception(
+        boost::archive::archive_exception::input_stream_error);
+
+  return block_cache_.insert(position, ZlibCodec::decompress(compressed));
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::write_open_block() {
+  std::string contents = open_block_.contents();
+  std::string compressed = ZlibCodec::compress(contents);
+  uint64_t compressed_size = compressed.size();
+  compressed.insert(0, (char*)&compressed_size, sizeof(uint64_t));
+
+  size_t position;
+  if (!storage_->append(&compressed[0], compressed.size(), position))
+    throw boost::archive::archive_exception(
+        boost::archive::archive_exception::output_stream_error);
+
+  // Objects removed or written again since they were packed aren't there.
+  for (size_t slot = 0; slot < open_block_keys_.size(); slot++) {
+    auto it = objects_.find(open_block_keys_[slot]);
+    if (it != objects_.end() && it->second.packed &&
+        it->second.index_in_file == 0 && it->second.slot == slot)
+      it->second.index_in_file = position;
+  }
+
+  block_cache_.insert(position, std::move(contents));
+  open_block_.clear();
+  open_block_keys_.clear();
+}
+
+template <class Key, class Serializer>
+bool ObjectArchive<Key, Serializer>::must_blob(ObjectEntry const& entry) const {
+  return blob_threshold_ > 0 && entry.size > blob_threshold_;
+}
+
+template <class Key, class Serializer>
+std::string ObjectArchive<Key, Serializer>::blob_filename() const {
+  return blob_filename_.size() ? blob_filename_ : filename_ + ".blobs";
+}
+
+template <class Key, class Serializer>
+std::string ObjectArchive<Key, Serializer>::warm_filename() const {
+  return filename_ + ".warm";
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::save_warm_keys() {
+  if (!warm_restart_ || temporary_file_ || storage_backend_ == storage_memory)
+    return;
+
+  std::vector<std::string> keys;
+  for (auto entry : LRU_)
+    keys.push_back(serialize(*entry->key));
+  for (auto& key : warm_keys_) {
+    auto it = objects_.find(key);
+    if (it != objects_.end() && it->second.data.empty())
+      keys.push_back(serialize(key));
+  }
+
+  // The keys are only a hint, so they aren't synced.
+  FileStorage storage;
+  if (!storage.open(warm_filename(), true))
+    return;
+
+  StorageWriter writer(storage);
+  size_t n_keys = keys.size();
+  writer.write((char*)&n_keys, sizeof(size_t));
+  for (auto& key : keys) {
+    size_t key_size = key.size();
+    writer.write((char*)&key_size, sizeof(size_t));
+    writer.write(key.data(), key_size);
+  }
+  writer.flush();
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::load_warm_keys() {
+  warm_keys_.clear();
+  warm_fitted_ = false;
+
+  if (!warm_restart_ || temporary_file_ || storage_backend_ == storage_memory ||
+      !boost::filesystem::exists(warm_filename()))
+    return;
+
+  FileStorage storage;
+  if (!storage.open(warm_filename(), false))
+    return;
+
+  // A damaged file only loses the keys after the damage, and keys removed
+  // since they were saved are skipped.
+  StorageReader reader(storage);
+  size_t n_keys = 0;
+  reader.read((char*)&n_keys, sizeof(size_t));
+  try {
+    for (size_t i = 0; i < n_keys; i++) {
+      size_t key_size = 0;
+      if (!reader.read((char*)&key_size, sizeof(size_t)) ||
+          key_size > storage.size())
+        break;
+
+      std::string key_string;
+      key_string.resize(key_size);
+      if (!reader.read(&key_string[0], key_size))
+        break;
+
+      Key key;
+      deserialize(key_string, key);
+      if (find_object(key) != objects_.end())
+        warm_keys_.push_back(key);
+    }
+  }
+  catch (...) { }
+
+  if (!warm_prefetch_ || warm_keys_.empty())
+    return;
+
+#if ENABLE_THREADS
+  // A running prefetcher continues with the new keys.
+  if (!prefetching_) {
+    if (prefetcher_.joinable())
+      prefetcher_.join();
+    prefetching_ = true;
+    prefetcher_ = boost::thread(&ObjectArchive<Key, Serializer>::prefetcher,
+        this);
+  }
+#else
+  prefetch_warm();
+#endif
+}
+
+template <class Key, class Serializer>
+bool ObjectArchive<Key, Serializer>::prefetch_warm_batch(size_t& n_loaded) {
+  OBJECT_ARCHIVE_MUTEX_GUARD;
+
+  // Only the most recently used objects that fit in the buffer are loaded.
+  if (!warm_fitted_) {
+    size_t size = 0, n_fit = 0;
+    for (; n_fit < warm_keys_.size(); n_fit++) {
+      auto it = objects_.find(warm_keys_[n_fit]);
+      size_t object_size = it != objects_.end() ? it->second.size : 0;
+      if (size + object_size > max_buffer_size_)
+        break;
+      size += object_size;
+    }
+    warm_keys_.erase(warm_keys_.begin() + n_fit, warm_keys_.end());
+    warm_fitted_ = true;
+  }
+
+  if (warm_keys_.empty())
+    return false;
+
+  size_t n_keys = std::min(warm_keys_.size(), warm_batch_size());
+  std::vector<Key> keys(warm_keys_.end() - n_keys, warm_keys_.end());
+  warm_keys_.erase(warm_keys_.end() - n_keys, warm_keys_.end());
+
+  std::vector<std::string> data;
+  load_raw_many(keys, data, true);
+
+  // The batch was read in the file's order, so its order in the buffer is
+  // fixed from the least recently used.
+  for (size_t i = keys.size(); i-- > 0;) {
+    auto it = objects_.find(keys[i]);
+    if (it != objects_.end() && it->second.data.size()) {
+      touch_LRU(&it->second);
+      n_loaded++;
+    }
+  }
+
+  return !warm_keys_.empty();
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::open_blob_file() {
+  if (blob_storage_ && blob_storage_->is_open())
+    return;
+
+  blob_storage_ = open_blob_storage(blob_filename(), false);
+  if (blob_storage_->size() == 0) {
+    size_t magic = blob_magic, position;
+    blob_storage_->append((char*)&magic, sizeof(size_t), position);
+  }
+}
+
+template <class Key, class Serializer>
+std::unique_ptr<Storage> ObjectArchive<Key, Serializer>::open_blob_storage(
+    std::string const& filename, bool truncate) const {
+  std::unique_ptr<Storage> storage;
+
+  // Without support for direct I/O, the backend is used.
+  if (direct_io_ && storage_backend_ != storage_memory) {
+    storage.reset(new DirectFile());
+    if (storage->open(filename, truncate))
+      return storage;
+  }
+
+  storage.reset(new_storage());
+  storage->open(filename, truncate);
+  return storage;
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::write_blob(ObjectEntry& entry,
+    std::string const& data) {
+  open_blob_file();
+
+  if (!blob_storage_->append(data.data(), data.size(), entry.index_in_file))
+    throw boost::archive::archive_exception(
+        boost::archive::archive_exception::output_stream_error);
+  entry.in_blob = true;
+  entry.packed = false;
+  entry.delta_size = 0;
+  entry.delta_chain = 0;
+}
+
+template <class Key, class Serializer>
+std::unique_ptr<Storage> ObjectArchive<Key, Serializer>::rewrite_blobs(
+    std::string const& filename,
+    std::unordered_map<size_t, size_t>& positions) {
+  // The new file uses direct I/O if the old one does, so blobs are aligned.
+  std::unique_ptr<Storage> storage = open_blob_storage(filename, true);
+
+  size_t magic = blob_magic, position;
+  storage->append((char*)&magic, sizeof(size_t), position);
+
+  // Blobs are copied in the order they are in the old file.
+  std::vector<std::pair<size_t, size_t>> blobs;
+  for (auto& it : objects_)
+    if (it.second.in_blob)
+      blobs.emplace_back(it.second.index_in_file, it.second.size);
+  std::sort(blobs.begin(), blobs.end());
+
+  // Pieces are aligned, so each blob is contiguous even with direct I/O.
+  std::string piece;
+  for (auto& blob : blobs) {
+    for (size_t done = 0; done < blob.second; done += read_piece_size()) {
+      size_t n = std::min(read_piece_size(), blob.second - done);
+      piece.resize(n);
+      read_blob(blob.first + done, &piece[0], n);
+      storage->append(piece.data(), n, position);
+      if (done == 0)
+        positions[blob.first] = position;
+    }
+  }
+
+  return storage;
+}
+
+template <class Key, class Serializer>
+size_t ObjectArchive<Key, Serializer>::blob_file_size() {
+  open_blob_file();
+  return blob_storage_->size();
+}
+
+template <class Key, class Serializer>
+bool ObjectArchive<Key, Serializer>::read_blob(size_t position, char* data,
+    size_t size) {
+  open_blob_file();
+  return blob_storage_->read(position, data, size);
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::demote_objects() {
+  if (fast_capacity_ == 0)
+    return;
+
+  // Objects packed in blocks stay in the archive's file.
+  std::vector<std::pair<uint64_t, ObjectEntry*>> candidates;
+  size_t fast_size = 0;
+  for (auto& it : objects_) {
+    ObjectEntry& entry = it.second;
+    if (entry.in_blob || must_pack(entry))
+      continue;
+
+    fast_size += entry.size;
+    candidates.emplace_back(entry.last_access, &entry);
+  }
+
+  if (fast_size <= fast_capacity_)
+    return;
+
+  std::sort(candidates.begin(), candidates.end());
+  for (auto& candidate : candidates) {
+    if (fast_size <= fast_capacity_)
+      break;
+
+    ObjectEntry& entry = *candidate.second;
+    compute_digests(entry);
+
+    std::string data;
+    read_record(entry, data);
+    write_blob(entry, data);
+    fast_size -= entry.size;
+  }
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::count_access(ObjectEntry& entry,
+    size_t TierStats::* place) {
+  entry.last_access = ++access_clock_;
+  tier_stats_.*place += 1;
+
+  // The data is written to the archive's file when it leaves the buffer.
+  if (place == &TierStats::blob_file && fast_capacity_ > 0 &&
+      !must_blob(entry) && entry.size > 0 && entry.data.size() == entry.size)
+    entry.modified = true;
+}
+
+template <class Key, class Serializer>
+bool ObjectArchive<Key, Serializer>::read_data(ObjectEntry const& entry,
+    size_t begin, char* data, size_t size) {
+  if (entry.in_blob)
+    return read_blob(entry.index_in_file + begin, data, size);
+
+  return storage_->read(entry.index_in_file + begin, data, size);
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::read_record(ObjectEntry const& entry,
+    std::string& data) {
+  if (entry.in_blob) {
+    data.resize(entry.size);
+    read_data(entry, 0, &data[0], entry.size);
+    return;
+  }
+
+  if (!entry.packed) {
+    read_extent(extent(entry), data);
+    return;
+  }
+
+  if (entry.index_in_file == 0)
+    open_block_.get(entry.slot, data);
+  else
+    RecordBlock::get(read_block(entry.index_in_file), entry.slot, data);
+
+  if (data.size() != entry.size)
+    throw boost::archive::archive_exception(
+        boost::archive::archive_exception::input_stream_error);
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::compute_digests(ObjectEntry& entry) {
+  bool checksum = checksums_ && !entry.has_checksum,
+       hash = deduplication_ && !entry.has_hash;
+  if (!checksum && !hash)
+    return;
+
+  std::string data;
+  read_record(entry, data);
+
+  if (checksum) {
+    entry.checksum = CRC32C::compute(data.data(), data.size());
+    entry.has_checksum = true;
+  }
+  if (hash) {
+    entry.hash = XXHash64::hash(data.data(), data.size());
+    entry.has_hash = true;
+  }
+}
+
+template <class Key, class Serializer>
+bool ObjectArchive<Key, Serializer>::find_extent(uint64_t hash,
+    std::string const& data, size_t& position) {
+  auto range = extents_.equal_range(hash);
+  std::string piece;
+
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second.second != data.size())
+      continue;
+
+    // Compares the contents piece by piece, as different data may have the
+    // same hash.
+    bool equal = true;
+    for (size_t done = 0; done < data.size() && equal;
+         done += read_piece_size()) {
+      size_t n = std::min(read_piece_size(), data.size() - done);
+      piece.resize(n);
+      equal = storage_->read(it->second.first + done, &piece[0], n) &&
+        memcmp(piece.data(), data.data() + done, n) == 0;
+    }
+
+    if (equal) {
+      position = it->second.first;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+template <class Key, class Serializer>
+bool ObjectArchive<Key, Serializer>::must_verify(
+    ObjectEntry const& entry) const {
+  return entry.has_checksum && checksum_verification_ != verify_none;
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::check_checksum(ObjectEntry const& entry,
+    uint32_t checksum) const {
+  if (must_verify(entry) && checksum != entry.checksum)
+    throw ChecksumError("ObjectArchive: corrupted object in " + filename_);
+}
+
+template <class Key, class Serializer>
+uint32_t ObjectArchive<Key, Serializer>::read_file(ObjectEntry const& entry,
+    size_t begin, char* data, size_t size, uint32_t checksum) {
+  if (!must_verify(entry)) {
+    read_data(entry, begin, data, size);
+    return checksum;
+  }
+
+  for (size_t done = 0; done < size; done += read_piece_size()) {
+    size_t n = std::min(read_piece_size(), size - done);
+    read_data(entry, begin + done, data + done, n);
+    checksum = CRC32C::compute(data + done, n, checksum);
+  }
+  return checksum;
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::read_entry(ObjectEntry const& entry,
+    std::string& data) {
+  read_entry(entry, 0, entry.size, data);
+}
+
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::read_entry(ObjectEntry const& entry,
+    size_t begin, size_t size, std::string& data) {
+  if (entry.data.size()) {
+    data.assign(entry.data, begin, size);
+    return;
+  }
+
+  if (entry.delta_size || entry.packed) {
+    std::string full;
+    read_record(entry, full);
+    if (must_verify(entry))
+      check_checksum(entry, CRC32C::compute(full.data(), full.size()));
+    data.assign(full, begin, size);
+    return;
+  }
+
+  data.resize(size);
+  uint32_t checksum = read_file(entry, begin, &data[0], size);
+
+  // Partial reads can't be checked.
+  if (begin == 0 && size == entry.size)
+    check_checksum(entry, checksum);
+}
+
+template <class Key, class Serializer>
+bool ObjectArchive<Key, Serializer>::write_back(Key const& key) {
+  auto it = find_object(key);
   if (it == objects_.end())
     return false;
 
   return write_back(it);
 }
 
-template <class Key>
-bool ObjectArchive<Key>::write_back(
+template <class Key, class Serializer>
+bool ObjectArchive<Key, Serializer>::write_back(
     typename std::unordered_map<Key, ObjectEntry>::iterator const& it) {
   ObjectEntry& entry = it->second;
 
+  // Objects that aren't in the files leave the archive, and only their copy
+  // in the compressed tier remains.
+  if (drop_evicted_ && entry.modified) {
+    Key key = it->first;
+    std::string data;
+    data.swap(entry.data);
+    buffer_size_ -= entry.size;
+    ObjectArchive<Key, Serializer>::remove(key);
+    compressed_tier_.insert(key, data);
+    return true;
+  }
+
   if (entry.modified) {
-    stream_.seekp(0, std::ios_base::end);
-    entry.index_in_file = stream_.tellp();
-    stream_.write((char*)&entry.data[0], entry.size);
+    entry.packed = false;
+    entry.in_blob = false;
+    if (entry.has_hash &&
+        find_extent(entry.hash, entry.data, entry.index_in_file))
+      entry.delta_size = 0;
+    else if (must_pack(entry)) {
+      entry.packed = true;
+      entry.index_in_file = 0;
+      entry.slot = open_block_.add(entry.data);
+      entry.delta_size = 0;
+      open_block_keys_.push_back(it->first);
+      if (open_block_.size() >= block_size_)
+        write_open_block();
+    }
+    else if (must_blob(entry))
+      write_blob(entry, entry.data);
+    else {
+      write_extent(entry);
+      if (entry.has_hash && entry.delta_size == 0)
+        extents_.emplace(entry.hash,
+            std::make_pair(entry.index_in_file, entry.size));
+    }
+    entry.has_base = false;
     entry.modified = false;
     must_rebuild_file_ = true;
   }
@@ -499,8 +2996,8 @@ bool ObjectArchive<Key>::write_back(
   return true;
 }
 
-template <class Key>
-void ObjectArchive<Key>::touch_LRU(ObjectEntry const* entry) {
+template <class Key, class Serializer>
+void ObjectArchive<Key, Serializer>::touch_LRU(ObjectEntry const* entry) {
   LRU_.remove(entry);
   LRU_.push_front(entry);
 }
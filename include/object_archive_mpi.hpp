@@ -3,9 +3,10 @@
 //
 // The three basic operations (insert, load and remove) are communicated to
 // object instances in other MPI nodes, so data can be transparently shared.
-// However, the methods to check if a value is present (is_available and
-// available_objects) aren't mapped through MPI, as their returned values may
-// become incorrect right after the call. Hence they only provide local values.
+// However, the methods to check if a value is present (is_available,
+// available_objects and available_keys) aren't mapped through MPI, as their
+// returned values may become incorrect right after the call. Hence they only
+// provide local values.
 // In case local copies of data inserted in remotes is desired, the MPI archive
 // can be instructed to store them based on the key.
 //
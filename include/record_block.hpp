@@ -0,0 +1,178 @@
+// This file defines the blocks used by an ObjectArchive to pack many small
+// records together, so that they are compressed as a whole and a single read
+// serves many neighboring records, and the cache of decompressed blocks.
+//
+// The contents of a block, before compression, are:
+// 1) Number of records (uint32_t);
+// 2) Offset of each record from the beginning of the block, plus the offset of
+//    the end (uint32_t each);
+// 3) Records.
+//
+// Errors in blocks read are reported by throwing an archive_exception.
+
+#ifndef __RECORD_BLOCK_HPP__
+#define __RECORD_BLOCK_HPP__
+
+#include <boost/archive/archive_exception.hpp>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class RecordBlock {
+  public:
+    RecordBlock() { clear(); }
+
+    // Adds a record to the block and returns its slot.
+    size_t add(std::string const& record);
+
+    // Gets a record added to this block.
+    void get(size_t slot, std::string& record) const;
+
+    // Number of records and their total size.
+    size_t count() const { return offsets_.size() - 1; }
+    size_t size() const { return records_.size(); }
+
+    // Builds the contents of the block, ready to be compressed.
+    std::string contents() const;
+
+    void clear();
+
+    // Gets a record from the contents of a block.
+    static void get(std::string const& contents, size_t slot,
+        std::string& record);
+
+  private:
+    std::vector<uint32_t> offsets_; // Offsets inside records_
+    std::string records_;
+};
+
+// Keeps the contents of the blocks used most recently, indexed by their
+// position in the file, up to a total size.
+class BlockCache {
+  public:
+    BlockCache(): max_size_(0), size_(0) { }
+
+    // Gets the block's contents, if they are in the cache.
+    std::string const* find(size_t position);
+
+    // Stores the contents of a block, removing the least recently used ones if
+    // the cache is too large. Returns the contents stored.
+    std::string const& insert(size_t position, std::string&& contents);
+
+    void set_max_size(size_t max_size);
+
+    void clear();
+
+  private:
+    typedef std::list<std::pair<size_t, std::string>> block_list;
+
+    void shrink(size_t max_size);
+
+    block_list blocks_; // Most recent blocks are on the front
+    std::unordered_map<size_t, block_list::iterator> positions_;
+    size_t max_size_, size_;
+};
+
+inline size_t RecordBlock::add(std::string const& record) {
+  records_ += record;
+  offsets_.push_back(records_.size());
+  return count() - 1;
+}
+
+inline void RecordBlock::get(size_t slot, std::string& record) const {
+  record.assign(records_, offsets_[slot], offsets_[slot+1] - offsets_[slot]);
+}
+
+inline std::string RecordBlock::contents() const {
+  uint32_t n = count();
+  size_t header_size = sizeof(uint32_t) * (n + 2);
+
+  std::string ret;
+  ret.reserve(header_size + records_.size());
+  ret.append((char const*)&n, sizeof(uint32_t));
+  for (auto offset : offsets_) {
+    uint32_t value = offset + header_size;
+    ret.append((char const*)&value, sizeof(uint32_t));
+  }
+  ret += records_;
+
+  return ret;
+}
+
+inline void RecordBlock::clear() {
+  offsets_.assign(1, 0);
+  records_.clear();
+}
+
+inline void RecordBlock::get(std::string const& contents, size_t slot,
+    std::string& record) {
+  uint32_t n, begin, end;
+  if (contents.size() < sizeof(uint32_t))
+    throw boost::archive::archive_exception(
+        boost::archive::archive_exception::input_stream_error);
+  memcpy(&n, &contents[0], sizeof(uint32_t));
+
+  if (slot >= n || contents.size() < sizeof(uint32_t) * (n + 2))
+    throw boost::archive::archive_exception(
+        boost::archive::archive_exception::input_stream_error);
+  memcpy(&begin, &contents[sizeof(uint32_t) * (slot + 1)], sizeof(uint32_t));
+  memcpy(&end, &contents[sizeof(uint32_t) * (slot + 2)], sizeof(uint32_t));
+
+  if (begin > end || end > contents.size())
+    throw boost::archive::archive_exception(
+        boost::archive::archive_exception::input_stream_error);
+  record.assign(contents, begin, end - begin);
+}
+
+inline std::string const* BlockCache::find(size_t position) {
+  auto it = positions_.find(position);
+  if (it == positions_.end())
+    return nullptr;
+
+  blocks_.splice(blocks_.begin(), blocks_, it->second);
+  return &it->second->second;
+}
+
+inline std::string const& BlockCache::insert(size_t position,
+    std::string&& contents) {
+  auto it = positions_.find(position);
+  if (it != positions_.end()) {
+    size_ -= it->second->second.size();
+    blocks_.erase(it->second);
+    positions_.erase(it);
+  }
+
+  // Makes room for the new block, which is kept even if it's too large alone.
+  shrink(max_size_ > contents.size() ? max_size_ - contents.size() : 0);
+
+  size_ += contents.size();
+  blocks_.emplace_front(position, std::move(contents));
+  positions_[position] = blocks_.begin();
+
+  return blocks_.front().second;
+}
+
+inline void BlockCache::set_max_size(size_t max_size) {
+  max_size_ = max_size;
+  shrink(max_size);
+}
+
+inline void BlockCache::clear() {
+  blocks_.clear();
+  positions_.clear();
+  size_ = 0;
+}
+
+inline void BlockCache::shrink(size_t max_size) {
+  while (size_ > max_size && !blocks_.empty()) {
+    size_ -= blocks_.back().second.size();
+    positions_.erase(blocks_.back().first);
+    blocks_.pop_back();
+  }
+}
+
+#endif
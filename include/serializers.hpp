@@ -0,0 +1,372 @@
+// This file defines the serializer policies that an ObjectArchive can use to
+// turn objects into bytes, before they are compressed. Each policy provides:
+// template <class T> static void save(std::ostream& stream, T const& val);
+// template <class T> static void load(std::istream& stream, T& val);
+// static unsigned int format_version();
+// The format version is stored once in the archive's file and checked when it's
+// opened. Only BoostSerializer, whose objects describe themselves, returns 0,
+// and formats not based on boost use values above 0xffff, so that they differ
+// from boost's archive versions.
+//
+// BoostSerializer: the default. It uses boost's binary archives, so anything
+// that boost can serialize is supported. It also provides save_registered(),
+// used to serialize pointers to base classes pointing to derived objects.
+//
+// HeaderlessBoostSerializer: same as BoostSerializer, but without boost's
+// header and object tracking, which dominate the size and time of small
+// objects. The library version that the header would hold is the format
+// version. Without tracking, an object pointed to many times is stored many
+// times and cyclic structures aren't supported.
+//
+// BinarySerializer: a compact format without archive headers, class tracking
+// or virtual dispatch. It supports arithmetic types, enums, strings, vectors,
+// lists, pairs, sets and maps (ordered or not) and classes with a boost-like
+// method serialize(Archive&, const unsigned int) that only uses operator&.
+// Contiguous vectors of arithmetic types are written with a single call.
+//
+// RawSerializer: stores the bytes of a std::string as they are, which is useful
+// when the user has its own serialization. Other types, such as the keys, are
+// handled by BinarySerializer.
+//
+// As boost's binary archives, the data isn't portable between machines with
+// different endianness or type sizes.
+
+#ifndef __SERIALIZERS_HPP__
+#define __SERIALIZERS_HPP__
+
+#include <boost/archive/archive_exception.hpp>
+#include <boost/archive/binary_iarchive.hpp>
+#include <boost/archive/basic_archive.hpp>
+#include <boost/archive/binary_oarchive.hpp>
+#include <cstdint>
+#include <istream>
+#include <iterator>
+#include <list>
+#include <map>
+#include <ostream>
+#include <set>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+struct BoostSerializer {
+  template <class T>
+  static void save(std::ostream& stream, T const& val) {
+    boost::archive::binary_oarchive ar(stream);
+    ar << val;
+  }
+
+  template <class T>
+  static void load(std::istream& stream, T& val) {
+    boost::archive::binary_iarchive ar(stream);
+    ar >> val;
+  }
+
+  template <class Registered, class T>
+  static void save_registered(std::ostream& stream, T const& val) {
+    boost::archive::binary_oarchive ar(stream);
+    ar.register_type<Registered>();
+    ar << val;
+  }
+
+  static unsigned int format_version() { return 0; }
+};
+
+struct HeaderlessBoostSerializer {
+  static unsigned int const flags =
+    boost::archive::no_header | boost::archive::no_tracking;
+
+  template <class T>
+  static void save(std::ostream& stream, T const& val) {
+    boost::archive::binary_oarchive ar(stream, flags);
+    ar << val;
+  }
+
+  template <class T>
+  static void load(std::istream& stream, T& val) {
+    boost::archive::binary_iarchive ar(stream, flags);
+    ar >> val;
+  }
+
+  template <class Registered, class T>
+  static void save_registered(std::ostream& stream, T const& val) {
+    boost::archive::binary_oarchive ar(stream, flags);
+    ar.register_type<Registered>();
+    ar << val;
+  }
+
+  static unsigned int format_version() {
+    return boost::archive::BOOST_ARCHIVE_VERSION();
+  }
+};
+
+// Archive used by BinarySerializer to write objects.
+class BinaryOArchive {
+  public:
+    explicit BinaryOArchive(std::ostream& stream): stream_(stream) { }
+
+    template <class T>
+    BinaryOArchive& operator<<(T const& val) {
+      save(val);
+      return *this;
+    }
+
+    template <class T>
+    BinaryOArchive& operator&(T const& val) {
+      return *this << val;
+    }
+
+  private:
+    template <class T>
+    typename std::enable_if<std::is_arithmetic<T>::value ||
+                            std::is_enum<T>::value>::type
+    save(T const& val) {
+      write(&val, sizeof(T));
+    }
+
+    template <class T>
+    typename std::enable_if<std::is_class<T>::value>::type
+    save(T const& val) {
+      const_cast<T&>(val).serialize(*this, 0);
+    }
+
+    void save(std::string const& val) {
+      save_size(val.size());
+      write(val.data(), val.size());
+    }
+
+    template <class T, class A>
+    void save(std::vector<T, A> const& val) {
+      save_size(val.size());
+      save_range(val.begin(), val.end(),
+          std::integral_constant<bool, std::is_arithmetic<T>::value &&
+                                       !std::is_same<T, bool>::value>());
+    }
+
+    template <class T, class A>
+    void save(std::list<T, A> const& val) {
+      save_size(val.size());
+      save_range(val.begin(), val.end(), std::false_type());
+    }
+
+    template <class T1, class T2>
+    void save(std::pair<T1, T2> const& val) {
+      save(val.first);
+      save(val.second);
+    }
+
+    template <class K, class C, class A>
+    void save(std::set<K, C, A> const& val) {
+      save_size(val.size());
+      save_range(val.begin(), val.end(), std::false_type());
+    }
+
+    template <class K, class T, class C, class A>
+    void save(std::map<K, T, C, A> const& val) {
+      save_size(val.size());
+      save_range(val.begin(), val.end(), std::false_type());
+    }
+
+    template <class K, class H, class E, class A>
+    void save(std::unordered_set<K, H, E, A> const& val) {
+      save_size(val.size());
+      save_range(val.begin(), val.end(), std::false_type());
+    }
+
+    template <class K, class T, class H, class E, class A>
+    void save(std::unordered_map<K, T, H, E, A> const& val) {
+      save_size(val.size());
+      save_range(val.begin(), val.end(), std::false_type());
+    }
+
+    // Contiguous ranges of arithmetic types are written at once.
+    template <class It>
+    void save_range(It begin, It end, std::true_type) {
+      if (begin != end)
+        write(&*begin, (end - begin) * sizeof(*begin));
+    }
+
+    template <class It>
+    void save_range(It begin, It end, std::false_type) {
+      for (; begin != end; ++begin)
+        save(*begin);
+    }
+
+    void save_size(uint64_t size) {
+      write(&size, sizeof(size));
+    }
+
+    void write(void const* data, size_t size) {
+      stream_.write((char const*)data, size);
+      if (!stream_)
+        throw boost::archive::archive_exception(
+            boost::archive::archive_exception::output_stream_error);
+    }
+
+    std::ostream& stream_;
+};
+
+// Archive used by BinarySerializer to read objects.
+class BinaryIArchive {
+  public:
+    explicit BinaryIArchive(std::istream& stream): stream_(stream) { }
+
+    template <class T>
+    BinaryIArchive& operator>>(T& val) {
+      load(val);
+      return *this;
+    }
+
+    template <class T>
+    BinaryIArchive& operator&(T& val) {
+      return *this >> val;
+    }
+
+  private:
+    template <class T>
+    typename std::enable_if<std::is_arithmetic<T>::value ||
+                            std::is_enum<T>::value>::type
+    load(T& val) {
+      read(&val, sizeof(T));
+    }
+
+    template <class T>
+    typename std::enable_if<std::is_class<T>::value>::type
+    load(T& val) {
+      val.serialize(*this, 0);
+    }
+
+    void load(std::string& val) {
+      val.resize(load_size());
+      if (val.size())
+        read(&val[0], val.size());
+    }
+
+    template <class T, class A>
+    void load(std::vector<T, A>& val) {
+      val.resize(load_size());
+      load_vector(val,
+          std::integral_constant<bool, std::is_arithmetic<T>::value &&
+                                       !std::is_same<T, bool>::value>());
+    }
+
+    template <class T, class A>
+    void load(std::list<T, A>& val) {
+      val.resize(load_size());
+      for (auto& it : val)
+        load(it);
+    }
+
+    template <class T1, class T2>
+    void load(std::pair<T1, T2>& val) {
+      load(val.first);
+      load(val.second);
+    }
+
+    template <class K, class C, class A>
+    void load(std::set<K, C, A>& val) {
+      load_associative(val, (K*)nullptr);
+    }
+
+    template <class K, class T, class C, class A>
+    void load(std::map<K, T, C, A>& val) {
+      load_associative(val, (std::pair<K, T>*)nullptr);
+    }
+
+    template <class K, class H, class E, class A>
+    void load(std::unordered_set<K, H, E, A>& val) {
+      load_associative(val, (K*)nullptr);
+    }
+
+    template <class K, class T, class H, class E, class A>
+    void load(std::unordered_map<K, T, H, E, A>& val) {
+      load_associative(val, (std::pair<K, T>*)nullptr);
+    }
+
+    template <class V>
+    void load_vector(V& val, std::true_type) {
+      if (val.size())
+        read(&val[0], val.size() * sizeof(val[0]));
+    }
+
+    template <class V>
+    void load_vector(V& val, std::false_type) {
+      for (size_t i = 0; i < val.size(); i++) {
+        typename V::value_type element;
+        load(element);
+        val[i] = std::move(element);
+      }
+    }
+
+    // The value type is given as a pointer, as the container's one may have a
+    // const key.
+    template <class C, class V>
+    void load_associative(C& val, V*) {
+      val.clear();
+      uint64_t size = load_size();
+      for (uint64_t i = 0; i < size; i++) {
+        V element;
+        load(element);
+        val.insert(std::move(element));
+      }
+    }
+
+    uint64_t load_size() {
+      uint64_t size;
+      read(&size, sizeof(size));
+      return size;
+    }
+
+    void read(void* data, size_t size) {
+      stream_.read((char*)data, size);
+      if (!stream_)
+        throw boost::archive::archive_exception(
+            boost::archive::archive_exception::input_stream_error);
+    }
+
+    std::istream& stream_;
+};
+
+struct BinarySerializer {
+  template <class T>
+  static void save(std::ostream& stream, T const& val) {
+    BinaryOArchive ar(stream);
+    ar << val;
+  }
+
+  template <class T>
+  static void load(std::istream& stream, T& val) {
+    BinaryIArchive ar(stream);
+    ar >> val;
+  }
+
+  static unsigned int format_version() { return 0x10001; }
+};
+
+struct RawSerializer {
+  template <class T>
+  static void save(std::ostream& stream, T const& val) {
+    BinarySerializer::save(stream, val);
+  }
+
+  template <class T>
+  static void load(std::istream& stream, T& val) {
+    BinarySerializer::load(stream, val);
+  }
+
+  static void save(std::ostream& stream, std::string const& val) {
+    stream.write(val.data(), val.size());
+  }
+
+  static void load(std::istream& stream, std::string& val) {
+    val.assign(std::istreambuf_iterator<char>(stream),
+        std::istreambuf_iterator<char>());
+  }
+
+  static unsigned int format_version() { return 0x20001; }
+};
+
+#endif
@@ -0,0 +1,480 @@
+// This file defines the storage backends through which an ObjectArchive
+// accesses its files, so that the way data is read and written can be chosen
+// independently of the archive's logic:
+// 1) FileStorage: positional reads and writes of a file descriptor;
+// 2) MmapStorage: same as FileStorage, but reads from a memory map;
+// 3) IoUringStorage: same as FileStorage, but batches of reads are submitted
+//    together through io_uring;
+// 4) MemoryStorage: keeps the contents in memory, without any file.
+//
+// StorageReader and StorageWriter provide buffered sequential access on top of
+// any of them, for parsing and writing many small fields.
+
+#ifndef __STORAGE_HPP__
+#define __STORAGE_HPP__
+
+#include <algorithm>
+#include <boost/predef.h>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if BOOST_OS_UNIX || BOOST_OS_MACOS
+#define STORAGE_POSIX 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "io_uring.hpp"
+
+class Storage {
+  public:
+    virtual ~Storage() { }
+
+    // Opens the file, creating it if it doesn't exist and emptying it if
+    // truncate is set. Returns false if it can't be opened.
+    virtual bool open(std::string const& filename, bool truncate) = 0;
+
+    virtual void close() = 0;
+
+    virtual bool is_open() const = 0;
+
+    virtual size_t size() const = 0;
+
+    // Reads size bytes starting at position. Returns false if they aren't all
+    // in the file.
+    virtual bool read(size_t position, char* data, size_t size) = 0;
+
+    // Writes the data at the position, growing the file if needed. Returns
+    // false on failure.
+    virtual bool write(size_t position, char const* data, size_t size) = 0;
+
+    // Writes the data at the end of the file and stores where in position.
+    virtual bool append(char const* data, size_t size, size_t& position) {
+      position = this->size();
+      return write(position, data, size);
+    }
+
+    // Makes sure that everything written is in the device.
+    virtual bool sync() = 0;
+
+    virtual bool truncate(size_t size) = 0;
+
+    // A read of size bytes starting at position, which is done if successful.
+    struct Range {
+      size_t position;
+      char* data;
+      size_t size;
+      bool done;
+    };
+
+    // Reads every range, returning false if any of them fails. By default,
+    // they are read one at a time.
+    virtual bool read_many(std::vector<Range>& ranges);
+
+    // Copies the contents of another storage, replacing the current ones.
+    bool copy(Storage& other);
+};
+
+class FileStorage: public Storage {
+  public:
+    FileStorage(): fd_(-1) { }
+    virtual ~FileStorage() { close(); }
+
+    virtual bool open(std::string const& filename, bool truncate);
+    virtual void close();
+    virtual bool is_open() const { return fd_ >= 0; }
+    virtual size_t size() const;
+    virtual bool read(size_t position, char* data, size_t size);
+    virtual bool write(size_t position, char const* data, size_t size);
+    virtual bool sync();
+    virtual bool truncate(size_t size);
+
+  protected:
+    int fd_;
+
+  private:
+    // Not implemented
+    FileStorage(FileStorage const& other);
+    FileStorage const& operator=(FileStorage const& other);
+};
+
+class MmapStorage: public FileStorage {
+  public:
+    MmapStorage(): map_(nullptr), map_size_(0) { }
+    virtual ~MmapStorage() { close(); }
+
+    virtual void close();
+    virtual bool read(size_t position, char* data, size_t size);
+    virtual bool truncate(size_t size);
+
+  private:
+    // Maps the whole file again, after it grew.
+    void remap();
+    void unmap();
+
+    char* map_; // nullptr if the file isn't mapped
+    size_t map_size_;
+};
+
+class IoUringStorage: public FileStorage {
+  public:
+    // Keeps up to depth reads in flight.
+    explicit IoUringStorage(unsigned int depth): depth_(depth) { }
+
+    virtual bool open(std::string const& filename, bool truncate);
+    virtual void close();
+    virtual bool read_many(std::vector<Range>& ranges);
+
+  private:
+    unsigned int depth_;
+    IoUring ring_;
+};
+
+class MemoryStorage: public Storage {
+  public:
+    MemoryStorage(): open_(false) { }
+
+    // The file name is ignored and the contents are lost when it's closed.
+    virtual bool open(std::string const& filename, bool truncate);
+    virtual void close();
+    virtual bool is_open() const { return open_; }
+    virtual size_t size() const { return contents_.size(); }
+    virtual bool read(size_t position, char* data, size_t size);
+    virtual bool write(size_t position, char const* data, size_t size);
+    virtual bool sync() { return true; }
+    virtual bool truncate(size_t size);
+
+  private:
+    bool open_;
+    std::string contents_;
+};
+
+// Reads a storage sequentially through a buffer of buffer_size bytes, which
+// should be small if only a few fields are read.
+class StorageReader {
+  public:
+    StorageReader(Storage& storage, size_t position = 0,
+        size_t buffer_size = 1 << 16);
+
+    // Reads the next size bytes. Returns false if they aren't all there.
+    bool read(char* data, size_t size);
+
+    void skip(size_t size) { position_ += size; }
+
+    // Moves to another position, reusing the buffer if it's inside it.
+    void seek(size_t position) { position_ = position; }
+
+    size_t tell() const { return position_; }
+
+  private:
+    Storage& storage_;
+    size_t position_, end_, buffer_size_;
+    std::string buffer_;
+    size_t buffer_position_; // Position of the buffer's first byte
+};
+
+// Writes a storage sequentially through a buffer, which is written when it's
+// full, by flush() and on destruction.
+class StorageWriter {
+  public:
+    StorageWriter(Storage& storage, size_t position = 0);
+    ~StorageWriter() { flush(); }
+
+    bool write(char const* data, size_t size);
+
+    size_t tell() const { return position_ + buffer_.size(); }
+
+    bool flush();
+
+  private:
+    static size_t buffer_size() { return 1 << 16; }
+
+    Storage& storage_;
+    size_t position_; // Position of the buffer's first byte
+    std::string buffer_;
+    bool ok_;
+};
+
+inline bool Storage::read_many(std::vector<Range>& ranges) {
+  bool ok = true;
+  for (auto& range : ranges) {
+    range.done = read(range.position, range.data, range.size);
+    ok = ok && range.done;
+  }
+  return ok;
+}
+
+inline bool Storage::copy(Storage& other) {
+  if (!truncate(0))
+    return false;
+
+  std::string piece;
+  size_t size = other.size();
+  for (size_t done = 0; done < size; done += piece.size()) {
+    piece.resize(std::min<size_t>(1 << 20, size - done));
+    if (!other.read(done, &piece[0], piece.size()) ||
+        !write(done, piece.data(), piece.size()))
+      return false;
+  }
+
+  return true;
+}
+
+#if STORAGE_POSIX
+inline bool FileStorage::open(std::string const& filename, bool truncate) {
+  close();
+  fd_ = ::open(filename.c_str(), O_RDWR | O_CREAT | (truncate ? O_TRUNC : 0),
+      0644);
+  return fd_ >= 0;
+}
+
+inline void FileStorage::close() {
+  if (fd_ >= 0)
+    ::close(fd_);
+  fd_ = -1;
+}
+
+inline size_t FileStorage::size() const {
+  struct stat info;
+  if (fd_ >= 0 && fstat(fd_, &info) == 0)
+    return info.st_size;
+  return 0;
+}
+
+inline bool FileStorage::read(size_t position, char* data, size_t size) {
+  while (size > 0) {
+    ssize_t n = pread(fd_, data, size, position);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+
+    data += n;
+    position += n;
+    size -= n;
+  }
+  return true;
+}
+
+inline bool FileStorage::write(size_t position, char const* data,
+    size_t size) {
+  while (size > 0) {
+    ssize_t n = pwrite(fd_, data, size, position);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+
+    data += n;
+    position += n;
+    size -= n;
+  }
+  return true;
+}
+
+inline bool FileStorage::sync() {
+  return fd_ >= 0 && fsync(fd_) == 0;
+}
+
+inline bool FileStorage::truncate(size_t size) {
+  return fd_ >= 0 && ftruncate(fd_, size) == 0;
+}
+
+inline void MmapStorage::close() {
+  unmap();
+  FileStorage::close();
+}
+
+inline bool MmapStorage::read(size_t position, char* data, size_t size) {
+  // An empty file isn't mapped.
+  if (size == 0)
+    return position <= this->size();
+
+  if (position + size > map_size_)
+    remap();
+  if (position + size > map_size_)
+    return false;
+
+  memcpy(data, map_ + position, size);
+  return true;
+}
+
+inline bool MmapStorage::truncate(size_t size) {
+  // Reading pages of the map beyond the end of the file would crash.
+  unmap();
+  return FileStorage::truncate(size);
+}
+
+inline void MmapStorage::remap() {
+  unmap();
+
+  size_t size = this->size();
+  if (size == 0)
+    return;
+
+  void* map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd_, 0);
+  if (map != MAP_FAILED) {
+    map_ = (char*)map;
+    map_size_ = size;
+  }
+}
+
+inline void MmapStorage::unmap() {
+  if (map_)
+    munmap(map_, map_size_);
+  map_ = nullptr;
+  map_size_ = 0;
+}
+#else
+// Without POSIX files, only MemoryStorage can be used.
+inline bool FileStorage::open(std::string const&, bool) { return false; }
+inline void FileStorage::close() { }
+inline size_t FileStorage::size() const { return 0; }
+inline bool FileStorage::read(size_t, char*, size_t) { return false; }
+inline bool FileStorage::write(size_t, char const*, size_t) { return false; }
+inline bool FileStorage::sync() { return false; }
+inline bool FileStorage::truncate(size_t) { return false; }
+
+inline void MmapStorage::close() { }
+inline bool MmapStorage::read(size_t, char*, size_t) { return false; }
+inline bool MmapStorage::truncate(size_t) { return false; }
+inline void MmapStorage::remap() { }
+inline void MmapStorage::unmap() { }
+#endif
+
+inline bool IoUringStorage::open(std::string const& filename,
+    bool truncate) {
+  if (!FileStorage::open(filename, truncate))
+    return false;
+
+  // Without io_uring, reads are made one at a time.
+  ring_.init(depth_);
+  return true;
+}
+
+inline void IoUringStorage::close() {
+  ring_.close();
+  FileStorage::close();
+}
+
+inline bool IoUringStorage::read_many(std::vector<Range>& ranges) {
+  if (!ring_.is_open())
+    return Storage::read_many(ranges);
+
+  std::vector<IoUring::Request> requests(ranges.size());
+  for (size_t i = 0; i < ranges.size(); i++) {
+    IoUring::Request request = { fd_, ranges[i].position, ranges[i].data,
+      ranges[i].size, 0 };
+    requests[i] = request;
+  }
+
+  bool ok = ring_.read(requests);
+  for (size_t i = 0; i < ranges.size(); i++)
+    ranges[i].done = requests[i].done == ranges[i].size;
+
+  return ok;
+}
+
+inline bool MemoryStorage::open(std::string const&, bool truncate) {
+  open_ = true;
+  if (truncate)
+    contents_.clear();
+  return true;
+}
+
+inline void MemoryStorage::close() {
+  open_ = false;
+  std::string().swap(contents_);
+}
+
+inline bool MemoryStorage::read(size_t position, char* data, size_t size) {
+  if (position > contents_.size() || size > contents_.size() - position)
+    return false;
+
+  memcpy(data, contents_.data() + position, size);
+  return true;
+}
+
+inline bool MemoryStorage::write(size_t position, char const* data,
+    size_t size) {
+  if (position + size > contents_.size())
+    contents_.resize(position + size);
+
+  memcpy(&contents_[position], data, size);
+  return true;
+}
+
+inline bool MemoryStorage::truncate(size_t size) {
+  contents_.resize(size);
+  return true;
+}
+
+inline StorageReader::StorageReader(Storage& storage, size_t position,
+    size_t buffer_size):
+  storage_(storage),
+  position_(position),
+  end_(storage.size()),
+  buffer_size_(buffer_size),
+  buffer_position_(0) { }
+
+inline bool StorageReader::read(char* data, size_t size) {
+  if (position_ > end_ || size > end_ - position_)
+    return false;
+
+  // Large reads don't go through the buffer.
+  if (size >= buffer_size_) {
+    if (!storage_.read(position_, data, size))
+      return false;
+    position_ += size;
+    return true;
+  }
+
+  if (position_ < buffer_position_ ||
+      position_ + size > buffer_position_ + buffer_.size()) {
+    buffer_position_ = position_;
+    buffer_.resize(std::min(buffer_size_, end_ - position_));
+    if (!storage_.read(buffer_position_, &buffer_[0], buffer_.size())) {
+      buffer_.clear();
+      return false;
+    }
+  }
+
+  memcpy(data, buffer_.data() + (position_ - buffer_position_), size);
+  position_ += size;
+  return true;
+}
+
+inline StorageWriter::StorageWriter(Storage& storage, size_t position):
+  storage_(storage),
+  position_(position),
+  ok_(true) { }
+
+inline bool StorageWriter::write(char const* data, size_t size) {
+  if (buffer_.size() + size > buffer_size())
+    flush();
+
+  // Large writes don't go through the buffer.
+  if (size >= buffer_size()) {
+    ok_ = storage_.write(position_, data, size) && ok_;
+    position_ += size;
+  }
+  else
+    buffer_.append(data, size);
+
+  return ok_;
+}
+
+inline bool StorageWriter::flush() {
+  if (buffer_.size()) {
+    ok_ = storage_.write(position_, buffer_.data(), buffer_.size()) && ok_;
+    position_ += buffer_.size();
+    buffer_.clear();
+  }
+  return ok_;
+}
+
+#endif
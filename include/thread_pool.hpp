@@ -0,0 +1,183 @@
+// This file defines a simple pool of threads used by the archive to run
+// independent tasks in parallel, such as compressing the chunks of a large
+// object.
+//
+// The thread calling run() also executes tasks, so a pool without workers just
+// runs them in order. Without ENABLE_THREADS, no thread is ever created.
+//
+// Example:
+// ThreadPool pool(3);
+// pool.run(chunks.size(), [&](size_t i) { process(chunks[i]); });
+
+#ifndef __THREAD_POOL_HPP__
+#define __THREAD_POOL_HPP__
+
+#if ENABLE_THREADS
+#include <boost/thread.hpp>
+#endif
+#include <exception>
+#include <functional>
+
+class ThreadPool {
+  public:
+    // Creates a pool with n_threads workers besides the caller.
+    ThreadPool(unsigned int n_threads);
+
+    // Waits for the workers to finish.
+    ~ThreadPool();
+
+    // Calls task(i) for every i in [0, n_tasks) and returns when all of them
+    // are done. If some task throws, the first exception caught is rethrown
+    // after the others finish.
+    void run(size_t n_tasks, std::function<void(size_t)> const& task);
+
+    // Number of workers besides the caller.
+    unsigned int size() const;
+
+    // Number of workers that makes use of every core.
+    static unsigned int default_size();
+
+  private:
+    // Not implemented
+    ThreadPool(ThreadPool const& other);
+    ThreadPool const& operator=(ThreadPool const& other);
+
+#if ENABLE_THREADS
+    // Main loop of each worker.
+    void worker();
+
+    // Runs tasks from the current batch until there are none left.
+    void work();
+
+    boost::mutex mutex_;
+    boost::mutex run_mutex_; // Only one batch runs at a time
+    boost::condition_variable work_available_, work_done_;
+    boost::thread_group threads_;
+
+    std::function<void(size_t)> const* task_; // Current batch, if any
+    size_t next_task_, n_tasks_, pending_tasks_;
+    std::exception_ptr error_;
+    bool stop_;
+#endif
+    unsigned int n_threads_;
+};
+
+inline ThreadPool::ThreadPool(unsigned int n_threads):
+#if ENABLE_THREADS
+  task_(nullptr),
+  next_task_(0),
+  n_tasks_(0),
+  pending_tasks_(0),
+  stop_(false),
+#endif
+  n_threads_(n_threads) {
+#if ENABLE_THREADS
+    for (unsigned int i = 0; i < n_threads; i++)
+      threads_.create_thread(std::bind(&ThreadPool::worker, this));
+#else
+    n_threads_ = 0;
+#endif
+}
+
+inline ThreadPool::~ThreadPool() {
+#if ENABLE_THREADS
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_available_.notify_all();
+  threads_.join_all();
+#endif
+}
+
+inline void ThreadPool::run(size_t n_tasks,
+    std::function<void(size_t)> const& task) {
+#if ENABLE_THREADS
+  boost::lock_guard<boost::mutex> run_lock(run_mutex_);
+
+  {
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    task_ = &task;
+    next_task_ = 0;
+    n_tasks_ = n_tasks;
+    pending_tasks_ = n_tasks;
+    error_ = std::exception_ptr();
+  }
+  work_available_.notify_all();
+
+  work();
+
+  std::exception_ptr error;
+  {
+    boost::unique_lock<boost::mutex> lock(mutex_);
+    while (pending_tasks_ > 0)
+      work_done_.wait(lock);
+    task_ = nullptr;
+    error = error_;
+  }
+
+  if (error)
+    std::rethrow_exception(error);
+#else
+  for (size_t i = 0; i < n_tasks; i++)
+    task(i);
+#endif
+}
+
+inline unsigned int ThreadPool::size() const {
+  return n_threads_;
+}
+
+inline unsigned int ThreadPool::default_size() {
+#if ENABLE_THREADS
+  unsigned int n = boost::thread::hardware_concurrency();
+  return n > 1 ? n - 1 : 0;
+#else
+  return 0;
+#endif
+}
+
+#if ENABLE_THREADS
+inline void ThreadPool::worker() {
+  while (true) {
+    {
+      boost::unique_lock<boost::mutex> lock(mutex_);
+      while (!stop_ && (task_ == nullptr || next_task_ >= n_tasks_))
+        work_available_.wait(lock);
+      if (stop_)
+        return;
+    }
+
+    work();
+  }
+}
+
+inline void ThreadPool::work() {
+  while (true) {
+    std::function<void(size_t)> const* task;
+    size_t i;
+    {
+      boost::lock_guard<boost::mutex> lock(mutex_);
+      if (task_ == nullptr || next_task_ >= n_tasks_)
+        return;
+      task = task_;
+      i = next_task_++;
+    }
+
+    try {
+      (*task)(i);
+    }
+    catch (...) {
+      boost::lock_guard<boost::mutex> lock(mutex_);
+      if (!error_)
+        error_ = std::current_exception();
+    }
+
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    if (--pending_tasks_ == 0)
+      work_done_.notify_all();
+  }
+}
+#endif
+
+#endif
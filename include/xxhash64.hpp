@@ -0,0 +1,97 @@
+// This file defines the 64 bits xxHash, a fast non-cryptographic hash used by
+// the archive to find objects with the same contents. Its values are the same
+// as the reference implementation's on little endian machines.
+//
+// As with any 64 bits hash, different contents may have the same value, so
+// contents must still be compared when the values match.
+
+#ifndef __XXHASH64_HPP__
+#define __XXHASH64_HPP__
+
+#include <cstdint>
+#include <cstring>
+
+class XXHash64 {
+  public:
+    static uint64_t hash(void const* data, size_t size, uint64_t seed = 0);
+
+  private:
+    static uint64_t prime1() { return 0x9e3779b185ebca87; }
+    static uint64_t prime2() { return 0xc2b2ae3d27d4eb4f; }
+    static uint64_t prime3() { return 0x165667b19e3779f9; }
+    static uint64_t prime4() { return 0x85ebca77c2b2ae63; }
+    static uint64_t prime5() { return 0x27d4eb2f165667c5; }
+
+    static uint64_t rotate(uint64_t value, int bits) {
+      return (value << bits) | (value >> (64 - bits));
+    }
+
+    static uint64_t round(uint64_t acc, uint64_t input) {
+      return rotate(acc + input * prime2(), 31) * prime1();
+    }
+
+    static uint64_t merge(uint64_t acc, uint64_t value) {
+      return (acc ^ round(0, value)) * prime1() + prime4();
+    }
+
+    static uint64_t read64(unsigned char const* p) {
+      uint64_t value;
+      memcpy(&value, p, sizeof(value));
+      return value;
+    }
+
+    static uint32_t read32(unsigned char const* p) {
+      uint32_t value;
+      memcpy(&value, p, sizeof(value));
+      return value;
+    }
+};
+
+inline uint64_t XXHash64::hash(void const* data, size_t size, uint64_t seed) {
+  unsigned char const* p = (unsigned char const*)data;
+  unsigned char const* end = p + size;
+  uint64_t h;
+
+  if (size >= 32) {
+    uint64_t v1 = seed + prime1() + prime2(),
+             v2 = seed + prime2(),
+             v3 = seed,
+             v4 = seed - prime1();
+
+    for (; p + 32 <= end; p += 32) {
+      v1 = round(v1, read64(p));
+      v2 = round(v2, read64(p + 8));
+      v3 = round(v3, read64(p + 16));
+      v4 = round(v4, read64(p + 24));
+    }
+
+    h = rotate(v1, 1) + rotate(v2, 7) + rotate(v3, 12) + rotate(v4, 18);
+    h = merge(h, v1);
+    h = merge(h, v2);
+    h = merge(h, v3);
+    h = merge(h, v4);
+  }
+  else
+    h = seed + prime5();
+
+  h += size;
+
+  for (; p + 8 <= end; p += 8)
+    h = rotate(h ^ round(0, read64(p)), 27) * prime1() + prime4();
+  if (p + 4 <= end) {
+    h = rotate(h ^ (read32(p) * prime1()), 23) * prime2() + prime3();
+    p += 4;
+  }
+  for (; p < end; p++)
+    h = rotate(h ^ (*p * prime5()), 11) * prime1();
+
+  h ^= h >> 33;
+  h *= prime2();
+  h ^= h >> 29;
+  h *= prime3();
+  h ^= h >> 32;
+
+  return h;
+}
+
+#endif
@@ -0,0 +1,392 @@
+// This file defines helpers to compress the data stored in an ObjectArchive
+// directly through zlib, without the setup cost of boost's filtering streams.
+//
+// The streams generated are regular zlib streams, so the data compressed
+// without a dictionary can still be read by boost's zlib_decompressor. If a
+// dictionary is used, zlib marks the stream with the dictionary id (its
+// adler32), which allows decompress() to find the right one among many.
+//
+// A dictionary can be trained from a set of samples, which should be small
+// records similar to the ones that will be compressed. The training picks the
+// segments of the samples that contain the largest number of substrings shared
+// among many samples, placing the most useful ones at the end, as zlib encodes
+// closer matches with fewer bits.
+//
+// Large objects can be split into chunks compressed independently, which
+// allows them to be compressed and decompressed in parallel and each chunk to
+// be read without the others. The chunked data has the format:
+// 1) Chunked magic (uint64_t), whose first byte is never the first one of a
+//    zlib stream;
+// 2) Number of chunks (uint64_t);
+// 3) Uncompressed size of each chunk but the last (uint64_t);
+// 4) Total uncompressed size (uint64_t);
+// 5) Offset of each chunk from the beginning, plus the offset of the end
+//    (uint64_t each);
+// 6) Chunks compressed as regular zlib streams.
+//
+// Errors are reported by throwing boost::iostreams::zlib_error, as it's what
+// boost's filters would throw for the same problem.
+
+#ifndef __ZLIB_CODEC_HPP__
+#define __ZLIB_CODEC_HPP__
+
+#include <boost/iostreams/filter/zlib.hpp>
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <queue>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <zlib.h>
+
+#include "thread_pool.hpp"
+
+class ZlibCodec {
+  public:
+    // Map between dictionary ids and their contents.
+    typedef std::map<uint32_t, std::string> dictionary_map;
+
+    // zlib only looks 32K bytes back, so larger dictionaries are useless.
+    static size_t max_dictionary_size() { return 32768; }
+
+    // Compresses the data, possibly using a dictionary. With level
+    // Z_NO_COMPRESSION, the data is copied in a valid stream as it is.
+    static std::string compress(std::string const& data,
+        std::string const* dictionary = nullptr,
+        int level = Z_DEFAULT_COMPRESSION);
+
+    // Compresses the data in independent chunks of chunk_size bytes, using the
+    // pool's threads if one is provided.
+    static std::string compress_chunked(std::string const& data,
+        size_t chunk_size, ThreadPool* pool = nullptr);
+
+    // Decompresses the data, which may also be chunked. If the stream was
+    // compressed with a dictionary, it must be present in the map provided.
+    static std::string decompress(std::string const& data,
+        dictionary_map const& dictionaries = dictionary_map(),
+        ThreadPool* pool = nullptr);
+
+    // Information about chunked data. The header must have at least
+    // chunked_header_size() bytes from the beginning of the data.
+    static bool is_chunked(std::string const& header);
+    static size_t chunked_header_size() { return 4 * sizeof(uint64_t); }
+    static size_t chunk_count(std::string const& header);
+
+    // Position of the chunk's offset inside the chunked data. The offset of its
+    // end immediately follows it.
+    static size_t chunk_offset_position(size_t chunk);
+
+    // Id that zlib stores in streams compressed with the dictionary.
+    static uint32_t dictionary_id(std::string const& dictionary);
+
+    // Builds a dictionary with at most max_size bytes from the samples.
+    static std::string train_dictionary(std::vector<std::string> const& samples,
+        size_t max_size = max_dictionary_size());
+
+  private:
+    // Size of the substrings counted during training and of the segments
+    // copied to the dictionary.
+    static size_t const dmer_size = 8;
+    static size_t const segment_size = 64;
+
+    static uint64_t dmer_at(char const* data);
+
+    static uint64_t read_uint64(std::string const& data, size_t position);
+
+    // First bytes of chunked data: "\xffCHUNKS" in little endian.
+    static uint64_t chunked_magic() { return 0x534b4e554843ff; }
+};
+
+inline std::string ZlibCodec::compress(std::string const& data,
+    std::string const* dictionary, int level) {
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  if (deflateInit(&strm, level) != Z_OK)
+    throw boost::iostreams::zlib_error(Z_MEM_ERROR);
+
+  if (dictionary && dictionary->size())
+    deflateSetDictionary(&strm, (Bytef const*)dictionary->data(),
+        dictionary->size());
+
+  std::string out;
+  out.resize(deflateBound(&strm, data.size()));
+
+  size_t in_pos = 0, out_pos = 0;
+  int ret;
+  do {
+    // zlib counts with uInt, so huge objects are fed in pieces.
+    if (strm.avail_in == 0) {
+      size_t avail = std::min<size_t>(data.size() - in_pos, UINT_MAX);
+      strm.next_in = (Bytef*)&data[0] + in_pos;
+      strm.avail_in = avail;
+      in_pos += avail;
+    }
+    if (out_pos == out.size())
+      out.resize(out.size() * 2);
+    size_t avail_out = std::min<size_t>(out.size() - out_pos, UINT_MAX);
+    strm.next_out = (Bytef*)&out[0] + out_pos;
+    strm.avail_out = avail_out;
+
+    ret = deflate(&strm, in_pos == data.size() ? Z_FINISH : Z_NO_FLUSH);
+    out_pos += avail_out - strm.avail_out;
+  } while (ret == Z_OK || ret == Z_BUF_ERROR);
+
+  deflateEnd(&strm);
+  if (ret != Z_STREAM_END)
+    throw boost::iostreams::zlib_error(ret);
+
+  out.resize(out_pos);
+  return out;
+}
+
+inline std::string ZlibCodec::compress_chunked(std::string const& data,
+    size_t chunk_size, ThreadPool* pool) {
+  size_t n_chunks = (data.size() + chunk_size - 1) / chunk_size;
+
+  std::vector<std::string> chunks(n_chunks);
+  auto task = [&](size_t i) {
+    size_t begin = i * chunk_size;
+    chunks[i] = compress(data.substr(begin, chunk_size));
+  };
+  if (pool)
+    pool->run(n_chunks, task);
+  else
+    for (size_t i = 0; i < n_chunks; i++)
+      task(i);
+
+  std::vector<uint64_t> header;
+  header.push_back(chunked_magic());
+  header.push_back(n_chunks);
+  header.push_back(chunk_size);
+  header.push_back(data.size());
+
+  uint64_t offset = chunk_offset_position(n_chunks + 1);
+  for (auto const& chunk : chunks) {
+    header.push_back(offset);
+    offset += chunk.size();
+  }
+  header.push_back(offset);
+
+  std::string out;
+  out.reserve(offset);
+  out.append((char const*)&header[0], header.size() * sizeof(uint64_t));
+  for (auto& chunk : chunks) {
+    out.append(chunk);
+    std::string().swap(chunk);
+  }
+
+  return out;
+}
+
+inline std::string ZlibCodec::decompress(std::string const& data,
+    dictionary_map const& dictionaries, ThreadPool* pool) {
+  if (is_chunked(data)) {
+    size_t n_chunks = chunk_count(data);
+    size_t chunk_size = read_uint64(data, 2 * sizeof(uint64_t));
+    size_t size = read_uint64(data, 3 * sizeof(uint64_t));
+
+    // The header is checked before anything is allocated, so that corrupted
+    // sizes can't write out of the output.
+    if (chunk_size == 0 || size == 0 ||
+        n_chunks != (size - 1) / chunk_size + 1 ||
+        n_chunks >= (data.size() - chunked_header_size()) / sizeof(uint64_t))
+      throw boost::iostreams::zlib_error(Z_DATA_ERROR);
+
+    // Chunks follow the offsets in order and aren't empty.
+    std::vector<size_t> offsets(n_chunks + 1);
+    size_t min_offset = chunk_offset_position(n_chunks + 1);
+    for (size_t i = 0; i <= n_chunks; i++) {
+      offsets[i] = read_uint64(data, chunk_offset_position(i));
+      if (offsets[i] < min_offset || offsets[i] > data.size())
+        throw boost::iostreams::zlib_error(Z_DATA_ERROR);
+      min_offset = offsets[i] + 1;
+    }
+
+    std::string out;
+    out.resize(size);
+
+    auto task = [&](size_t i) {
+      std::string chunk = decompress(data.substr(offsets[i],
+            offsets[i + 1] - offsets[i]));
+      if (chunk.size() != std::min(chunk_size, size - i * chunk_size))
+        throw boost::iostreams::zlib_error(Z_DATA_ERROR);
+      memcpy(&out[i * chunk_size], chunk.data(), chunk.size());
+    };
+    if (pool)
+      pool->run(n_chunks, task);
+    else
+      for (size_t i = 0; i < n_chunks; i++)
+        task(i);
+
+    return out;
+  }
+
+  z_stream strm;
+  memset(&strm, 0, sizeof(strm));
+  if (inflateInit(&strm) != Z_OK)
+    throw boost::iostreams::zlib_error(Z_MEM_ERROR);
+
+  std::string out;
+  out.resize(std::max<size_t>(data.size() * 4, 64));
+
+  size_t in_pos = 0, out_pos = 0;
+  int ret;
+  do {
+    if (strm.avail_in == 0 && in_pos < data.size()) {
+      size_t avail = std::min<size_t>(data.size() - in_pos, UINT_MAX);
+      strm.next_in = (Bytef*)&data[0] + in_pos;
+      strm.avail_in = avail;
+      in_pos += avail;
+    }
+    if (out_pos == out.size())
+      out.resize(out.size() * 2);
+    size_t avail_out = std::min<size_t>(out.size() - out_pos, UINT_MAX);
+    strm.next_out = (Bytef*)&out[0] + out_pos;
+    strm.avail_out = avail_out;
+
+    ret = inflate(&strm, Z_NO_FLUSH);
+    out_pos += avail_out - strm.avail_out;
+
+    if (ret == Z_NEED_DICT) {
+      auto it = dictionaries.find(strm.adler);
+      if (it == dictionaries.end())
+        break;
+      ret = inflateSetDictionary(&strm, (Bytef const*)it->second.data(),
+          it->second.size());
+    }
+    // Out of input without reaching the end means the data is truncated.
+    else if (ret == Z_BUF_ERROR && strm.avail_in == 0 &&
+        strm.avail_out != 0 && in_pos == data.size())
+      ret = Z_DATA_ERROR;
+  } while (ret == Z_OK || ret == Z_BUF_ERROR);
+
+  inflateEnd(&strm);
+  if (ret != Z_STREAM_END)
+    throw boost::iostreams::zlib_error(ret);
+
+  out.resize(out_pos);
+  return out;
+}
+
+inline bool ZlibCodec::is_chunked(std::string const& header) {
+  return header.size() >= chunked_header_size() &&
+    read_uint64(header, 0) == chunked_magic();
+}
+
+inline size_t ZlibCodec::chunk_count(std::string const& header) {
+  return read_uint64(header, sizeof(uint64_t));
+}
+
+inline size_t ZlibCodec::chunk_offset_position(size_t chunk) {
+  return chunked_header_size() + chunk * sizeof(uint64_t);
+}
+
+inline uint64_t ZlibCodec::read_uint64(std::string const& data,
+    size_t position) {
+  if (position + sizeof(uint64_t) > data.size())
+    throw boost::iostreams::zlib_error(Z_DATA_ERROR);
+
+  uint64_t value;
+  memcpy(&value, &data[position], sizeof(uint64_t));
+  return value;
+}
+
+inline uint32_t ZlibCodec::dictionary_id(std::string const& dictionary) {
+  uLong id = adler32(0L, Z_NULL, 0);
+  return adler32(id, (Bytef const*)dictionary.data(), dictionary.size());
+}
+
+inline uint64_t ZlibCodec::dmer_at(char const* data) {
+  uint64_t dmer;
+  memcpy(&dmer, data, sizeof(dmer));
+  return dmer;
+}
+
+inline std::string ZlibCodec::train_dictionary(
+    std::vector<std::string> const& samples, size_t max_size) {
+  max_size = std::min(max_size, max_dictionary_size());
+
+  // Number of samples in which each dmer appears. A dmer that appears in a
+  // single sample is only useful if it's the only one.
+  std::unordered_map<uint64_t, size_t> frequency;
+  for (auto const& sample : samples) {
+    std::unordered_set<uint64_t> seen;
+    for (size_t i = 0; i + dmer_size <= sample.size(); i++)
+      if (seen.insert(dmer_at(&sample[i])).second)
+        frequency[dmer_at(&sample[i])]++;
+  }
+  if (samples.size() > 1)
+    for (auto& it : frequency)
+      if (it.second < 2)
+        it.second = 0;
+
+  struct Segment {
+    size_t sample, begin, end, score;
+    bool operator<(Segment const& other) const { return score < other.score; }
+  };
+
+  auto score = [&](Segment const& segment) {
+    std::unordered_set<uint64_t> seen;
+    size_t total = 0;
+    std::string const& sample = samples[segment.sample];
+    for (size_t i = segment.begin; i + dmer_size <= segment.end; i++) {
+      uint64_t dmer = dmer_at(&sample[i]);
+      if (seen.insert(dmer).second)
+        total += frequency[dmer];
+    }
+    return total;
+  };
+
+  std::priority_queue<Segment> candidates;
+  for (size_t s = 0; s < samples.size(); s++)
+    for (size_t begin = 0; begin + dmer_size <= samples[s].size();
+        begin += segment_size / 2) {
+      Segment segment;
+      segment.sample = s;
+      segment.begin = begin;
+      segment.end = std::min(begin + segment_size, samples[s].size());
+      segment.score = score(segment);
+      if (segment.score > 0)
+        candidates.push(segment);
+    }
+
+  // Greedy selection. Scores only decrease as dmers are covered, so a segment
+  // whose updated score is still the best can be taken right away.
+  std::vector<Segment> selected;
+  size_t total_size = 0;
+  while (!candidates.empty() && total_size < max_size) {
+    Segment segment = candidates.top();
+    candidates.pop();
+
+    size_t new_score = score(segment);
+    if (new_score == 0)
+      continue;
+    if (new_score < segment.score) {
+      segment.score = new_score;
+      candidates.push(segment);
+      continue;
+    }
+
+    std::string const& sample = samples[segment.sample];
+    for (size_t i = segment.begin; i + dmer_size <= segment.end; i++)
+      frequency[dmer_at(&sample[i])] = 0;
+
+    segment.end = std::min(segment.end, segment.begin + max_size - total_size);
+    total_size += segment.end - segment.begin;
+    selected.push_back(segment);
+  }
+
+  // The best segments go to the end of the dictionary.
+  std::string dictionary;
+  dictionary.reserve(total_size);
+  for (auto it = selected.rbegin(); it != selected.rend(); ++it)
+    dictionary.append(samples[it->sample], it->begin, it->end - it->begin);
+
+  return dictionary;
+}
+
+#endif
@@ -1,6 +1,9 @@
 #include "object_archive.hpp"
 
+#include <atomic>
+#include <boost/serialization/vector.hpp>
 #include <gtest/gtest.h>
+#include <set>
 
 class ObjectArchiveTest: public ::testing::Test {
   protected:
@@ -17,6 +20,184 @@ class ObjectArchiveTest: public ::testing::Test {
     }
 };
 
+TEST_F(ObjectArchiveTest, AvailableKeys) {
+  for (bool lazy : { false, true }) {
+    {
+      ObjectArchive<size_t> ar;
+      ar.set_lazy_index(lazy);
+      ar.init(filename.string());
+      for (size_t i = 0; i < 100; i++)
+        ar.insert(i, std::to_string(i));
+    }
+
+    ObjectArchive<size_t> ar;
+    ar.set_lazy_index(lazy);
+    ar.init(filename.string());
+    ar.remove(3);
+    ar.change_key(4, 200);
+    ar.insert(201, std::string("new"));
+
+    std::vector<size_t> keys = ar.available_keys();
+    std::sort(keys.begin(), keys.end());
+    EXPECT_EQ(100, keys.size());
+    EXPECT_EQ(2, keys[2]);
+    EXPECT_EQ(5, keys[3]);
+    EXPECT_EQ(200, keys[98]);
+    EXPECT_EQ(201, keys[99]);
+
+    // The keys stay valid while the objects are removed.
+    for (auto key : keys)
+      ar.remove(key);
+    EXPECT_EQ(0, ar.available_keys().size());
+    EXPECT_EQ(100, keys.size());
+    ar.flush();
+  }
+
+  boost::filesystem::remove(filename.string() + ".index");
+}
+
+TEST_F(ObjectArchiveTest, BlobStorage) {
+  std::string large;
+  for (size_t i = 0; large.size() < 100000; i++)
+    large += std::to_string(i * i);
+  std::string blobs = filename.string() + ".blobs";
+
+  size_t s1;
+  {
+    ObjectArchive<size_t> ar;
+    ar.init(filename.string());
+    ar.set_blob_storage(10000);
+    ar.set_checksums(true);
+
+    s1 = ar.insert(0, large);
+    ar.insert(1, std::string("small"));
+  }
+
+  size_t blob_size = boost::filesystem::file_size(blobs);
+  EXPECT_LT(s1, blob_size);
+  EXPECT_GT(s1, boost::filesystem::file_size(filename));
+
+  ObjectArchive<size_t> ar;
+  ar.init(filename.string());
+
+  std::string val;
+  EXPECT_EQ(s1, ar.load(0, val));
+  EXPECT_EQ(large, val);
+  ar.load(1, val);
+  EXPECT_EQ(std::string("small"), val);
+  EXPECT_EQ(0, ar.scrub(-1));
+
+  // Flushing doesn't copy the blobs.
+  ar.insert(2, std::string("other"));
+  ar.flush();
+  EXPECT_EQ(blob_size, boost::filesystem::file_size(blobs));
+
+  // Unless most of the blob file isn't used anymore.
+  ar.insert(0, std::string("replaced"));
+  ar.flush();
+  EXPECT_EQ(sizeof(size_t), boost::filesystem::file_size(blobs));
+
+  // Without blob storage, blobs are moved to the archive's file.
+  ar.insert(0, large);
+  ar.set_blob_storage(0);
+  ar.flush();
+  EXPECT_FALSE(boost::filesystem::exists(blobs));
+  EXPECT_EQ(s1, ar.load(0, val));
+  EXPECT_EQ(large, val);
+}
+
+TEST_F(ObjectArchiveTest, BlockPacking) {
+  size_t n = 1000;
+  auto value = [](size_t i) { return "value " + std::to_string(i); };
+
+  size_t unpacked_size;
+  {
+    ObjectArchive<size_t> ar;
+    ar.init(filename.string());
+    for (size_t i = 0; i < n; i++)
+      ar.insert(i, value(i));
+  }
+  unpacked_size = boost::filesystem::file_size(filename);
+  boost::filesystem::remove(filename);
+
+  std::string large(10000, 'a');
+  {
+    ObjectArchive<size_t> ar;
+    ar.init(filename.string());
+    ar.set_block_packing(1024, 4096);
+    ar.set_checksums(true);
+
+    for (size_t i = 0; i < n; i++)
+      ar.insert(i, value(i));
+    ar.insert(2, large);
+    ar.change_key(0, n);
+    ar.remove(1);
+
+    // Objects are read from their blocks, written or still open.
+    std::string val;
+    for (size_t i = 3; i < n; i++) {
+      ar.load(i, val);
+      EXPECT_EQ(value(i), val);
+    }
+    ar.load(n, val);
+    EXPECT_EQ(value(0), val);
+  }
+
+  EXPECT_GT(unpacked_size, boost::filesystem::file_size(filename));
+
+  ObjectArchive<size_t> ar;
+  ar.init(filename.string());
+
+  std::string val;
+  for (size_t i = 3; i < n; i++) {
+    ar.load(i, val);
+    EXPECT_EQ(value(i), val);
+  }
+  ar.load(n, val);
+  EXPECT_EQ(value(0), val);
+  ar.load(2, val);
+  EXPECT_EQ(large, val);
+  EXPECT_FALSE(ar.is_available(0));
+  EXPECT_FALSE(ar.is_available(1));
+  EXPECT_EQ(0, ar.scrub(-1));
+
+  // Records are found by their slot in the block.
+  RecordBlock block;
+  for (size_t i = 0; i < n; i++)
+    block.add(value(i));
+  std::string contents = block.contents();
+  RecordBlock::get(contents, 10, val);
+  EXPECT_EQ(value(10), val);
+  EXPECT_THROW(RecordBlock::get(contents, n, val),
+      boost::archive::archive_exception);
+}
+
+TEST_F(ObjectArchiveTest, BlockPackingBoundary) {
+  // Objects around the packing limit are either packed or compressed, even
+  // when the stream's header takes them over the limit.
+  size_t n = 100;
+  auto value = [](size_t i) { return std::string(950 + i, 'a'); };
+
+  {
+    ObjectArchive<size_t> ar;
+    ar.init(filename.string());
+    ar.set_block_packing(1024, 4096);
+    for (size_t i = 0; i < n; i++)
+      ar.insert(i, value(i));
+  }
+
+  EXPECT_GT(n * 150, boost::filesystem::file_size(filename));
+
+  ObjectArchive<size_t> ar;
+  ar.init(filename.string());
+
+  std::string val;
+  for (size_t i = 0; i < n; i++) {
+    ar.load(i, val);
+    EXPECT_EQ(value(i), val);
+  }
+}
+
 TEST_F(ObjectArchiveTest, ChangeKey) {
   size_t s1, s2;
   {
@@ -38,6 +219,115 @@ TEST_F(ObjectArchiveTest, ChangeKey) {
   }
 }
 
+TEST_F(ObjectArchiveTest, Checksums) {
+  EXPECT_EQ(0xe3069283, CRC32C::compute("123456789", 9));
+  EXPECT_EQ(0xe3069283, CRC32C::compute_software("123456789", 9));
+  EXPECT_EQ(CRC32C::compute("123456789", 9),
+      CRC32C::compute("6789", 4, CRC32C::compute("12345", 5)));
+
+  std::string large;
+  for (size_t i = 0; large.size() < 100000; i++)
+    large += std::to_string(i);
+  EXPECT_EQ(CRC32C::compute_software(large.data(), large.size()),
+      CRC32C::compute(large.data(), large.size()));
+
+  std::string value(1000, 'a');
+  size_t s1, s2;
+  {
+    ObjectArchive<size_t> ar;
+    ar.init(filename.string());
+    s1 = ar.insert(0, value);
+  }
+
+  // Checksums are added to the existing file.
+  {
+    ObjectArchive<size_t> ar;
+    ar.set_checksums(true);
+    ar.init(filename.string());
+  }
+
+  {
+    ObjectArchive<size_t> ar;
+    ar.init(filename.string());
+
+    std::string val;
+    EXPECT_EQ(s1, ar.load(0, val));
+    EXPECT_EQ(value, val);
+  }
+
+  // Corrupts the last byte of the object.
+  {
+    std::fstream fs(filename.string(),
+        std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+    fs.seekg(-1, std::ios_base::end);
+    char c;
+    fs.read(&c, 1);
+    c ^= 1;
+    fs.seekp(-1, std::ios_base::end);
+    fs.write(&c, 1);
+  }
+
+  ObjectArchive<size_t> ar;
+  ar.init(filename.string());
+
+  std::string val;
+  EXPECT_THROW(ar.load(0, val), ChecksumError);
+  EXPECT_EQ(0, ar.get_buffer_size());
+
+  ar.set_checksum_verification(ObjectArchive<size_t>::verify_none);
+  s2 = ar.load_raw(0, val);
+  EXPECT_EQ(s1, s2);
+}
+
+TEST_F(ObjectArchiveTest, ChunkedCompression) {
+  std::string value;
+  for (size_t i = 0; value.size() < 1000000; i++)
+    value += std::to_string(i * i) + ' ';
+
+  {
+    ObjectArchive<size_t> ar;
+    ar.init(filename.string());
+    ar.set_chunked_compression(1 << 16, 3);
+
+    ar.insert(0, value);
+  }
+
+  ObjectArchive<size_t> ar;
+  ar.init(filename.string());
+  ar.set_chunked_compression(1 << 16, 3);
+
+  std::string val;
+  ar.load(0, val);
+  EXPECT_EQ(value, val);
+
+  std::string chunks, chunk;
+  size_t n_chunks = 0;
+  while (ar.load_chunk(0, n_chunks, chunk)) {
+    EXPECT_GE(1 << 16, chunk.size());
+    chunks += chunk;
+    n_chunks++;
+  }
+  EXPECT_LT(1, n_chunks);
+  EXPECT_EQ(value, chunks.substr(chunks.size() - value.size()));
+
+  // Headers that don't match the chunks are rejected.
+  std::string compressed = ZlibCodec::compress_chunked(value, 1 << 16);
+  auto corrupt = [&](size_t field, uint64_t field_value) {
+    std::string data = compressed;
+    memcpy(&data[field * sizeof(uint64_t)], &field_value, sizeof(uint64_t));
+    EXPECT_THROW(ZlibCodec::decompress(data), boost::iostreams::zlib_error);
+  };
+  corrupt(1, 1000000);
+  corrupt(2, 0);
+  corrupt(2, 1 << 10);
+  corrupt(2, 1 << 20);
+  corrupt(3, 1);
+  corrupt(3, 2 * value.size());
+  corrupt(4, 0);
+  corrupt(5, compressed.size() + 1);
+  corrupt(n_chunks + 4, 0);
+}
+
 TEST_F(ObjectArchiveTest, Clear) {
   size_t s1, s2;
   {
@@ -84,6 +374,314 @@ TEST_F(ObjectArchiveTest, Clear) {
   }
 }
 
+TEST_F(ObjectArchiveTest, CompressedTier) {
+  ObjectArchive<size_t> ar;
+  ar.init(filename.string());
+  ar.set_contiguous_arrays(true);
+  ar.set_buffer_size(5000);
+  ar.set_compressed_tier(1 << 20);
+
+  std::vector<int> array(1000), val;
+  for (size_t i = 0; i < 10; i++) {
+    array[0] = i;
+    ar.insert(i, array);
+  }
+
+  // Objects evicted from the buffer are much smaller in the tier.
+  EXPECT_LT(0, ar.get_compressed_tier_size());
+  EXPECT_GT(9 * array.size() * sizeof(int) / 10,
+      ar.get_compressed_tier_size());
+
+  for (size_t i = 0; i < 9; i++) {
+    ar.load(i, val, false);
+    EXPECT_EQ(i, val[0]);
+  }
+  EXPECT_EQ(9, ar.get_compressed_tier_hits());
+
+  // Objects inserted again don't use the old copy.
+  array[0] = 100;
+  ar.insert(0, array);
+  ar.unload();
+  ar.load(0, val);
+  EXPECT_EQ(100, val[0]);
+  EXPECT_EQ(10, ar.get_compressed_tier_hits());
+
+  // A flush doesn't move the buffer to the tier, but keeps what's there.
+  size_t tier_size = ar.get_compressed_tier_size();
+  ar.flush();
+  EXPECT_EQ(tier_size, ar.get_compressed_tier_size());
+  ar.load(1, val);
+  EXPECT_EQ(1, val[0]);
+  EXPECT_EQ(11, ar.get_compressed_tier_hits());
+
+  ar.set_compressed_tier(0);
+  EXPECT_EQ(0, ar.get_compressed_tier_size());
+  ar.load(2, val);
+  EXPECT_EQ(2, val[0]);
+  EXPECT_EQ(11, ar.get_compressed_tier_hits());
+}
+
+TEST_F(ObjectArchiveTest, ContiguousArrays) {
+  std::vector<double> value(1000);
+  for (size_t i = 0; i < value.size(); i++)
+    value[i] = i / 3.;
+
+  {
+    ObjectArchive<size_t> ar;
+    ar.init(filename.string());
+    ar.set_contiguous_arrays(true);
+
+    EXPECT_EQ(ArrayRecord::header_size() + value.size() * sizeof(double),
+        ar.insert(0, value));
+  }
+
+  for (int enable = 0; enable < 2; enable++) {
+    ObjectArchive<size_t> ar;
+    ar.init(filename.string());
+    ar.set_contiguous_arrays(enable);
+
+    std::vector<double> val;
+    ar.load(0, val);
+    EXPECT_EQ(value, val);
+
+    std::vector<float> wrong_type;
+    EXPECT_THROW(ar.load(0, wrong_type), boost::archive::archive_exception);
+  }
+}
+
+TEST_F(ObjectArchiveTest, Deduplication) {
+  std::string value;
+  for (size_t i = 0; value.size() < 100000; i++)
+    value += std::to_string(i * i);
+
+  size_t s1;
+  {
+    ObjectArchive<size_t> ar;
+    ar.init(filename.string());
+    ar.set_deduplication(true);
+
+    for (size_t i = 0; i < 10; i++)
+      s1 = ar.insert(i, value);
+    ar.insert(0, std::string("other"));
+  }
+
+  // Only one copy of the data is stored.
+  {
+    std::fstream fs(filename.string(),
+        std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+    fs.seekp(0, std::ios_base::end);
+    EXPECT_GT(2 * s1, fs.tellp());
+  }
+
+  ObjectArchive<size_t> ar;
+  ar.init(filename.string());
+  ar.set_buffer_size(10 * s1);
+
+  std::string val;
+  ar.load(0, val);
+  EXPECT_EQ(std::string("other"), val);
+
+  // Loading the same data under another key doesn't use more buffer.
+  ar.load(1, val);
+  size_t buffer_size = ar.get_buffer_size();
+  for (size_t i = 1; i < 10; i++) {
+    EXPECT_EQ(s1, ar.load(i, val));
+    EXPECT_EQ(value, val);
+  }
+  EXPECT_EQ(buffer_size, ar.get_buffer_size());
+}
+
+TEST_F(ObjectArchiveTest, DeltaEncoding) {
+  std::vector<double> value(100000);
+  for (size_t i = 0; i < value.size(); i++)
+    value[i] = i / 3.;
+
+  size_t full_size;
+  {
+    ObjectArchive<size_t> ar;
+    ar.init(filename.string());
+    ar.set_contiguous_arrays(true);
+    ar.set_delta_encoding(4);
+
+    full_size = ar.insert(0, value);
+    for (size_t version = 1; version <= 10; version++) {
+      value[version * 1000] = version;
+      ar.insert(0, value);
+
+      std::vector<double> val;
+      ar.load(0, val);
+      EXPECT_EQ(value, val);
+    }
+
+    // Full copies after the first one and after every 4 deltas.
+    EXPECT_GT(4 * full_size, boost::filesystem::file_size(filename));
+  }
+
+  // Deltas of compressed objects are as small.
+  std::string zlib_filename = filename.string() + ".zlib";
+  {
+    ObjectArchive<size_t> ar;
+    ar.init(zlib_filename);
+    ar.set_delta_encoding(4);
+
+    std::vector<double> zlib_value = value;
+    size_t zlib_size = ar.insert(0, zlib_value);
+    for (size_t version = 1; version <= 10; version++) {
+      zlib_value[version * 2000] = -1. * version;
+      ar.insert(0, zlib_value);
+
+      std::vector<double> val;
+      ar.load(0, val);
+      EXPECT_EQ(zlib_value, val);
+    }
+
+    EXPECT_GT(4 * zlib_size, boost::filesystem::file_size(zlib_filename));
+  }
+  boost::filesystem::remove(zlib_filename);
+
+  std::string base(1000, 'a'), target = base;
+  target.insert(100, "inserted");
+  target[900] = 'b';
+  std::string delta = DeltaCodec::encode(base, target);
+  EXPECT_GT(100, delta.size());
+  EXPECT_EQ(target, DeltaCodec::decode(base, delta, 0, target.size()));
+  EXPECT_THROW(DeltaCodec::decode(base, delta, 0, target.size() + 1),
+      boost::archive::archive_exception);
+
+  ObjectArchive<size_t> ar;
+  ar.init(filename.string());
+
+  std::vector<double> val;
+  EXPECT_EQ(full_size, ar.load(0, val));
+  EXPECT_EQ(value, val);
+}
+
+TEST_F(ObjectArchiveTest, Dictionary) {
+  std::vector<std::string> values;
+  for (size_t i = 0; i < 100; i++)
+    values.push_back("run=" + std::to_string(i % 7) +
+        ";solver=conjugate_gradient;tolerance=1e-9;max_iterations=" +
+        std::to_string(i * 13));
+
+  size_t plain_size = 0, dictionary_size = 0;
+  {
+    ObjectArchive<size_t> ar;
+    ar.init(filename.string());
+
+    for (size_t i = 0; i < values.size(); i++)
+      plain_size += ar.insert(i, values[i]);
+
+    EXPECT_LT(0, ar.train_dictionary());
+
+    for (size_t i = 0; i < values.size(); i++)
+      dictionary_size += ar.insert(i, values[i]);
+  }
+
+  EXPECT_LT(dictionary_size, plain_size);
+
+  {
+    ObjectArchive<size_t> ar;
+    ar.init(filename.string());
+
+    for (size_t i = 0; i < values.size(); i++) {
+      std::string val;
+      ar.load(i, val);
+      EXPECT_EQ(values[i], val);
+    }
+  }
+
+  // Arrays and large objects aren't used as samples.
+  ObjectArchive<size_t> ar;
+  ar.init(filename.string(), true);
+  ar.set_contiguous_arrays(true);
+  ar.set_dictionary_threshold(1000);
+  std::vector<double> array(10, 1);
+  for (size_t i = 0; i < values.size(); i++) {
+    ar.insert(i, values[i]);
+    ar.insert(values.size() + i, array);
+  }
+  ar.insert(2 * values.size(), std::string(100000, 'a'));
+  ar.flush();
+
+  EXPECT_LT(0, ar.train_dictionary());
+  std::vector<double> val;
+  ar.load(values.size(), val);
+  EXPECT_EQ(array, val);
+}
+
+TEST_F(ObjectArchiveTest, DirectIO) {
+  std::string large;
+  for (size_t i = 0; large.size() < 100000; i++)
+    large += std::to_string(i * i);
+  std::string blobs = filename.string() + ".blobs";
+
+  // Unaligned reads of aligned writes, if the file system supports it.
+  bool supported;
+  {
+    DirectFile file;
+    supported = file.open(filename.string(), true);
+    if (supported) {
+      EXPECT_TRUE(file.write(0, large.data(), large.size()));
+      EXPECT_EQ(DirectFile::align(large.size()), file.size());
+
+      std::string val(large.size() - 10, 0);
+      EXPECT_TRUE(file.read(5, &val[0], val.size()));
+      EXPECT_EQ(large.substr(5, val.size()), val);
+      EXPECT_FALSE(file.read(file.size(), &val[0], 1));
+    }
+  }
+  boost::filesystem::remove(filename);
+
+  size_t s1;
+  {
+    ObjectArchive<size_t> ar;
+    ar.init(filename.string());
+    ar.set_blob_storage(10000);
+    ar.set_direct_io(true);
+    ar.set_checksums(true);
+
+    ar.insert(0, large);
+    s1 = ar.insert(1, large + "1");
+  }
+
+  if (supported) {
+    EXPECT_EQ(DirectFile::alignment() + 2 * DirectFile::align(s1),
+        boost::filesystem::file_size(blobs));
+  }
+
+  {
+    ObjectArchive<size_t> ar;
+    ar.init(filename.string());
+    ar.set_direct_io(true);
+
+    std::string val;
+    ar.load(0, val);
+    EXPECT_EQ(large, val);
+    EXPECT_EQ(0, ar.scrub(-1));
+
+    // The blob file is rewritten with direct I/O as well.
+    ar.insert(0, std::string("replaced"));
+    ar.flush();
+    if (supported) {
+      EXPECT_EQ(DirectFile::alignment() + DirectFile::align(s1),
+          boost::filesystem::file_size(blobs));
+    }
+    EXPECT_EQ(s1, ar.load(1, val));
+    EXPECT_EQ(large + "1", val);
+  }
+
+  // Aligned blobs are read without direct I/O too.
+  ObjectArchive<size_t> ar;
+  ar.init(filename.string());
+
+  std::string val;
+  EXPECT_EQ(s1, ar.load(1, val));
+  EXPECT_EQ(large + "1", val);
+
+  ar.set_blob_storage(0);
+  ar.flush();
+}
+
 TEST_F(ObjectArchiveTest, DontKeepInBuffer) {
   size_t s1, s2;
   {
@@ -167,6 +765,105 @@ TEST_F(ObjectArchiveTest, Flush) {
   }
 }
 
+TEST_F(ObjectArchiveTest, ForEach) {
+  for (bool lazy : { false, true }) {
+    {
+      ObjectArchive<size_t> ar;
+      ar.set_lazy_index(lazy);
+      ar.init(filename.string());
+      ar.set_blob_storage(1000);
+      ar.set_checksums(true);
+      for (size_t i = 0; i < 100; i++)
+        ar.insert(i, std::to_string(i * i));
+      ar.insert(100, std::string(10000, 'a'));
+    }
+
+    ObjectArchive<size_t> ar;
+    ar.set_lazy_index(lazy);
+    ar.init(filename.string());
+    ar.set_buffer_size(1 << 20);
+
+    // Objects removed, moved, changed, loaded and not written yet.
+    std::string val;
+    ar.remove(3);
+    ar.change_key(4, 200);
+    ar.insert(5, std::string("changed"));
+    ar.load(6, val);
+    ar.insert(201, std::string("new"));
+    size_t buffer_size = ar.get_buffer_size();
+
+    std::map<size_t, std::string> objects;
+    ar.for_each<std::string>([&](size_t const& key, std::string const& obj) {
+        EXPECT_TRUE(objects.emplace(key, obj).second);
+    });
+
+    EXPECT_EQ(101, objects.size());
+    EXPECT_EQ(0, objects.count(3));
+    EXPECT_EQ(0, objects.count(4));
+    EXPECT_EQ(std::string("16"), objects[200]);
+    EXPECT_EQ(std::string("changed"), objects[5]);
+    EXPECT_EQ(std::string("36"), objects[6]);
+    EXPECT_EQ(std::string("new"), objects[201]);
+    EXPECT_EQ(std::string(10000, 'a'), objects[100]);
+    EXPECT_EQ(std::string("9801"), objects[99]);
+    EXPECT_EQ(buffer_size, ar.get_buffer_size());
+
+    ar.clear();
+  }
+
+  boost::filesystem::remove(filename.string() + ".blobs");
+  boost::filesystem::remove(filename.string() + ".index");
+}
+
+TEST_F(ObjectArchiveTest, Freeze) {
+  std::string frozen = filename.string() + ".frozen";
+  std::string large(10000, 'a');
+  {
+    ObjectArchive<size_t> ar;
+    ar.init(filename.string());
+    ar.set_buffer_size(1000);
+    ar.set_contiguous_arrays(true);
+
+    for (size_t i = 0; i < 1000; i++)
+      ar.insert(i, std::to_string(i * 3));
+    ar.insert(1000, large);
+    ar.insert(1001, std::vector<int>(100, 7));
+    ar.freeze(frozen);
+  }
+
+  FrozenArchive<size_t> ar;
+  ar.open(frozen);
+  EXPECT_EQ(1002, ar.size());
+
+  std::string val;
+  for (size_t i = 0; i < 1000; i++) {
+    EXPECT_TRUE(ar.load(i, val));
+    EXPECT_EQ(std::to_string(i * 3), val);
+  }
+  ar.load(1000, val);
+  EXPECT_EQ(large, val);
+
+  std::vector<int> array;
+  ar.load(1001, array);
+  EXPECT_EQ(std::vector<int>(100, 7), array);
+
+  EXPECT_FALSE(ar.is_available(1002));
+  EXPECT_FALSE(ar.load(1002, val));
+
+  // Records that fit in a page don't cross pages.
+  size_t size;
+  for (size_t i = 0; i < 1000; i++) {
+    size_t offset = (size_t)ar.find(i, size) % 4096;
+    EXPECT_LE(offset + size, 4096);
+  }
+
+  EXPECT_THROW(ar.open(filename.string()),
+      boost::archive::archive_exception);
+  EXPECT_EQ(0, ar.size());
+
+  boost::filesystem::remove(frozen);
+}
+
 TEST_F(ObjectArchiveTest, Insert) {
   size_t s1, s2;
   {
@@ -349,6 +1046,86 @@ TEST_F(ObjectArchiveTest, IsAvailable) {
   EXPECT_TRUE(ar.is_available(id));
 }
 
+TEST_F(ObjectArchiveTest, LazyIndex) {
+  std::string index = filename.string() + ".index";
+  {
+    ObjectArchive<size_t> ar;
+    ar.init(filename.string());
+    ar.set_checksums(true);
+    ar.set_lazy_index(true);
+
+    for (size_t i = 0; i < 100; i++)
+      ar.insert(i, i * 2);
+  }
+  ASSERT_TRUE(boost::filesystem::exists(index));
+
+  // Changes made before the entries are read are kept when they are.
+  for (size_t pass = 0; pass < 2; pass++) {
+    ObjectArchive<size_t> ar;
+    ar.set_lazy_index(true);
+    ar.init(filename.string());
+
+    if (pass == 0) {
+      ar.remove(3);
+      ar.change_key(4, 104);
+      ar.insert(100, (size_t)7);
+      continue;
+    }
+
+    size_t val;
+    EXPECT_FALSE(ar.is_available(3));
+    EXPECT_FALSE(ar.is_available(4));
+    ar.load(104, val);
+    EXPECT_EQ(8, val);
+    ar.load(100, val);
+    EXPECT_EQ(7, val);
+    EXPECT_EQ(100, ar.available_objects().size());
+  }
+
+  // Corrupts the key's checksum of the entry in the index's first used slot,
+  // which only fails when that entry is read.
+  {
+    std::fstream fs(index,
+        std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+    uint64_t record[2] = { 0, 0 };
+    fs.seekg(4 * sizeof(uint64_t));
+    while (record[1] == 0)
+      fs.read((char*)record, sizeof(record));
+
+    std::fstream archive(filename.string(),
+        std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+    archive.seekp(record[1] + 2 * sizeof(size_t));
+    archive.write("\xff\xff\xff\xff", 4);
+  }
+
+  {
+    ObjectArchive<size_t> ar;
+    EXPECT_THROW(ar.init(filename.string()), ChecksumError);
+  }
+
+  ObjectArchive<size_t> ar;
+  ar.set_lazy_index(true);
+  ar.init(filename.string());
+
+  size_t val, n_corrupted = 0;
+  for (size_t i = 0; i < 105; i++) {
+    if (i == 3 || i == 4 || (i > 100 && i < 104))
+      continue;
+
+    try {
+      EXPECT_TRUE(ar.load(i, val));
+      EXPECT_EQ(i == 100 ? 7 : (i % 100) * 2, val);
+    }
+    catch (ChecksumError&) {
+      n_corrupted++;
+    }
+  }
+  EXPECT_EQ(1, n_corrupted);
+  EXPECT_FALSE(ar.is_available(3));
+
+  boost::filesystem::remove(index);
+}
+
 TEST_F(ObjectArchiveTest, Load) {
   size_t s1, s2;
   {
@@ -387,6 +1164,51 @@ TEST_F(ObjectArchiveTest, Load) {
   }
 }
 
+TEST_F(ObjectArchiveTest, LoadMany) {
+  auto value = [](size_t i) { return "value " + std::to_string(i); };
+  std::string large;
+  for (size_t i = 0; large.size() < 100000; i++)
+    large += std::to_string(i * i);
+
+  ObjectArchive<size_t> ar;
+  ar.init(filename.string());
+  ar.set_blob_storage(10000);
+  ar.set_checksums(true);
+
+  std::vector<size_t> keys;
+  size_t total = 0;
+  for (size_t i = 0; i < 100; i++) {
+    total += ar.insert(i, value(i));
+    keys.push_back(99 - i);
+  }
+  total += ar.insert(100, large);
+  keys.push_back(100);
+  keys.push_back(200);
+  ar.flush();
+
+  // Every object is read from the file, with or without io_uring, and then
+  // from the buffer.
+  for (unsigned int depth : { 0, 8 }) {
+    ar.set_io_uring(depth);
+    ar.set_buffer_size(0);
+    ar.set_buffer_size(1000000);
+
+    for (int from_buffer = 0; from_buffer < 2; from_buffer++) {
+      std::vector<std::string> vals;
+      EXPECT_EQ(total, ar.load_many(keys, vals));
+      ASSERT_EQ(keys.size(), vals.size());
+      for (size_t i = 0; i < 100; i++)
+        EXPECT_EQ(value(99 - i), vals[i]);
+      EXPECT_EQ(large, vals[100]);
+      EXPECT_EQ(std::string(), vals[101]);
+      EXPECT_EQ(total, ar.get_buffer_size());
+    }
+  }
+
+  ar.set_blob_storage(0);
+  ar.flush();
+}
+
 TEST_F(ObjectArchiveTest, LoadTooLarge) {
   size_t s1;
   {
@@ -413,6 +1235,158 @@ TEST_F(ObjectArchiveTest, LoadTooLarge) {
   }
 }
 
+TEST_F(ObjectArchiveTest, Memory) {
+  typedef ObjectArchive<size_t> Archive;
+  std::string large(5000, 'a');
+
+  // Any use of the file system would fail without a temporary directory.
+  char const* tmpdir = getenv("TMPDIR");
+  std::string old_tmpdir = tmpdir ? tmpdir : "";
+  setenv("TMPDIR", "/nonexistent/object_archive", 1);
+  {
+    Archive ar(Archive::storage_memory);
+    ar.set_buffer_size(100);
+    ar.set_checksums(true);
+    ar.set_blob_storage(1000);
+
+    for (size_t i = 0; i < 100; i++)
+      ar.insert(i, std::to_string(i));
+    ar.insert(100, large);
+    ar.flush();
+    ar.remove(5);
+    ar.flush();
+
+    std::string val;
+    for (size_t i = 0; i < 100; i++)
+      if (i != 5) {
+        ar.load(i, val);
+        EXPECT_EQ(std::to_string(i), val);
+      }
+    EXPECT_FALSE(ar.is_available(5));
+    ar.load(100, val);
+    EXPECT_EQ(large, val);
+
+    ar.init();
+    EXPECT_FALSE(ar.is_available(0));
+  }
+  if (tmpdir)
+    setenv("TMPDIR", old_tmpdir.c_str(), 1);
+  else
+    unsetenv("TMPDIR");
+
+  // Leaving memory gives the archive a temporary file.
+  Archive ar(Archive::storage_memory);
+  ar.insert(0, large);
+  ar.set_storage(Archive::storage_file);
+  ar.flush();
+
+  std::string val;
+  ar.load(0, val);
+  EXPECT_EQ(large, val);
+
+  // Dropping evicted objects keeps the archive bounded.
+  Archive cache(Archive::storage_memory);
+  cache.set_buffer_size(1000);
+  cache.set_compressed_tier(1000);
+  cache.set_drop_evicted(true);
+  auto value = [](size_t i) { return std::string(100, 'a' + i % 26); };
+  for (size_t i = 0; i < 1000; i++)
+    cache.insert(i, value(i));
+  cache.insert(1000, large);
+  cache.flush();
+
+  EXPECT_GE(1000, cache.get_buffer_size());
+  EXPECT_GE(1000, cache.get_compressed_tier_size());
+  EXPECT_GT(100, cache.available_keys().size());
+  EXPECT_FALSE(cache.is_available(0));
+  EXPECT_EQ(0, cache.load(0, val));
+
+  // The oldest objects left are in the tier and are loaded from there.
+  size_t oldest = 0;
+  while (!cache.is_available(oldest))
+    oldest++;
+  EXPECT_LT(900, oldest);
+  cache.load(oldest, val);
+  EXPECT_EQ(value(oldest), val);
+  EXPECT_EQ(1, cache.get_compressed_tier_hits());
+  cache.load(999, val);
+  EXPECT_EQ(value(999), val);
+  cache.remove(oldest + 1);
+  EXPECT_FALSE(cache.is_available(oldest + 1));
+}
+
+TEST_F(ObjectArchiveTest, ParallelScan) {
+  ObjectArchive<size_t> ar;
+  ar.init(filename.string());
+  for (size_t i = 0; i < 1000; i++)
+    ar.insert(i, std::string(3000, 'a' + i % 26));
+  ar.flush();
+  ar.insert(1000, std::string("new"));
+
+  std::string order;
+  ar.for_each<std::string>([&](size_t const& key, std::string const&) {
+      order += std::to_string(key) + ",";
+  });
+
+  std::atomic<size_t> n_objects(0);
+  ar.parallel_for_each<std::string>(
+      [&](size_t const& key, std::string const& obj) {
+        EXPECT_EQ(key < 1000 ? 3000 : 3, obj.size());
+        n_objects++;
+      });
+  EXPECT_EQ(1001, n_objects);
+
+  // Parts are combined in the order of the file.
+  std::string keys = ar.map_reduce<std::string, std::string>(
+      [](size_t const& key, std::string const&) {
+        return std::to_string(key) + ",";
+      },
+      [](std::string const& a, std::string const& b) { return a + b; },
+      std::string());
+  EXPECT_EQ(order, keys);
+}
+
+TEST_F(ObjectArchiveTest, Range) {
+  ObjectArchive<std::string> ar;
+  ar.init(filename.string());
+  for (size_t run = 0; run < 3; run++)
+    for (size_t i = 0; i < 5; i++)
+      ar.insert("run/" + std::to_string(run) + "/" + std::to_string(i), i);
+  ar.insert("other", 0);
+  ar.flush();
+
+  EXPECT_EQ(16, ar.range("", "z").size());
+  EXPECT_EQ(10, ar.range("run/0/", "run/2/").size());
+  EXPECT_EQ(0, ar.range("run/2/", "run/0/").size());
+
+  std::vector<std::string> keys = ar.prefix("run/1/");
+  std::set<std::string> found(keys.begin(), keys.end());
+  EXPECT_EQ(5, found.size());
+  for (size_t i = 0; i < 5; i++)
+    EXPECT_EQ(1, found.count("run/1/" + std::to_string(i)));
+
+  // Keys are in the order of their objects in the file.
+  std::vector<std::string> order;
+  ar.for_each_raw([&](std::string const& key, std::string const&) {
+      if (key.compare(0, 4, "run/") == 0)
+        order.push_back(key);
+  });
+  EXPECT_EQ(order, ar.prefix("run/"));
+
+  // The index follows the changes made after it's built.
+  ar.remove("run/1/0");
+  ar.change_key("run/1/1", "run/3/1");
+  ar.insert("run/1/5", 5);
+  keys = ar.prefix("run/1/");
+  found = std::set<std::string>(keys.begin(), keys.end());
+  EXPECT_EQ(4, found.size());
+  EXPECT_EQ(0, found.count("run/1/0"));
+  EXPECT_EQ(0, found.count("run/1/1"));
+  EXPECT_EQ(1, found.count("run/1/5"));
+  EXPECT_EQ(std::vector<std::string>(1, "run/3/1"), ar.prefix("run/3/"));
+  EXPECT_EQ(std::string("run/1/5"), ar.prefix("run/1/").back());
+}
+
 TEST_F(ObjectArchiveTest, Remove) {
   size_t s1, s2;
   {
@@ -489,10 +1463,151 @@ TEST_F(ObjectArchiveTest, Reopen) {
   ar.set_buffer_size(100);
 
   auto available = ar.available_objects();
-  if (**available.begin() == 0)
+  if (**available.begin() == 0) {
     EXPECT_EQ(2, **++available.begin());
-  else if (**available.begin() == 2)
+  }
+  else if (**available.begin() == 2) {
     EXPECT_EQ(0, **++available.begin());
+  }
+}
+
+TEST_F(ObjectArchiveTest, Scrub) {
+  {
+    ObjectArchive<size_t> ar;
+    ar.init(filename.string());
+    ar.set_checksums(true);
+
+    for (size_t i = 0; i < 3; i++)
+      ar.insert(i, std::string(1000, 'a' + i));
+  }
+
+  // Corrupts the last byte of the last object.
+  {
+    std::fstream fs(filename.string(),
+        std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+    fs.seekg(-1, std::ios_base::end);
+    char c;
+    fs.read(&c, 1);
+    c ^= 1;
+    fs.seekp(-1, std::ios_base::end);
+    fs.write(&c, 1);
+  }
+
+  size_t corrupted_key = 3;
+  {
+    ObjectArchive<size_t> ar;
+    ar.init(filename.string());
+    ar.set_scrub_callback([&](size_t const& key) { corrupted_key = key; });
+
+    EXPECT_EQ(1, ar.scrub(-1));
+    ASSERT_GT(3, corrupted_key);
+    EXPECT_FALSE(ar.is_available(corrupted_key));
+    EXPECT_EQ(std::list<size_t>(1, corrupted_key), ar.quarantined_objects());
+
+    EXPECT_EQ(0, ar.scrub(-1));
+  }
+
+  ObjectArchive<size_t> ar;
+  ar.init(filename.string());
+  EXPECT_EQ(2, ar.available_objects().size());
+  for (size_t i = 0; i < 3; i++)
+    if (i != corrupted_key) {
+      std::string val;
+      ar.load(i, val);
+      EXPECT_EQ(std::string(1000, 'a' + i), val);
+    }
+  ar.clear();
+
+  // An object inserted again after its quarantine isn't the evicted copy.
+  ar.set_buffer_size(1 << 20);
+  ar.set_compressed_tier(1 << 20);
+  ar.set_checksums(true);
+  ar.insert_raw(0, std::string(1000, 'A'));
+  ar.unload();
+  {
+    std::fstream fs(filename.string(),
+        std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+    fs.seekg(-1, std::ios_base::end);
+    char c;
+    fs.read(&c, 1);
+    c ^= 1;
+    fs.seekp(-1, std::ios_base::end);
+    fs.write(&c, 1);
+  }
+  EXPECT_EQ(1, ar.scrub(-1));
+
+  std::string val;
+  ar.insert_raw(0, std::string(1000, 'B'), false);
+  ar.load_raw(0, val);
+  EXPECT_EQ(std::string(1000, 'B'), val);
+}
+
+TEST_F(ObjectArchiveTest, Storage) {
+  typedef ObjectArchive<size_t> Archive;
+  std::string large(100000, 'a');
+  std::string blobs = filename.string() + ".blobs";
+
+  {
+    Archive ar;
+    ar.init(filename.string());
+    ar.set_storage(Archive::storage_mmap);
+    ar.set_blob_storage(10000);
+
+    for (size_t i = 0; i < 10; i++)
+      ar.insert(i, std::to_string(i));
+    ar.insert(10, large);
+  }
+
+  // Every backend reads the same file and changing it keeps the objects.
+  Archive ar;
+  ar.init(filename.string());
+
+  Archive::StorageBackend backends[] = { Archive::storage_file,
+    Archive::storage_mmap, Archive::storage_io_uring, Archive::storage_memory,
+    Archive::storage_file };
+  std::vector<size_t> keys = { 10, 3, 11, 7 };
+  for (auto backend : backends) {
+    ar.set_storage(backend);
+    ar.insert(11, std::string("other"));
+    ar.flush();
+
+    std::string val;
+    for (size_t i = 0; i < 10; i++) {
+      ar.load(i, val);
+      EXPECT_EQ(std::to_string(i), val);
+    }
+    ar.load(10, val);
+    EXPECT_EQ(large, val);
+
+    std::vector<std::string> vals;
+    ar.load_many(keys, vals);
+    EXPECT_EQ(large, vals[0]);
+    EXPECT_EQ(std::string("3"), vals[1]);
+    EXPECT_EQ(std::string("other"), vals[2]);
+  }
+
+  // Memory doesn't write to the file, whose contents are copied when leaving.
+  ar.set_storage(Archive::storage_memory);
+  size_t size = boost::filesystem::file_size(filename);
+  ar.insert(12, std::string("memory"));
+  ar.flush();
+  EXPECT_EQ(size, boost::filesystem::file_size(filename));
+
+  ar.set_storage(Archive::storage_file);
+  ar.init(filename.string());
+  std::string val;
+  ar.load(12, val);
+  EXPECT_EQ(std::string("memory"), val);
+
+  // An empty file isn't mapped, but reading nothing from it succeeds.
+  MmapStorage empty;
+  ASSERT_TRUE(empty.open(blobs, true));
+  char c;
+  EXPECT_TRUE(empty.read(0, &c, 0));
+  EXPECT_FALSE(empty.read(0, &c, 1));
+  empty.close();
+
+  boost::filesystem::remove(blobs);
 }
 
 TEST_F(ObjectArchiveTest, StringConstructor) {
@@ -523,3 +1638,126 @@ TEST_F(ObjectArchiveTest, StringConstructor) {
   total_size += ObjectArchive<size_t>::serialize((size_t)2).size();
   EXPECT_EQ(total_size, fs.tellp());
 }
+
+TEST_F(ObjectArchiveTest, Tiers) {
+  typedef ObjectArchive<size_t> Archive;
+  std::string slow = filename.string() + ".slow";
+
+  std::vector<std::string> objs;
+  for (size_t i = 0; i < 20; i++)
+    objs.push_back(std::string(200, 'a' + i));
+
+  std::string val;
+  {
+    Archive ar;
+    ar.init(filename.string());
+    ar.set_buffer_size(1 << 20);
+    ar.set_slow_tier(slow, 1000);
+
+    for (size_t i = 0; i < objs.size(); i++)
+      ar.insert_raw(i, objs[i]);
+    for (size_t i = 0; i < 4; i++)
+      ar.load_raw(i, val);
+
+    // Only the 5 most recently used objects fit in the archive's file.
+    ar.flush();
+    EXPECT_TRUE(boost::filesystem::exists(slow));
+    EXPECT_FALSE(boost::filesystem::exists(filename.string() + ".blobs"));
+
+    ar.reset_tier_stats();
+    ar.load_raw(0, val);
+    EXPECT_EQ(objs[0], val);
+    ar.load_raw(19, val);
+    EXPECT_EQ(objs[19], val);
+    ar.load_raw(5, val);
+    EXPECT_EQ(objs[5], val);
+    ar.load_raw(5, val);
+
+    Archive::TierStats stats = ar.get_tier_stats();
+    EXPECT_EQ(1, stats.buffer);
+    EXPECT_EQ(2, stats.file);
+    EXPECT_EQ(1, stats.blob_file);
+
+    // The object loaded from the slow tier was promoted.
+    ar.flush();
+    ar.reset_tier_stats();
+    ar.load_raw(5, val);
+    EXPECT_EQ(objs[5], val);
+    EXPECT_EQ(1, ar.get_tier_stats().file);
+
+    // Objects loaded together from the slow tier are promoted as well, also
+    // when they are read in a single batch.
+    ar.set_io_uring(8);
+    std::vector<size_t> keys = { 6, 7 };
+    std::vector<std::string> many;
+    ar.load_raw_many(keys, many);
+    EXPECT_EQ(objs[6], many[0]);
+    EXPECT_EQ(objs[7], many[1]);
+    EXPECT_EQ(2, ar.get_tier_stats().blob_file);
+
+    ar.flush();
+    ar.reset_tier_stats();
+    ar.load_raw_many(keys, many);
+    EXPECT_EQ(2, ar.get_tier_stats().file);
+  }
+
+  // The slow tier's path is kept in the archive.
+  Archive ar;
+  ar.init(filename.string());
+  for (size_t i = 0; i < objs.size(); i++) {
+    ar.load_raw(i, val, false);
+    EXPECT_EQ(objs[i], val);
+  }
+  Archive::TierStats stats = ar.get_tier_stats();
+  EXPECT_EQ(objs.size(), stats.file + stats.blob_file);
+  EXPECT_LT(0, stats.blob_file);
+
+  boost::filesystem::remove(slow);
+}
+
+TEST_F(ObjectArchiveTest, WarmRestart) {
+  std::string warm = filename.string() + ".warm";
+  {
+    ObjectArchive<size_t> ar;
+    ar.init(filename.string());
+    ar.set_buffer_size(1 << 20);
+    ar.set_warm_restart(true);
+
+    for (size_t i = 0; i < 10; i++)
+      ar.insert_raw(i, std::string(100, 'a' + i));
+    ar.flush();
+
+    std::string val;
+    ar.load_raw(2, val);
+    ar.load_raw(5, val);
+    ar.load_raw(7, val);
+  }
+  EXPECT_TRUE(boost::filesystem::exists(warm));
+
+  // Only the 2 most recently used objects fit in the buffer.
+  ObjectArchive<size_t> ar;
+  ar.init(filename.string());
+  ar.set_buffer_size(250);
+  ar.set_warm_restart(true);
+  EXPECT_EQ(0, ar.get_buffer_size());
+  EXPECT_EQ(2, ar.prefetch_warm());
+  EXPECT_EQ(200, ar.get_buffer_size());
+
+  // The least recently used one is evicted first.
+  std::string val;
+  ar.load_raw(2, val);
+  ar.reset_tier_stats();
+  ar.load_raw(7, val);
+  EXPECT_EQ(std::string(100, 'h'), val);
+  ar.load_raw(5, val);
+  EXPECT_EQ(std::string(100, 'f'), val);
+  EXPECT_EQ(1, ar.get_tier_stats().buffer);
+  EXPECT_EQ(1, ar.get_tier_stats().file);
+
+  // Flushing empties the buffer without loading the saved keys again.
+  ar.set_warm_restart(true, true);
+  ar.flush();
+  EXPECT_EQ(0, ar.get_buffer_size());
+
+  boost::filesystem::remove(warm);
+}
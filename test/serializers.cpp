@@ -0,0 +1,136 @@
+#include "object_archive.hpp"
+
+#include <boost/serialization/list.hpp>
+#include <boost/serialization/vector.hpp>
+#include <gtest/gtest.h>
+
+class SerializersTest: public ::testing::Test {
+  protected:
+    boost::filesystem::path filename;
+
+    virtual void SetUp() {
+      filename = boost::filesystem::temp_directory_path();
+      filename += '/';
+      filename += boost::filesystem::unique_path();
+    }
+
+    virtual void TearDown() {
+      boost::filesystem::remove(filename);
+    }
+};
+
+struct SerializersTestValue {
+  int id;
+  std::vector<double> values;
+  std::map<std::string, std::list<size_t>> groups;
+
+  template<class Archive>
+  void serialize(Archive& ar, const unsigned int version) {
+    ar & id;
+    ar & values;
+    ar & groups;
+  }
+
+  bool operator==(SerializersTestValue const& other) const {
+    return id == other.id && values == other.values && groups == other.groups;
+  }
+};
+
+TEST_F(SerializersTest, Binary) {
+  SerializersTestValue value;
+  value.id = 42;
+  value.values = {1.5, 2.5, 3.5};
+  value.groups["a"] = {1, 2};
+  value.groups["b"] = {3};
+
+  {
+    ObjectArchive<size_t, BinarySerializer> ar;
+    ar.init(filename.string());
+    ar.insert(0, value);
+  }
+
+  ObjectArchive<size_t, BinarySerializer> ar;
+  ar.init(filename.string());
+
+  SerializersTestValue val;
+  EXPECT_LT(0, ar.load(0, val));
+  EXPECT_EQ(value, val);
+
+  typedef ObjectArchive<size_t, BinarySerializer> BinaryArchive;
+  EXPECT_LT(BinaryArchive::serialize(value).size(),
+      ObjectArchive<size_t>::serialize(value).size());
+}
+
+TEST_F(SerializersTest, Raw) {
+  {
+    ObjectArchive<std::string, RawSerializer> ar;
+    ar.init(filename.string());
+    ar.insert("key", std::string("value"));
+  }
+
+  ObjectArchive<std::string, RawSerializer> ar;
+  ar.init(filename.string());
+
+  std::string val;
+  EXPECT_LT(0, ar.load("key", val));
+  EXPECT_EQ(std::string("value"), val);
+}
+
+TEST_F(SerializersTest, Headerless) {
+  typedef ObjectArchive<size_t, HeaderlessBoostSerializer> HeaderlessArchive;
+  EXPECT_LT(HeaderlessArchive::serialize((size_t)0).size(),
+      ObjectArchive<size_t>::serialize((size_t)0).size());
+
+  {
+    HeaderlessArchive ar;
+    ar.init(filename.string());
+    ar.insert(0, std::string("1"));
+  }
+
+  {
+    HeaderlessArchive ar;
+    ar.init(filename.string());
+
+    std::string val;
+    EXPECT_LT(0, ar.load(0, val));
+    EXPECT_EQ(std::string("1"), val);
+  }
+
+  // The format of the objects differs, so the file can't be read.
+  ObjectArchive<size_t> ar;
+  EXPECT_THROW(ar.init(filename.string()), boost::archive::archive_exception);
+}
+
+TEST_F(SerializersTest, Mismatch) {
+  {
+    ObjectArchive<size_t> ar;
+    ar.init(filename.string());
+    ar.insert(7, std::string("value"));
+  }
+
+  // Files written with another serializer can't be read.
+  {
+    ObjectArchive<size_t, BinarySerializer> ar;
+    EXPECT_THROW(ar.init(filename.string()),
+        boost::archive::archive_exception);
+  }
+  {
+    ObjectArchive<size_t, RawSerializer> ar;
+    EXPECT_THROW(ar.init(filename.string()),
+        boost::archive::archive_exception);
+  }
+
+  boost::filesystem::remove(filename);
+  {
+    ObjectArchive<size_t, BinarySerializer> ar;
+    ar.init(filename.string());
+    ar.insert(7, std::string("value"));
+  }
+  {
+    ObjectArchive<size_t, RawSerializer> ar;
+    EXPECT_THROW(ar.init(filename.string()),
+        boost::archive::archive_exception);
+  }
+  ObjectArchive<size_t> ar;
+  EXPECT_THROW(ar.init(filename.string()), boost::archive::archive_exception);
+}
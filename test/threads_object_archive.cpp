@@ -42,3 +42,118 @@ TEST_F(ThreadsObjectArchiveTest, InsertLoad) {
   t1.join();
   t2.join();
 }
+
+TEST_F(ThreadsObjectArchiveTest, ParallelScan) {
+  ObjectArchive<size_t> ar;
+  ar.init(filename.string());
+  for (size_t i = 0; i < 2000; i++)
+    ar.insert(i, std::string(2000, 'a' + i % 26));
+  ar.flush();
+
+  boost::mutex mutex;
+  std::vector<bool> seen(2000, false);
+  ar.parallel_for_each<std::string>(
+      [&](size_t const& key, std::string const& obj) {
+        EXPECT_EQ(std::string(2000, 'a' + key % 26), obj);
+        boost::lock_guard<boost::mutex> lock(mutex);
+        EXPECT_FALSE(seen[key]);
+        seen[key] = true;
+      }, 3);
+  EXPECT_EQ(2000, std::count(seen.begin(), seen.end(), true));
+
+  std::string order;
+  ar.for_each<std::string>([&](size_t const& key, std::string const&) {
+      order += std::to_string(key) + ",";
+  });
+  std::string keys = ar.map_reduce<std::string, std::string>(
+      [](size_t const& key, std::string const&) {
+        return std::to_string(key) + ",";
+      },
+      [](std::string const& a, std::string const& b) { return a + b; },
+      std::string(), 3);
+  EXPECT_EQ(order, keys);
+
+  // An exception stops the scan and leaves the archive usable.
+  EXPECT_THROW(ar.parallel_for_each<std::string>(
+        [](size_t const& key, std::string const&) {
+          if (key == 1000)
+            throw std::runtime_error("stop");
+        }, 3), std::runtime_error);
+
+  std::string val;
+  EXPECT_LT(0, ar.load(1000, val));
+}
+
+TEST_F(ThreadsObjectArchiveTest, Scrubber) {
+  {
+    ObjectArchive<size_t> ar;
+    ar.init(filename.string());
+    ar.set_checksums(true);
+
+    ar.insert(0, std::string(1000, 'a'));
+  }
+
+  // Corrupts the last byte of the object.
+  {
+    std::fstream fs(filename.string(),
+        std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+    fs.seekg(-1, std::ios_base::end);
+    char c;
+    fs.read(&c, 1);
+    c ^= 1;
+    fs.seekp(-1, std::ios_base::end);
+    fs.write(&c, 1);
+  }
+
+  ObjectArchive<size_t> ar;
+  ar.init(filename.string());
+
+  boost::mutex mutex;
+  boost::condition_variable found;
+  bool corrupted = false;
+  ar.set_scrub_callback([&](size_t const&) {
+      boost::lock_guard<boost::mutex> lock(mutex);
+      corrupted = true;
+      found.notify_all();
+    });
+
+  ar.start_scrubber(1 << 20);
+  {
+    boost::unique_lock<boost::mutex> lock(mutex);
+    found.timed_wait(lock, boost::posix_time::seconds(10),
+        [&]() { return corrupted; });
+  }
+  ar.stop_scrubber();
+
+  EXPECT_TRUE(corrupted);
+  EXPECT_FALSE(ar.is_available(0));
+}
+
+TEST_F(ThreadsObjectArchiveTest, WarmRestart) {
+  std::string warm = filename.string() + ".warm";
+  {
+    ObjectArchive<size_t> ar;
+    ar.init(filename.string());
+    ar.set_buffer_size(1 << 20);
+    ar.set_warm_restart(true);
+
+    for (size_t i = 0; i < 1000; i++)
+      ar.insert_raw(i, std::string(100, 'a' + i % 26));
+  }
+
+  // The objects are loaded in the background while the archive is used.
+  ObjectArchive<size_t> ar;
+  ar.set_buffer_size(1 << 20);
+  ar.set_warm_restart(true, true);
+  ar.init(filename.string());
+
+  std::string val;
+  ar.load_raw(500, val);
+  EXPECT_EQ(std::string(100, 'a' + 500 % 26), val);
+
+  for (size_t i = 0; i < 1000 && ar.get_buffer_size() < 100000; i++)
+    boost::this_thread::sleep(boost::posix_time::milliseconds(10));
+  EXPECT_EQ(100000, ar.get_buffer_size());
+
+  boost::filesystem::remove(warm);
+}